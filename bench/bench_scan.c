@@ -0,0 +1,83 @@
+// Throughput of the delimiter scanners and of tokenize_line() on batch-like text.
+// Built against wsh.c itself; WSH_SCAN picks the scanner tokenize_line() uses.
+#define main wsh_main
+#include "../wsh.c"
+#undef main
+
+/// @brief Fill a buffer with command lines of 4 to 12 short words
+/// @param p the buffer
+/// @param len its length
+static void bench_fill(char *p, size_t len)
+{
+    static const char *words[] = {"cp", "-r", "src/main.c", "/tmp/out", "|", "grep", "-v", "x", "&", "make"};
+    size_t i = 0;
+    unsigned r = 1;
+    while (i < len)
+    {
+        int n = 4 + (r = r * 1103515245 + 12345) % 9;
+        for (int w = 0; w < n && i < len; w++)
+        {
+            const char *word = words[(r = r * 1103515245 + 12345) >> 16 & 7];
+            for (const char *c = word; *c && i < len; c++)
+                p[i++] = *c;
+            if (i < len)
+                p[i++] = w + 1 < n ? ' ' : '\n';
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? atol(argv[1]) : 64) << 20;
+    char *text = malloc(size), *work = malloc(size);
+    bench_fill(text, size);
+
+    scan_block_fn scanners[3] = {scan_block_scalar};
+    const char *names[3] = {"scalar", "sse2", "avx2"};
+    int num_scanners = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        scanners[num_scanners++] = scan_block_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        scanners[num_scanners++] = scan_block_avx2;
+#endif
+
+    // block scanners alone, on a fresh copy each time since they overwrite delimiters
+    double scalar_rate = 0;
+    for (int k = 0; k < num_scanners; k++)
+    {
+        memcpy(work, text, size);
+        uint64_t sum = 0, nl;
+        double start = now_seconds();
+        for (size_t i = 0; i + 64 <= size; i += 64)
+            sum += scanners[k](work + i, &nl) ^ nl;
+        double rate = size / (now_seconds() - start) / 1e9;
+        if (k == 0)
+            scalar_rate = rate;
+        printf("scan_block %-7s %6.2f GB/s  %5.1fx scalar  (checksum %llx)\n", names[k], rate,
+               rate / scalar_rate, (unsigned long long)sum);
+    }
+
+    // the whole tokenizer, line by line as the interactive path calls it
+    memcpy(work, text, size);
+    char *argv_buf[4096];
+    int num_pipes, bg;
+    long lines = 0, words = 0;
+    double start = now_seconds();
+    for (char *line = work, *end; line < work + size; line = end + 1)
+    {
+        end = memchr(line, '\n', work + size - line);
+        if (end == NULL)
+            break;
+        *end = '\0';
+        words += tokenize_line(line, argv_buf, 4095, &num_pipes, &bg);
+        lines++;
+    }
+    double secs = now_seconds() - start;
+    printf("tokenize_line (%s): %.2f GB/s, %.1fM lines/s, %ld words\n",
+           getenv("WSH_SCAN") ? getenv("WSH_SCAN") : "default", size / secs / 1e9, lines / secs / 1e6, words);
+    free(text);
+    free(work);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Lines per second of "while read x; do :; done" in wsh, bash and dash.
+# Usage: bench/read_loop.sh [LINES]   (WSH=path/to/wsh, default ./wsh)
+#
+# producer pipe: seq LINES | while ...   (the loop owns the pipe, wsh reads ahead)
+# shared file:   while ... with the shell's stdin redirected from a regular file
+
+lines=${1:-1000000}
+wsh=${WSH:-./wsh}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+seq "$lines" > "$tmp/input"
+echo "seq $lines | while read x; do :; done" > "$tmp/pipe.wsh"
+echo "while read x; do :; done" > "$tmp/file.wsh"
+
+# run a command and print lines per second
+rate()
+{
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v n="$lines" '{ printf "%12.0f", n / ($2 - $1) }'
+}
+
+printf '%-14s %12s %12s %12s\n' "" wsh bash dash
+printf '%-14s %s %s %s\n' "producer pipe" \
+    "$(rate "$wsh" "$tmp/pipe.wsh")" \
+    "$(rate bash -c "seq $lines | while read x; do :; done")" \
+    "$(rate dash -c "seq $lines | while read x; do :; done")"
+printf '%-14s %s %s %s\n' "shared file" \
+    "$(rate sh -c "exec \"$wsh\" \"$tmp/file.wsh\" < \"$tmp/input\"")" \
+    "$(rate sh -c "exec bash -c 'while read x; do :; done' < \"$tmp/input\"")" \
+    "$(rate sh -c "exec dash -c 'while read x; do :; done' < \"$tmp/input\"")"
@@ -0,0 +1,120 @@
+// Differential fuzz test of the delimiter scanners: every block scanner against the scalar one,
+// and tokenize_line() against a byte-at-a-time reference split. Built against wsh.c itself.
+#define main wsh_main
+#include "../wsh.c"
+#undef main
+
+// bytes the inputs are made of: delimiters, their neighbours, operators and high bytes
+static const char alphabet[] = "  \n\nab|&\t\r\x1f!\x80\xa0\xff";
+
+/// @brief Next pseudo-random number (xorshift64, reproducible from the seed)
+/// @param s the state
+/// @return the number
+static uint64_t fuzz_next(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/// @brief Fill a buffer with random bytes from the alphabet, or any byte now and then
+/// @param s the random state
+/// @param p the buffer
+/// @param len its length
+static void fuzz_fill(uint64_t *s, char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        uint64_t r = fuzz_next(s);
+        p[i] = r % 8 == 0 ? (char)(r >> 8) : alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+        // no NUL inside a line, and no $( <( >( that classify_words() would rejoin
+        if (p[i] == '\0' || p[i] == '$' || p[i] == '<' || p[i] == '>')
+            p[i] = 'z';
+    }
+}
+
+/// @brief Split a line the way tokenize_line() must, one byte at a time
+/// @param line the line, delimiters are replaced by NUL
+/// @param argv where to store the words
+/// @param max room in argv
+/// @return number of words
+static int fuzz_reference_split(char *line, char **argv, int max)
+{
+    int n = 0;
+    size_t len = strlen(line);
+    for (size_t i = 0; i < len && n < max; i++)
+    {
+        if (line[i] == ' ' || line[i] == '\n')
+            continue;
+        argv[n++] = line + i;
+        while (i < len && line[i] != ' ' && line[i] != '\n')
+            i++;
+        line[i] = '\0';
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9e3779b97f4a7c15ULL, s = seed;
+    scan_block_fn scanners[] = {scan_block_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+                                scan_block_sse2, NULL
+#endif
+    };
+    const char *names[] = {"scalar", "sse2", "avx2"};
+    int num_scanners = sizeof(scanners) / sizeof(scanners[0]);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanners[2] = scan_block_avx2;
+    else
+        num_scanners = 2;
+#endif
+
+    for (long r = 0; r < rounds; r++)
+    {
+        // one block through every scanner: same masks, same bytes left behind
+        char block[64], ref[64], got[64];
+        uint64_t ref_nl, got_nl;
+        fuzz_fill(&s, block, sizeof(block));
+        memcpy(ref, block, sizeof(block));
+        uint64_t ref_spaces = scan_block_scalar(ref, &ref_nl);
+        for (int k = 1; k < num_scanners; k++)
+        {
+            memcpy(got, block, sizeof(block));
+            uint64_t got_spaces = scanners[k](got, &got_nl);
+            if (got_spaces != ref_spaces || got_nl != ref_nl || memcmp(got, ref, sizeof(got)) != 0)
+            {
+                printf("FAIL: %s differs from scalar in round %ld (seed %#llx)\n", names[k], r,
+                       (unsigned long long)seed);
+                return 1;
+            }
+        }
+
+        // one line of 0..300 bytes through the tokenizer, with the scanner WSH_SCAN picked
+        size_t len = fuzz_next(&s) % 301;
+        char line[len + 1], copy[len + 1];
+        fuzz_fill(&s, line, len);
+        line[len] = '\0';
+        memcpy(copy, line, len + 1);
+        char *words[len + 2], *expect[len + 2];
+        int num_pipes, bg;
+        int n = tokenize_line(line, words, len + 1, &num_pipes, &bg);
+        int m = fuzz_reference_split(copy, expect, len + 1);
+        int same = n == m;
+        for (int i = 0; same && i < n; i++)
+            same = strcmp(words[i], expect[i]) == 0;
+        if (!same)
+        {
+            printf("FAIL: tokenize_line differs from the reference in round %ld (seed %#llx)\n", r,
+                   (unsigned long long)seed);
+            return 1;
+        }
+    }
+    printf("ok: %ld rounds, %d block scanners, tokenizer on %s\n", rounds, num_scanners,
+           getenv("WSH_SCAN") ? getenv("WSH_SCAN") : "the default scanner");
+    return 0;
+}
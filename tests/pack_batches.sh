@@ -0,0 +1,28 @@
+#!/bin/sh
+# pack runs more batches than the job table has slots (256), serially and with -P.
+# Usage: tests/pack_batches.sh   (WSH=path/to/wsh, default ./wsh)
+
+wsh=${WSH:-./wsh}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# 2000 items, 3 per batch: 667 batches
+seq 2000 > "$tmp/items"
+cat > "$tmp/pack.wsh" <<END
+pack -n 3 -a $tmp/items echo
+echo status \$?
+pack -n 3 -P 4 -a $tmp/items echo
+echo status \$?
+pack -n 3 -a $tmp/items false
+echo status \$?
+END
+
+"$wsh" "$tmp/pack.wsh" < /dev/null > "$tmp/out"
+rc=$?
+fail=0
+[ $rc -eq 0 ] || { echo "FAIL: wsh exited $rc"; fail=1; }
+[ "$(grep -c '^[0-9]' "$tmp/out")" -eq 1334 ] || { echo "FAIL: expected 1334 batch lines"; fail=1; }
+[ "$(grep '^status' "$tmp/out" | tr '\n' ' ')" = "status 0 status 0 status 123 " ] ||
+    { echo "FAIL: statuses $(grep '^status' "$tmp/out" | tr '\n' ' ')"; fail=1; }
+[ $fail -eq 0 ] && echo "ok: 3 pack runs of 667 batches"
+exit $fail
@@ -1,15 +1,41 @@
+#define _GNU_SOURCE
 #include "wsh.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <termios.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 typedef struct process
 {
@@ -22,8 +48,27 @@ typedef struct process
     int status;           /* status indicator */
     char completed;       /* completed indicator */
     int dead;             /* dead indicator */
+    int stat_fd;          /* /proc/<pid>/stat kept open by jobs --watch, -1 if not open */
+    unsigned long long cpu_ticks; /* utime + stime at the last jobs --watch sample */
 } process;
 
+// resource controls applied in the child right before exec
+typedef struct spawn_attrs
+{
+    int has_affinity;     /* pin to the cpus in affinity */
+    cpu_set_t affinity;   /* cpu set for sched_setaffinity */
+    int has_nice;         /* adjust niceness */
+    int nice;             /* niceness increment for setpriority */
+    int num_rlimits;      /* number of entries in rlimits */
+    struct
+    {
+        int resource;     /* RLIMIT_* resource */
+        struct rlimit lim; /* soft and hard limit */
+    } rlimits[16];
+    long timeout_ms;      /* deadline enforced by the shell (0 = none) */
+    long kill_after_ms;   /* grace period between SIGTERM and SIGKILL */
+} spawn_attrs;
+
 typedef struct job
 {
     struct job *next;          /* next active job */
@@ -37,12 +82,89 @@ typedef struct job
     int job_id;                /* job id */
     int dead;                  /* dead indicator */
     int piped;                 /* piped job indicator */
+    int queued;                /* waiting for admission indicator */
+    int admitted;              /* passed admission control indicator */
+    int priority;              /* scheduling priority (higher runs first) */
+    unsigned long seq;         /* submission order */
+    spawn_attrs attrs;         /* affinity/nice/rlimits for every process */
+    int timerfd;               /* deadline timer, -1 if none */
+    int timed_out;             /* 1 after SIGTERM, 2 after SIGKILL was sent */
+    int pass_fds[16];          /* <(...) and >(...) pipe ends inherited by the processes */
+    int num_pass_fds;          /* closed in the shell once the processes are started */
+    int own_stdin;             /* stdin is a here-document the shell closes once the processes are started */
+    int64_t start_ns, end_ns;  /* CLOCK_REALTIME when started and when seen done, for the job board */
+    int64_t journal_offset;    /* batch line journaled once this background job is done, -1 if none */
+    int waited;                /* already reported by wait */
+    double record_issued;      /* --record: when this background line was started, -1 once recorded */
+    int owed;                  /* still held after it is done (a control client not told its exit yet, a loop's
+                                  producer, a DAG node, a pack batch): the slot and id stay taken */
 } job;
 
 // array of all jobs
 struct job *jobs[256];
 int curr_id = 0;
 
+// background job admission control (0 disables a threshold)
+int sched_max_jobs = 0;        /* max concurrently running background jobs */
+double sched_max_load = 0;     /* max 1-minute load average */
+long sched_min_mem_kb = 0;     /* min MemAvailable in kB */
+int sched_by_priority = 0;     /* queue order: 0 = fifo, 1 = priority */
+int sched_priority = 0;        /* priority given to newly submitted jobs */
+unsigned long sched_seq = 0;   /* submission counter */
+
+// default spawn attributes set by the nice/taskset/ulimit/timeout builtins
+spawn_attrs shell_attrs;
+
+// exit status of the last foreground job
+int last_status = 0;
+
+// where jobs started from a command line read and write (a pipe or capture file for substitutions)
+int eval_stdin = STDIN_FILENO;
+int eval_stdout = STDOUT_FILENO;
+
+// body of the <<WORD here-document of the line being run, collected by the runner
+char *eval_heredoc = NULL;
+
+// the line being run is the last of a batch file: a simple command may replace the shell
+int eval_exec = 0;
+
+// self-pipe written by the SIGCHLD handler so waiters can poll for reaps
+int sigchld_pipe[2] = {-1, -1};
+
+// --profile: time the current batch line spent forking, in its children and after the last reap
+int profiling = 0;
+double prof_spawn = 0, prof_run = 0, prof_reap = 0, prof_reaped_at = 0;
+
+// WSH_BOARD: the shared-memory job board (see wsh.h), republished by the main thread when board_dirty is set
+wsh_board *board = NULL;
+char board_path[4096];
+volatile sig_atomic_t board_dirty = 0;
+uint64_t board_jobs_started = 0, board_spawns = 0, board_reaps = 0;
+
+void run_job(job *j, int foreground);
+void sched_dispatch();
+int sched_queue_len();
+int sched_running_jobs();
+void drain_sigchld_pipe();
+void check_job_timers();
+void disarm_job_timer(job *j);
+int job_wait_fds(struct pollfd *fds, int fd);
+process *build_pipeline(int argc, char *argv[]);
+job *eval_argv(int cmd_argc, char **cmd_argv, int num_pipes, int bg, char *cmd, int force_bg);
+job *eval_line(char *cmd, int force_bg);
+void grow_array(void *arr, uint32_t *cap, uint32_t need, size_t elem);
+int tokenize_line(char *line, char **argv, int max, int *num_pipes, int *bg);
+char *get_var(const char *name, size_t len);
+void set_var(const char *name, const char *value);
+int run_builtin(int argc, char *argv[]);
+double now_seconds();
+void close_job_stat_fds(job *j);
+void board_sync();
+void journal_reap_job(job *j);
+void journal_reap();
+void record_job(job *j);
+void record_reap();
+
 struct termios shell_tmodes;
 pid_t shell_pgid;
 int shell_terminal;
@@ -97,11 +219,13 @@ int mark_process_status(pid_t pid, int status)
                     if (p->pid == pid)
                     {
                         p->status = status;
+                        board_dirty = 1;
                         if (WIFSTOPPED(status))
                             p->stopped = 1;
                         else
                         {
                             p->completed = 1;
+                            __atomic_fetch_add(&board_reaps, 1, __ATOMIC_RELAXED);
                             // if (WIFSIGNALED(status))
                             //     fprintf(stderr, "%d: Terminated by signal %d.\n",
                             //             (int)pid, WTERMSIG(p->status));
@@ -126,6 +250,54 @@ int mark_process_status(pid_t pid, int status)
     }
 }
 
+/// @brief Wait for a job by polling the SIGCHLD self-pipe, starting queued background jobs meanwhile
+/// @param j job struct pointer
+void wait_for_job_polling(job *j)
+{
+    int status;
+    pid_t pid;
+    process *p;
+
+    while (true)
+    {
+        // collect anything the SIGCHLD handler has not reaped yet, including stops
+        for (p = j->first_process; p; p = p->next)
+        {
+            if (!p->completed && (pid = waitpid(p->pid, &status, WNOHANG | WUNTRACED)) > 0)
+                mark_process_status(pid, status);
+        }
+        if (job_is_stopped(j) || job_is_completed(j))
+            break;
+
+        sched_dispatch();
+
+        struct pollfd fds[1 + 256];
+        int nfds = job_wait_fds(fds, -1);
+        if (poll(fds, nfds, sched_queue_len() > 0 ? 200 : -1) > 0 && (fds[0].revents & POLLIN))
+            drain_sigchld_pipe();
+        check_job_timers();
+    }
+}
+
+/// @brief Compute the shell exit status of a job from its last process
+/// @param j job struct pointer
+/// @return exit code, 128+signal if killed, 124 if the job hit its deadline
+int job_exit_status(job *j)
+{
+    process *p = j->first_process;
+    if (j->timed_out)
+        return 124;
+    if (p == NULL)
+        return 0;
+    while (p->next)
+        p = p->next;
+    if (WIFEXITED(p->status))
+        return WEXITSTATUS(p->status);
+    if (WIFSIGNALED(p->status))
+        return 128 + WTERMSIG(p->status);
+    return 0;
+}
+
 /// @brief Interrupt system to wait for a job to finish
 /// @param j job struct pointer
 void wait_for_job(job *j)
@@ -133,8 +305,13 @@ void wait_for_job(job *j)
     int status;
     pid_t pid;
 
+    // keep the background queue moving, enforce deadlines and keep the job board current while a foreground job runs
+    if (sched_queue_len() > 0 || job_wait_fds(NULL, -1) > 1 || (board && sched_running_jobs() > 0))
+    {
+        wait_for_job_polling(j);
+    }
     // handle piped jobs and regular jobs differently
-    if (j->piped)
+    else if (j->piped)
     {
         do
         {
@@ -150,8 +327,26 @@ void wait_for_job(job *j)
             pid = waitpid(j->pgid, &status, WUNTRACED);
         } while (!mark_process_status(pid, status) && !job_is_stopped(j) && !job_is_completed(j));
     }
+    if (profiling)
+        prof_reaped_at = now_seconds();
 
+    // a stopped job stays in the table as a background job, bg or fg can continue it
+    if (!job_is_completed(j))
+    {
+        j->foreground = 0;
+        last_status = 128 + SIGTSTP;
+        board_dirty = 1;
+        board_sync();
+        return;
+    }
     j->dead = 1;
+
+    disarm_job_timer(j);
+    last_status = job_exit_status(j);
+    board_dirty = 1;
+    board_sync();
+    if (j->timed_out)
+        fprintf(stderr, "wsh: job %d timed out\n", j->job_id);
 }
 
 /// @brief Move a running job to the foreground
@@ -220,6 +415,9 @@ void sigchld_handler(int signum)
                     if (p->pid == pid)
                     {
                         p->dead = 1;
+                        p->completed = 1;
+                        p->status = status;
+                        __atomic_fetch_add(&board_reaps, 1, __ATOMIC_RELAXED);
                     }
                     if (p->dead == 0)
                     {
@@ -234,44 +432,133 @@ void sigchld_handler(int signum)
             }
         }
     }
+
+    // the main thread republishes the job board
+    board_dirty = 1;
+
+    // wake up anyone polling for finished children
+    if (sigchld_pipe[1] >= 0)
+    {
+        int saved_errno = errno;
+        char c = 0;
+        if (write(sigchld_pipe[1], &c, 1) < 0)
+        {
+            // pipe is full, a wakeup is already pending
+        }
+        errno = saved_errno;
+    }
 }
 
-/// @brief Algorithm to return the smallest available id
-/// @return smallest available job id
-int smallest_available_id()
+/// @brief Create the non-blocking self-pipe the SIGCHLD handler writes to
+void init_sigchld_pipe()
 {
-    int smallest_available = 1;
-    int all_null = 1;
+    if (sigchld_pipe[0] >= 0)
+        return;
+    if (pipe(sigchld_pipe) < 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(sigchld_pipe[i], F_SETFL, fcntl(sigchld_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+}
 
-    // iterate over all the jobs
-    for (int i = 0; i < 256; i++)
+/// @brief Empty the SIGCHLD self-pipe after a wakeup
+void drain_sigchld_pipe()
+{
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    board_sync();
+    journal_reap();
+    record_reap();
+}
+
+/// @brief Free a job that left the table: its processes, their words and its command line
+/// @param j job struct pointer
+void free_job(job *j)
+{
+    process *next;
+    for (process *p = j->first_process; p; p = next)
+    {
+        next = p->next;
+        for (int i = 0; i < p->argc - 1; i++)
+            free(p->argv[i]);
+        free(p->argv);
+        free(p->name);
+        free(p);
+    }
+    disarm_job_timer(j);
+    free(j->command);
+    free(j);
+}
+
+/// @brief Store a job in the first free slot of the jobs array, reusing (and freeing) slots of dead jobs
+/// @param j job struct pointer
+void add_job(job *j)
+{
+    struct pollfd pfd;
+
+    while (true)
     {
-        // if an index in the jobs array is populated, if the job is alive
-        // if the job's id is not smaller than the tracker
-        if (jobs[i] != NULL && (jobs[i]->dead == 0) && !(jobs[i]->job_id < smallest_available))
+        for (int n = 0; n < 256; n++)
         {
-            // found a non-null
-            if (all_null)
-                all_null = 0;
-            // if the id is equal, increment and continue search
-            if (jobs[i]->job_id == smallest_available)
-            {
-                smallest_available += 1;
-            }
-            // if there is no equal, it is the smallest
-            else
+            int i = (curr_id + n) % 256;
+            if (jobs[i] == NULL || (jobs[i]->dead && !jobs[i]->owed))
             {
-                return smallest_available;
+                // the SIGCHLD handler walks the table: the slot points at the new job before the old one goes
+                job *old = jobs[i];
+                if (old != NULL)
+                {
+                    journal_reap_job(old);
+                    record_job(old);
+                    close_job_stat_fds(old);
+                }
+                jobs[i] = j;
+                if (old != NULL)
+                    free_job(old);
+                curr_id = (i + 1) % 256;
+                return;
             }
         }
+
+        // the table is full: apply back-pressure until a background job finishes
+        sched_dispatch();
+        pfd.fd = sigchld_pipe[0];
+        pfd.events = POLLIN;
+        if (sigchld_pipe[0] < 0 || sched_running_jobs() == 0)
+        {
+            fprintf(stderr, "wsh: too many jobs\n");
+            exit(1);
+        }
+        if (poll(&pfd, 1, 200) > 0)
+            drain_sigchld_pipe();
     }
-    // all entries are null -> return 1
-    if (all_null)
+}
+
+/// @brief Algorithm to return the smallest available id
+/// @return smallest available job id
+int smallest_available_id()
+{
+    // jobs are not stored in id order (slots get reused), so check every candidate id
+    for (int id = 1;; id++)
     {
-        return 1;
+        int taken = 0;
+        for (int i = 0; i < 256 && !taken; i++)
+        {
+            if (jobs[i] != NULL && (jobs[i]->dead == 0 || jobs[i]->owed) && jobs[i]->job_id == id)
+            {
+                taken = 1;
+            }
+        }
+        if (!taken)
+        {
+            return id;
+        }
     }
-
-    return smallest_available;
 }
 
 /// @brief Algorithm to find the largest id currently in use
@@ -324,398 +611,6363 @@ int reverse_array(char *arr[], int n)
 }
 
 /*
- * BUILT IN COMMANDS
+ * BACKGROUND JOB SCHEDULING
  */
 
-/// @brief command to exit the program
-void wsh_exit()
+/// @brief Read the 1-minute load average from /proc/loadavg (fd is kept open and re-read with pread)
+/// @return load average, or -1 if unavailable
+double read_loadavg()
 {
-    exit(0);
+    static int fd = -1;
+    char buf[128];
+
+    if (fd < 0 && (fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return strtod(buf, NULL);
 }
 
-/// @brief command to implement cd  (changing directories)
-/// @param argc the argument count
-/// @param argv the argument vector
-void wsh_cd(int argc, char *argv[])
+/// @brief Read MemAvailable from /proc/meminfo (fd is kept open and re-read with pread)
+/// @return available memory in kB, or -1 if unavailable
+long read_mem_available_kb()
 {
-    // decrement argc to get rid of null termination
-    argc -= 1;
-    if (argc != 2)
+    static int fd = -1;
+    char buf[4096];
+
+    if (fd < 0 && (fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    char *field = strstr(buf, "MemAvailable:");
+    if (field == NULL)
+        return -1;
+    return strtol(field + strlen("MemAvailable:"), NULL, 10);
+}
+
+/// @brief Count the background jobs that have been started and are still alive
+/// @return number of running background jobs
+int sched_running_jobs()
+{
+    int running = 0;
+    for (int i = 0; i < 256; i++)
     {
-        printf("USAGE: cd dir\n");
+        if (jobs[i] != NULL && jobs[i]->dead == 0 && jobs[i]->foreground == 0 && !jobs[i]->queued)
+        {
+            running += 1;
+        }
     }
-    else
+    return running;
+}
+
+/// @brief Count the background jobs waiting for admission
+/// @return number of queued jobs
+int sched_queue_len()
+{
+    int queued = 0;
+    for (int i = 0; i < 256; i++)
     {
-        // change directories
-        if (chdir(argv[1]) != 0)
+        if (jobs[i] != NULL && jobs[i]->queued)
         {
-            printf("Error: chdir to %s failed.\n", argv[1]);
+            queued += 1;
         }
     }
+    return queued;
 }
 
-/// @brief command to display all in progress background jobs (in order by job id) in the following format:
-/// <id>: <program name> <arg1> <arg2> … <argN> [&]
-void wsh_jobs()
+/// @brief Check whether any job is still queued, running or stopped
+/// @return true if some job is not dead
+int jobs_pending()
 {
-    process *p;
+    for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL && jobs[i]->dead == 0)
+            return 1;
+    return 0;
+}
 
-    int largest_id = get_largest_id();
-    int local_job_id = 1;
+/// @brief Return true if any admission threshold is configured
+/// @return scheduler enabled indicator
+int sched_enabled()
+{
+    return sched_max_jobs > 0 || sched_max_load > 0 || sched_min_mem_kb > 0;
+}
 
-    // continue to iterate over all jobs until we have printed the largest id
-    while (local_job_id <= largest_id)
+/// @brief Check the running count, load average and available memory against the thresholds
+/// @return true if another background job may start now
+int sched_has_capacity()
+{
+    int running = sched_running_jobs();
+
+    if (sched_max_jobs > 0 && running >= sched_max_jobs)
+        return 0;
+    // the load average lags by up to a minute, so only apply it while our own jobs contribute to it
+    if (sched_max_load > 0 && running > 0)
     {
-        // iterate over all jobs
-        for (int i = 0; i < 256; i++)
-        {
-            // if the index of the jobs array is populated and the job is alive
-            // if the job is a background job
-            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->foreground == 0)
-            {
-                // if the job id is the current id we need
-                if (jobs[i]->job_id == local_job_id)
-                {
-                    // print out the contents
-                    printf("%d: ", jobs[i]->job_id);
-                    int num_proc = 0;
-                    for (p = jobs[i]->first_process; p; p = p->next)
-                    {
-                        if (num_proc == 0)
-                        {
-                            printf("%s ", p->name);
-                            for (int i = 1; i < p->argc - 1; i++)
-                            {
-                                printf("%s ", p->argv[i]);
-                            }
-                            num_proc += 1;
-                        }
-                        else
-                        {
-                            printf("| ");
-                            printf("%s ", p->name);
-                            for (int i = 1; i < p->argc - 1; i++)
-                            {
-                                printf("%s ", p->argv[i]);
-                            }
-                        }
-                    }
-                    printf("& ");
-                    printf("\n");
-                    break;
-                }
-            }
-        }
-        // increment the job id we need and repeat search
-        local_job_id += 1;
+        double load = read_loadavg();
+        if (load >= 0 && load >= sched_max_load)
+            return 0;
+    }
+    if (sched_min_mem_kb > 0)
+    {
+        long avail = read_mem_available_kb();
+        if (avail >= 0 && avail < sched_min_mem_kb)
+            return 0;
     }
+    return 1;
 }
 
-/// @brief fg should move a process from the background to the foreground
-/// @param argc the argument count
-/// @param argv the argument vector
-void wsh_fg(int argc, char *argv[])
+/// @brief Decide whether a newly submitted background job may start right away
+/// @param j job struct pointer
+/// @return true if the job is admitted, false if it has to be queued
+int sched_admit(job *j)
 {
-    argc -= 1;
-    // id was provided
-    if (argc == 2)
+    // never let a new job overtake jobs that are already waiting
+    if (sched_queue_len() > 0 || !sched_has_capacity())
+        return 0;
+    j->admitted = 1;
+    return 1;
+}
+
+/// @brief Pick the next queued job: highest priority first (priority policy), then submission order
+/// @return job struct pointer or NULL if the queue is empty
+job *sched_next()
+{
+    job *best = NULL;
+    for (int i = 0; i < 256; i++)
     {
-        // iterate over all jobs
-        for (int i = 0; i < 256; i++)
+        job *j = jobs[i];
+        if (j == NULL || !j->queued)
+            continue;
+        if (best == NULL ||
+            (sched_by_priority && j->priority > best->priority) ||
+            ((!sched_by_priority || j->priority == best->priority) && j->seq < best->seq))
         {
-            // if the index of the jobs array is populated and the job is alive
-            // if the job id is equal to the provided id
-            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->job_id == atoi(argv[1]))
-            {
-                /* Put the job into the foreground.  */
-                tcsetpgrp(shell_terminal, jobs[i]->pgid);
+            best = j;
+        }
+    }
+    return best;
+}
 
-                /* Wait for it to report.  */
-                wait_for_job(jobs[i]);
+/// @brief Start queued background jobs while there is capacity
+void sched_dispatch()
+{
+    job *j;
 
-                /* Put the shell back in the foreground.  */
-                tcsetpgrp(shell_terminal, shell_pgid);
+    check_job_timers();
+    while ((j = sched_next()) != NULL && sched_has_capacity())
+    {
+        j->queued = 0;
+        j->admitted = 1;
+        run_job(j, 0);
+    }
+    board_sync();
+}
 
-                /* Restore the shell’s terminal modes.  */
-                tcgetattr(shell_terminal, &jobs[i]->tmodes);
-                tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
-                return;
-            }
+/// @brief Fill a poll set with the SIGCHLD self-pipe, an optional extra fd and every armed job deadline timer
+/// @param fds poll set with room for 2 + 256 entries, or NULL to only count
+/// @param fd extra file descriptor placed at index 1 (-1 for none)
+/// @return number of entries
+int job_wait_fds(struct pollfd *fds, int fd)
+{
+    int nfds = 0;
+
+    if (fds)
+    {
+        fds[nfds].fd = sigchld_pipe[0];
+        fds[nfds].events = POLLIN;
+    }
+    nfds++;
+    if (fd >= 0)
+    {
+        if (fds)
+        {
+            fds[nfds].fd = fd;
+            fds[nfds].events = POLLIN;
         }
+        nfds++;
     }
-    // use most recent id
-    else if (argc == 1)
+    for (int i = 0; i < 256; i++)
     {
-        // iterate over all jobs
-        for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL && jobs[i]->timerfd >= 0)
         {
-            // if the index of the jobs array is populated and the job is alive
-            if (jobs[i] != NULL && (jobs[i]->dead == 0))
+            if (fds)
             {
-                /* Put the job into the foreground.  */
-                tcsetpgrp(shell_terminal, jobs[i]->pgid);
-
-                /* Wait for it to report.  */
-                wait_for_job(jobs[i]);
-
-                /* Put the shell back in the foreground.  */
-                tcsetpgrp(shell_terminal, shell_pgid);
-
-                /* Restore the shell’s terminal modes.  */
-                tcgetattr(shell_terminal, &jobs[i]->tmodes);
-                tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
-                return;
+                fds[nfds].fd = jobs[i]->timerfd;
+                fds[nfds].events = POLLIN;
             }
+            nfds++;
         }
     }
-    else
+    return nfds;
+}
+
+/// @brief Keep dispatching queued jobs and enforcing deadlines of background jobs until fd becomes readable
+/// @param fd file descriptor to wait on (-1 to wait until nothing is queued or under a deadline)
+void sched_wait(int fd)
+{
+    struct pollfd fds[2 + 256];
+
+    while (true)
     {
-        printf("USAGE: fg [job_id]\n");
+        sched_dispatch();
+        int queued = sched_queue_len();
+        int nfds = job_wait_fds(fds, fd);
+        if (queued == 0 && nfds == (fd >= 0 ? 2 : 1))
+            return;
+
+        // time out periodically to re-sample load and memory
+        int n = poll(fds, nfds, queued > 0 ? 200 : -1);
+        if (n > 0 && (fds[0].revents & POLLIN))
+            drain_sigchld_pipe();
+        if (n > 0 && fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP)))
+            return;
     }
 }
 
-/// @brief bg should resume a process in the background - or run any suspended job in the background (!!!CURRENTLY BROKEN)
-/// @param argc the argument count
-/// @param argv the argument array
-void wsh_bg(int argc, char *argv[])
+/*
+ * JOB BOARD
+ */
+
+/// @brief Nanoseconds on the real-time clock, for timestamps other processes read
+/// @return time in nanoseconds since the epoch
+int64_t realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// @brief Remove the board file when the shell that created it exits
+void board_close()
+{
+    if (board != NULL && board->shell_pid == getpid())
+        unlink(board_path);
+}
+
+/// @brief Create the job board if WSH_BOARD is set: the path it names, or /dev/shm/wsh-<pid>
+void board_open()
+{
+    char *env = getenv("WSH_BOARD");
+    if (env == NULL)
+        return;
+    // the default name is predictable: another user must not get us to follow a symlink or reuse a
+    // file they created, so it is always a new file; a path the user chose is truncated
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+    if (strchr(env, '/'))
+    {
+        snprintf(board_path, sizeof(board_path), "%s", env);
+        flags |= O_TRUNC;
+    }
+    else
+    {
+        snprintf(board_path, sizeof(board_path), "/dev/shm/wsh-%d", getpid());
+        flags |= O_EXCL | O_NOFOLLOW;
+    }
+
+    // command lines are private to the user
+    int fd = open(board_path, flags, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(wsh_board)) < 0)
+    {
+        perror(board_path);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    void *map = mmap(NULL, sizeof(wsh_board), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+
+    // the magic goes in last, readers ignore a board without it
+    board = map;
+    board->version = WSH_BOARD_VERSION;
+    board->shell_pid = getpid();
+    board->start_ns = realtime_ns();
+    board->num_jobs = WSH_BOARD_JOBS;
+    board->procs_per_job = WSH_BOARD_PROCS;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(board->magic, WSH_BOARD_MAGIC, 4);
+    atexit(board_close);
+    board_dirty = 1;
+    board_sync();
+}
+
+/// @brief Publish the job table if it changed since the last time
+/// Called from the main thread only: the SIGCHLD handler just sets board_dirty, so there is one writer
+void board_sync()
+{
+    if (board == NULL || !board_dirty)
+        return;
+    board_dirty = 0;
+
+    // seqlock: odd while the board is being written
+    uint32_t seq = board->seq;
+    __atomic_store_n(&board->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int64_t now = realtime_ns();
+    for (int i = 0; i < WSH_BOARD_JOBS; i++)
+    {
+        wsh_board_job *b = &board->jobs[i];
+        job *j = jobs[i];
+        if (j == NULL)
+        {
+            b->job_id = 0;
+            b->state = WSH_BOARD_FREE;
+            continue;
+        }
+
+        int done = j->dead || job_is_completed(j);
+        if (done && j->end_ns == 0)
+            j->end_ns = now;
+        b->job_id = j->job_id;
+        b->pgid = j->pgid;
+        b->state = j->queued ? WSH_BOARD_QUEUED : done ? WSH_BOARD_DONE : job_is_stopped(j) ? WSH_BOARD_STOPPED
+                                                                                           : WSH_BOARD_RUNNING;
+        b->foreground = j->foreground;
+        b->exit_status = done ? job_exit_status(j) : -1;
+        b->start_ns = j->start_ns;
+        b->end_ns = j->end_ns;
+        snprintf(b->command, sizeof(b->command), "%s", j->command ? j->command : "");
+
+        int n = 0;
+        for (process *p = j->first_process; p; p = p->next, n++)
+        {
+            if (n >= WSH_BOARD_PROCS)
+                continue;
+            wsh_board_proc *bp = &b->procs[n];
+            bp->pid = p->pid;
+            bp->status = p->status;
+            bp->state = p->completed ? WSH_BOARD_DONE : p->stopped ? WSH_BOARD_STOPPED
+                        : p->pid     ? WSH_BOARD_RUNNING
+                                     : WSH_BOARD_QUEUED;
+        }
+        b->num_procs = n;
+    }
+    board->jobs_started = board_jobs_started;
+    board->spawns = board_spawns;
+    board->reaps = __atomic_load_n(&board_reaps, __ATOMIC_RELAXED);
+    board->updated_ns = now;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&board->seq, seq + 2, __ATOMIC_RELAXED);
+}
+
+/*
+ * JOB DEADLINES
+ */
+
+/// @brief Parse a duration such as 10, 1.5s, 500ms, 2m, 1h or 1d
+/// @param s the duration string (seconds if no unit is given)
+/// @param ms where to store the duration in milliseconds
+/// @return 0 on success, -1 on a malformed duration
+int parse_duration_ms(char *s, long *ms)
+{
+    char *end;
+    double value = strtod(s, &end);
+    double scale = 1000;
+
+    if (end == s || value < 0)
+        return -1;
+    if (strcmp(end, "ms") == 0)
+        scale = 1;
+    else if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+        scale = 1000;
+    else if (strcmp(end, "m") == 0)
+        scale = 60 * 1000;
+    else if (strcmp(end, "h") == 0)
+        scale = 60 * 60 * 1000;
+    else if (strcmp(end, "d") == 0)
+        scale = 24 * 60 * 60 * 1000;
+    else
+        return -1;
+    *ms = (long)(value * scale);
+    return 0;
+}
+
+/// @brief Arm a one-shot timerfd
+/// @param fd the timerfd
+/// @param ms milliseconds until it fires
+void arm_timer(int fd, long ms)
+{
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    // a zero it_value would disarm the timer
+    if (ms <= 0)
+        its.it_value.tv_nsec = 1;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+/// @brief Start the deadline timer of a job that was just launched
+/// @param j job struct pointer
+void arm_job_timer(job *j)
+{
+    if (j->attrs.timeout_ms <= 0)
+        return;
+    j->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (j->timerfd < 0)
+    {
+        perror("timerfd_create");
+        return;
+    }
+    arm_timer(j->timerfd, j->attrs.timeout_ms);
+}
+
+/// @brief Close the deadline timer of a job
+/// @param j job struct pointer
+void disarm_job_timer(job *j)
+{
+    if (j->timerfd >= 0)
+    {
+        close(j->timerfd);
+        j->timerfd = -1;
+    }
+}
+
+/// @brief Send a signal to every process of a job (through its process group if it has one)
+/// @param j job struct pointer
+/// @param sig the signal
+void signal_job(job *j, int sig)
+{
+    if (kill(-j->pgid, sig) == 0)
+        return;
+    for (process *p = j->first_process; p; p = p->next)
+        if (p->pid > 0 && !p->completed)
+            kill(p->pid, sig);
+}
+
+/// @brief Escalate jobs whose deadline passed: SIGTERM first, SIGKILL after the grace period
+void check_job_timers()
+{
+    uint64_t expirations;
+
+    for (int i = 0; i < 256; i++)
+    {
+        job *j = jobs[i];
+        if (j == NULL || j->timerfd < 0)
+            continue;
+        if (j->dead || job_is_completed(j))
+        {
+            // background jobs are reported here, foreground ones by wait_for_job
+            if (j->timed_out && !j->foreground)
+                fprintf(stderr, "wsh: job %d timed out\n", j->job_id);
+            disarm_job_timer(j);
+            continue;
+        }
+        if (read(j->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            continue;
+
+        if (j->timed_out == 0)
+        {
+            j->timed_out = 1;
+            signal_job(j, SIGTERM);
+            signal_job(j, SIGCONT);
+            arm_timer(j->timerfd, j->attrs.kill_after_ms);
+        }
+        else
+        {
+            j->timed_out = 2;
+            signal_job(j, SIGKILL);
+        }
+    }
+}
+
+/*
+ * JOB MONITOR
+ */
+
+// one sample of /proc/<pid>/stat
+typedef struct proc_sample
+{
+    char state;               /* R, S, D, T, Z, ... or ? when the process could not be read */
+    unsigned long long ticks; /* utime + stime */
+    unsigned long long start; /* start time in ticks since boot */
+    long rss_pages;           /* resident set size */
+} proc_sample;
+
+/// @brief Close the /proc descriptors kept open for the processes of a job
+/// @param j job struct pointer
+void close_job_stat_fds(job *j)
+{
+    for (process *p = j->first_process; p; p = p->next)
+    {
+        if (p->stat_fd >= 0)
+            close(p->stat_fd);
+        p->stat_fd = -1;
+    }
+}
+
+/// @brief Sample a process through its /proc/<pid>/stat descriptor, opened once and read again with pread
+/// @param p the process
+/// @param s where to store the sample
+/// @return 0 on success, -1 if the process is gone or could not be read
+int proc_sample_read(process *p, proc_sample *s)
+{
+    char buf[1024];
+
+    s->state = '?';
+    if (p->pid <= 0 || p->completed)
+    {
+        if (p->stat_fd >= 0)
+            close(p->stat_fd);
+        p->stat_fd = -1;
+        return -1;
+    }
+
+    // the descriptor stays bound to this process, a reused pid never shows up through it
+    int fd = p->stat_fd;
+    if (fd < 0)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/%d/stat", p->pid);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+
+        // keep at most half of the descriptor limit, the rest is left for the pipes of new jobs
+        struct rlimit lim;
+        if (getrlimit(RLIMIT_NOFILE, &lim) < 0 || (rlim_t)fd < lim.rlim_cur / 2)
+            p->stat_fd = fd;
+    }
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (fd != p->stat_fd || n <= 0)
+    {
+        close(fd);
+        p->stat_fd = -1;
+    }
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    // the name in parentheses may contain spaces, fields are counted from the last ')'
+    char state;
+    unsigned long long utime, stime, start;
+    long rss;
+    char *q = strrchr(buf, ')');
+    if (q == NULL || sscanf(q + 2, "%c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu %llu %*s %*s %*s %*s %*s %*s %llu %*s %ld",
+                            &state, &utime, &stime, &start, &rss) != 5)
+        return -1;
+    s->state = state;
+    s->ticks = utime + stime;
+    s->start = start;
+    s->rss_pages = rss;
+    return 0;
+}
+
+/// @brief Append formatted text to a growable buffer
+/// @param buf pointer to the buffer
+/// @param len pointer to its length
+/// @param cap pointer to its capacity
+/// @param fmt printf format
+void buf_printf(char **buf, uint32_t *len, uint32_t *cap, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    grow_array(buf, cap, *len + n + 1, 1);
+    va_start(ap, fmt);
+    vsnprintf(*buf + *len, n + 1, fmt, ap);
+    va_end(ap);
+    *len += n;
+}
+
+/// @brief Format a size in KiB as a short human string
+/// @param out where to store it (at least 16 bytes)
+/// @param kb the size in KiB
+void format_kb(char *out, double kb)
+{
+    if (kb >= 1024 * 1024)
+        snprintf(out, 16, "%.1fG", kb / (1024 * 1024));
+    else if (kb >= 1024)
+        snprintf(out, 16, "%.1fM", kb / 1024);
+    else
+        snprintf(out, 16, "%.0fK", kb);
+}
+
+/// @brief Name a /proc state letter
+/// @param state the letter
+/// @return running, sleeping, disk, stopped, zombie or ?
+const char *proc_state_name(char state)
+{
+    switch (state)
+    {
+    case 'R':
+        return "running";
+    case 'S':
+    case 'I':
+        return "sleeping";
+    case 'D':
+        return "disk";
+    case 'T':
+    case 't':
+        return "stopped";
+    case 'Z':
+    case 'X':
+        return "zombie";
+    default:
+        return "?";
+    }
+}
+
+/// @brief Sample every process of every background job and draw one frame of jobs --watch
+/// @param interval seconds since the previous frame, 0 for the first one (CPU% is then the lifetime average)
+/// @return number of background jobs shown
+int watch_frame(double interval)
+{
+    static char *buf;
+    static uint32_t cap;
+    uint32_t len = 0;
+    long hz = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    double uptime = boot.tv_sec + boot.tv_nsec / 1e9;
+
+    struct winsize ws;
+    int rows = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 ? ws.ws_row : 24;
+
+    // sample everything first so the sampling cost can be shown in the header
+    double t0 = now_seconds();
+    int num_jobs = 0, num_procs = 0;
+    double total_cpu = 0, total_kb = 0;
+    uint32_t body_len = 0, body_cap = 0, shown = 2, hidden = 0;
+    char *body = NULL;
+    for (int id = 1; id <= get_largest_id(); id++)
+    {
+        job *j = NULL;
+        for (int i = 0; i < 256 && j == NULL; i++)
+            if (jobs[i] != NULL && jobs[i]->dead == 0 && jobs[i]->foreground == 0 && jobs[i]->job_id == id)
+                j = jobs[i];
+        if (j == NULL)
+            continue;
+        num_jobs++;
+
+        int nproc = 0;
+        for (process *p = j->first_process; p; p = p->next)
+            nproc++;
+        proc_sample s[nproc];
+        double cpu[nproc], job_cpu = 0, job_kb = 0, elapsed = 0;
+        int stopped = 0, live = 0, k = 0;
+        for (process *p = j->first_process; p; p = p->next, k++)
+        {
+            unsigned long long before = p->cpu_ticks;
+            cpu[k] = 0;
+            if (proc_sample_read(p, &s[k]) < 0)
+                continue;
+            double age = uptime - (double)s[k].start / hz;
+            int fresh = interval <= 0 || before == 0;
+            double span = fresh ? age : interval;
+            cpu[k] = span > 0 ? 100.0 * (s[k].ticks - (fresh ? 0 : before)) / hz / span : 0;
+            p->cpu_ticks = s[k].ticks;
+            job_cpu += cpu[k];
+            job_kb += s[k].rss_pages * page_kb;
+            elapsed = age > elapsed ? age : elapsed;
+            stopped |= s[k].state == 'T' || s[k].state == 't';
+            live++;
+        }
+        num_procs += live;
+        total_cpu += job_cpu;
+        total_kb += job_kb;
+
+        // one row for the job, one for each of its processes, as long as the terminal has room
+        char rss[16], name[16];
+        int e = (int)elapsed;
+        format_kb(rss, job_kb);
+        snprintf(name, sizeof(name), "[%d]", j->job_id);
+        if (++shown < (uint32_t)rows - 1)
+            buf_printf(&body, &body_len, &body_cap, "%8s %-7s %-9s %6.1f %8s %4d:%02d:%02d  %.60s\n", name, "",
+                       j->queued ? "queued" : stopped ? "stopped" : live ? "running" : "done", job_cpu, rss,
+                       e / 3600, e / 60 % 60, e % 60, j->command ? j->command : "");
+        else
+            hidden++;
+        k = 0;
+        for (process *p = j->first_process; p; p = p->next, k++)
+        {
+            if (s[k].state == '?')
+                continue;
+            e = (int)(uptime - (double)s[k].start / hz);
+            format_kb(rss, (double)s[k].rss_pages * page_kb);
+            if (++shown < (uint32_t)rows - 1)
+                buf_printf(&body, &body_len, &body_cap, "%8s %-7d %-9s %6.1f %8s %4d:%02d:%02d    %.58s\n", "", p->pid,
+                           proc_state_name(s[k].state), cpu[k], rss, e / 3600, e / 60 % 60, e % 60, p->name);
+            else
+                hidden++;
+        }
+    }
+    double cost = now_seconds() - t0;
+
+    char total_rss[16];
+    format_kb(total_rss, total_kb);
+    buf_printf(&buf, &len, &cap, "\x1b[H\x1b[2J");
+    buf_printf(&buf, &len, &cap, "jobs: %d, processes: %d, cpu %.1f%%, rss %s, sampled in %.2fms (any key quits)\n\n",
+               num_jobs, num_procs, total_cpu, total_rss, cost * 1e3);
+    buf_printf(&buf, &len, &cap, "%8s %-7s %-9s %6s %8s %10s  %s\n", "JOB", "PID", "STATE", "CPU%", "RSS", "ELAPSED",
+               "COMMAND");
+    if (body)
+        buf_printf(&buf, &len, &cap, "%s", body);
+    if (hidden)
+        buf_printf(&buf, &len, &cap, "... %u more rows\n", hidden);
+    free(body);
+
+    // one write per frame, so the terminal never shows half of one
+    for (uint32_t off = 0; off < len;)
+    {
+        ssize_t w = write(STDOUT_FILENO, buf + off, len - off);
+        if (w <= 0 && errno != EINTR)
+            break;
+        off += w > 0 ? w : 0;
+    }
+    return num_jobs;
+}
+
+/// @brief Redraw the background jobs every interval until a key is pressed or no job is left
+/// @param interval seconds between frames
+void wsh_jobs_watch(double interval)
+{
+    int tty = isatty(STDIN_FILENO);
+    fflush(stdout);
+
+    // any key quits, without waiting for enter
+    if (tty)
+    {
+        struct termios raw = shell_tmodes;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    }
+
+    double last = 0;
+    int quit = 0;
+    while (!quit)
+    {
+        sched_dispatch();
+        double now = now_seconds();
+        if (watch_frame(last > 0 ? now - last : 0) == 0)
+            break;
+        last = now;
+
+        // keep reaping, dispatching and enforcing deadlines until the next frame
+        struct pollfd fds[2 + 256];
+        double deadline = now + interval;
+        while (!quit && (now = now_seconds()) < deadline)
+        {
+            int nfds = job_wait_fds(fds, tty ? STDIN_FILENO : -1);
+            int n = poll(fds, nfds, (int)((deadline - now) * 1000) + 1);
+            if (n > 0 && (fds[0].revents & POLLIN))
+                drain_sigchld_pipe();
+            if (n > 0 && tty && (fds[1].revents & POLLIN))
+            {
+                char c;
+                quit = read(STDIN_FILENO, &c, 1) >= 0;
+            }
+            check_job_timers();
+        }
+    }
+
+    if (tty)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    printf("\n");
+}
+
+/*
+ * WAITING FOR JOBS
+ */
+
+/// @brief Open a pidfd that becomes readable when the process exits
+/// @param pid the process
+/// @return the pidfd, -1 on error
+int pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/// @brief Check whether a background job is done, collecting exits the SIGCHLD handler has not seen yet
+/// @param j job struct pointer
+/// @return true if every process of the job is done
+int wait_job_done(job *j)
+{
+    int status;
+    pid_t pid;
+
+    if (j->queued)
+        return 0;
+    for (process *p = j->first_process; p; p = p->next)
+        if (p->pid > 0 && !p->completed && (pid = waitpid(p->pid, &status, WNOHANG)) > 0)
+            mark_process_status(pid, status);
+    if (job_is_completed(j))
+        j->dead = 1;
+    return j->dead;
+}
+
+/// @brief Wait for background jobs, sleeping in epoll on one pidfd per process; queued jobs are
+/// started and deadlines enforced meanwhile, as in wait_for_job_polling()
+/// @param targets the jobs to wait for, entries are set to NULL as they finish
+/// @param n number of jobs
+/// @param any return as soon as one of them is done
+/// @param timeout_ms give up after this many milliseconds (-1 waits forever)
+/// @return the job that finished (any) or the last one in targets (all), NULL on timeout
+job *wait_jobs(job **targets, int n, int any, long timeout_ms)
+{
+    struct epoll_event ev = {.events = EPOLLIN}, events[64];
+    double deadline = now_seconds() + timeout_ms / 1000.0;
+    job *result = any || n == 0 ? NULL : targets[n - 1];
+    struct
+    {
+        pid_t pid;
+        int fd;
+    } *watched = NULL;
+    uint32_t num_watched = 0, cap_watched = 0;
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0)
+    {
+        perror("epoll_create1");
+        return NULL;
+    }
+    epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_pipe[0], &ev);
+
+    while (true)
+    {
+        sched_dispatch();
+
+        int pending = 0;
+        for (int i = 0; i < n; i++)
+        {
+            job *j = targets[i];
+            if (j == NULL)
+                continue;
+            int done = wait_job_done(j);
+
+            // a pidfd stays readable once its process exited: it leaves the set with that process,
+            // not with the whole job, or the first stage of a pipeline to exit keeps epoll spinning
+            for (process *p = j->first_process; p; p = p->next)
+                for (uint32_t w = 0; w < num_watched; w++)
+                    if (p->completed && watched[w].pid == p->pid && watched[w].fd >= 0)
+                    {
+                        epoll_ctl(ep, EPOLL_CTL_DEL, watched[w].fd, NULL);
+                        close(watched[w].fd);
+                        watched[w].fd = -1;
+                    }
+            if (done)
+            {
+                // any: the oldest of the finished jobs
+                targets[i] = NULL;
+                if (any && (result == NULL || j->seq < result->seq))
+                    result = j;
+                continue;
+            }
+            pending++;
+
+            // one pidfd per started process; an exit before pidfd_open() is collected by wait_job_done()
+            for (process *p = j->first_process; p; p = p->next)
+            {
+                uint32_t w = 0;
+                while (w < num_watched && watched[w].pid != p->pid)
+                    w++;
+                if (p->pid <= 0 || p->completed || w < num_watched)
+                    continue;
+                grow_array(&watched, &cap_watched, num_watched + 1, sizeof(*watched));
+                watched[num_watched].pid = p->pid;
+                watched[num_watched].fd = pidfd_open(p->pid);
+                if (watched[num_watched].fd >= 0)
+                    epoll_ctl(ep, EPOLL_CTL_ADD, watched[num_watched].fd, &ev);
+                num_watched++;
+            }
+        }
+        if (pending == 0 || (any && result != NULL))
+            break;
+
+        // deadline timers come and go with jobs, a closed one leaves the set by itself
+        for (int i = 0; i < 256; i++)
+            if (jobs[i] != NULL && jobs[i]->timerfd >= 0)
+                epoll_ctl(ep, EPOLL_CTL_ADD, jobs[i]->timerfd, &ev);
+
+        // queued jobs need the load and memory re-sampled now and then
+        int ms = sched_queue_len() > 0 ? 200 : -1;
+        if (timeout_ms >= 0)
+        {
+            double left = deadline - now_seconds();
+            if (left <= 0)
+            {
+                result = NULL;
+                break;
+            }
+            if (ms < 0 || left * 1000 < ms)
+                ms = (int)(left * 1000) + 1;
+        }
+        if (epoll_wait(ep, events, 64, ms) > 0)
+            drain_sigchld_pipe();
+        check_job_timers();
+    }
+
+    for (uint32_t w = 0; w < num_watched; w++)
+        if (watched[w].fd >= 0)
+            close(watched[w].fd);
+    free(watched);
+    close(ep);
+    return result;
+}
+
+/// @brief wait for background jobs: all of them, the listed ones, or (-n) whichever finishes first.
+/// The status is that of the last listed or first finished job (0 when waiting for all of them),
+/// 127 if there is no such job and 124 on timeout.
+/// USAGE: wait [-n] [-t DURATION] [-p NAME] [[%]JOB_ID ...]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_wait(int argc, char *argv[])
+{
+    job *targets[256];
+    int n = 0, any = 0, a = 1;
+    long timeout_ms = -1;
+    char *name = NULL;
+
+    for (; a < argc - 1 && argv[a][0] == '-'; a++)
+    {
+        if (strcmp(argv[a], "-n") == 0)
+            any = 1;
+        else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc - 1 && parse_duration_ms(argv[a + 1], &timeout_ms) == 0)
+            a++;
+        else if (strcmp(argv[a], "-p") == 0 && a + 1 < argc - 1)
+            name = argv[++a];
+        else
+        {
+            printf("USAGE: wait [-n] [-t DURATION] [-p NAME] [[%%]JOB_ID ...]\n");
+            return;
+        }
+    }
+
+    int all = a == argc - 1;
+    if (all)
+    {
+        // every background job; -n also takes one that finished before and was not waited for yet
+        for (int i = 0; i < 256; i++)
+            if (jobs[i] != NULL && !jobs[i]->foreground && !jobs[i]->waited && (!jobs[i]->dead || any))
+                targets[n++] = jobs[i];
+    }
+    for (; a < argc - 1; a++)
+    {
+        char *id = argv[a] + (argv[a][0] == '%');
+        int i = 0;
+        while (i < 256 && !(jobs[i] != NULL && !jobs[i]->foreground && jobs[i]->job_id == atoi(id)))
+            i++;
+        if (i == 256)
+        {
+            printf("Error: no job %s.\n", argv[a]);
+            last_status = 127;
+            return;
+        }
+        targets[n++] = jobs[i];
+    }
+    if (n == 0)
+    {
+        last_status = any ? 127 : 0;
+        return;
+    }
+
+    // without -n, wait reports the last job listed
+    job *listed[256];
+    memcpy(listed, targets, n * sizeof(job *));
+    job *j = wait_jobs(targets, n, any, timeout_ms);
+    if (j == NULL)
+    {
+        last_status = 124;
+        return;
+    }
+
+    // a job is reported once, later wait -n calls move on to the next one
+    for (int i = 0; i < n; i++)
+        if (listed[i] == j || !any)
+            listed[i]->waited = 1;
+    last_status = all && !any ? 0 : job_exit_status(j);
+    if (name)
+    {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", j->job_id);
+        set_var(name, value);
+    }
+}
+
+/*
+ * BUILT IN COMMANDS
+ */
+
+/// @brief command to exit the program
+void wsh_exit()
+{
+    exit(0);
+}
+
+/// @brief command to implement cd  (changing directories)
+/// @param argc the argument count
+/// @param argv the argument vector
+void wsh_cd(int argc, char *argv[])
 {
+    // decrement argc to get rid of null termination
     argc -= 1;
-    // id was provided
-    if (argc == 2)
+    if (argc != 2)
+    {
+        printf("USAGE: cd dir\n");
+        last_status = 1;
+    }
+    else
+    {
+        // change directories
+        if (chdir(argv[1]) != 0)
+        {
+            printf("Error: chdir to %s failed.\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        last_status = 0;
+    }
+}
+
+/// @brief command to display all in progress background jobs (in order by job id) in the following format:
+/// <id>: <program name> <arg1> <arg2> … <argN> [&]
+/// USAGE: jobs [--watch [SECONDS]]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_jobs(int argc, char *argv[])
+{
+    process *p;
+
+    // a live view of cpu, memory and state instead of the list
+    if (argc > 2)
+    {
+        double interval = argc > 3 ? atof(argv[2]) : 1;
+        if (strcmp(argv[1], "--watch") != 0 || argc > 4 || interval <= 0)
+        {
+            printf("USAGE: jobs [--watch [SECONDS]]\n");
+            return;
+        }
+        wsh_jobs_watch(interval);
+        return;
+    }
+
+    int largest_id = get_largest_id();
+    int local_job_id = 1;
+
+    // continue to iterate over all jobs until we have printed the largest id
+    while (local_job_id <= largest_id)
+    {
+        // iterate over all jobs
+        for (int i = 0; i < 256; i++)
+        {
+            // if the index of the jobs array is populated and the job is alive
+            // if the job is a background job
+            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->foreground == 0)
+            {
+                // if the job id is the current id we need
+                if (jobs[i]->job_id == local_job_id)
+                {
+                    // print out the contents
+                    printf("%d: ", jobs[i]->job_id);
+                    int num_proc = 0;
+                    for (p = jobs[i]->first_process; p; p = p->next)
+                    {
+                        if (num_proc == 0)
+                        {
+                            printf("%s ", p->name);
+                            for (int i = 1; i < p->argc - 1; i++)
+                            {
+                                printf("%s ", p->argv[i]);
+                            }
+                            num_proc += 1;
+                        }
+                        else
+                        {
+                            printf("| ");
+                            printf("%s ", p->name);
+                            for (int i = 1; i < p->argc - 1; i++)
+                            {
+                                printf("%s ", p->argv[i]);
+                            }
+                        }
+                    }
+                    printf("& ");
+                    if (jobs[i]->timed_out)
+                    {
+                        printf("(timed out) ");
+                    }
+                    else if (sched_enabled() || jobs[i]->queued)
+                    {
+                        printf("(%s) ", jobs[i]->queued ? "queued" : "running");
+                    }
+                    printf("\n");
+                    break;
+                }
+            }
+        }
+        // increment the job id we need and repeat search
+        local_job_id += 1;
+    }
+}
+
+/// @brief fg should move a process from the background to the foreground
+/// @param argc the argument count
+/// @param argv the argument vector
+void wsh_fg(int argc, char *argv[])
+{
+    argc -= 1;
+    // id was provided
+    if (argc == 2)
+    {
+        // iterate over all jobs
+        for (int i = 0; i < 256; i++)
+        {
+            // if the index of the jobs array is populated and the job is alive
+            // if the job id is equal to the provided id
+            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->job_id == atoi(argv[1]))
+            {
+                /* Put the job into the foreground.  */
+                tcsetpgrp(shell_terminal, jobs[i]->pgid);
+
+                /* Wait for it to report.  */
+                wait_for_job(jobs[i]);
+
+                /* Put the shell back in the foreground.  */
+                tcsetpgrp(shell_terminal, shell_pgid);
+
+                /* Restore the shell’s terminal modes.  */
+                tcgetattr(shell_terminal, &jobs[i]->tmodes);
+                tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+                return;
+            }
+        }
+    }
+    // use most recent id
+    else if (argc == 1)
+    {
+        // iterate over all jobs
+        for (int i = 0; i < 256; i++)
+        {
+            // if the index of the jobs array is populated and the job is alive
+            if (jobs[i] != NULL && (jobs[i]->dead == 0))
+            {
+                /* Put the job into the foreground.  */
+                tcsetpgrp(shell_terminal, jobs[i]->pgid);
+
+                /* Wait for it to report.  */
+                wait_for_job(jobs[i]);
+
+                /* Put the shell back in the foreground.  */
+                tcsetpgrp(shell_terminal, shell_pgid);
+
+                /* Restore the shell’s terminal modes.  */
+                tcgetattr(shell_terminal, &jobs[i]->tmodes);
+                tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+                return;
+            }
+        }
+    }
+    else
+    {
+        printf("USAGE: fg [job_id]\n");
+    }
+}
+
+/// @brief bg should resume a process in the background - or run any suspended job in the background (!!!CURRENTLY BROKEN)
+/// @param argc the argument count
+/// @param argv the argument array
+void wsh_bg(int argc, char *argv[])
+{
+    argc -= 1;
+    // id was provided
+    if (argc == 2)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->job_id == atoi(argv[1]))
+            {
+                put_job_in_background(jobs[i], 1);
+                return;
+            }
+        }
+    }
+    // use most recent id
+    else if (argc == 1)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            if (jobs[i] != NULL && (jobs[i]->dead == 0))
+            {
+                put_job_in_background(jobs[i], 1);
+                return;
+            }
+        }
+    }
+    else
+    {
+        printf("USAGE: fg [job_id]\n");
+        // wsh_exit();
+    }
+}
+
+/// @brief sched configures admission control for background jobs
+/// USAGE: sched [jobs N | load X | mem KB | policy fifo|priority | priority N]
+/// @param argc the argument count
+/// @param argv the argument vector
+void wsh_sched(int argc, char *argv[])
+{
+    argc -= 1;
+    if (argc == 1)
+    {
+        printf("jobs: %d\n", sched_max_jobs);
+        printf("load: %.2f\n", sched_max_load);
+        printf("mem: %ld\n", sched_min_mem_kb);
+        printf("policy: %s\n", sched_by_priority ? "priority" : "fifo");
+        printf("priority: %d\n", sched_priority);
+        printf("running: %d queued: %d\n", sched_running_jobs(), sched_queue_len());
+        return;
+    }
+    if (argc != 3)
+    {
+        printf("USAGE: sched [jobs N | load X | mem KB | policy fifo|priority | priority N]\n");
+        return;
+    }
+
+    if (strcmp(argv[1], "jobs") == 0)
+        sched_max_jobs = atoi(argv[2]);
+    else if (strcmp(argv[1], "load") == 0)
+        sched_max_load = strtod(argv[2], NULL);
+    else if (strcmp(argv[1], "mem") == 0)
+        sched_min_mem_kb = strtol(argv[2], NULL, 10);
+    else if (strcmp(argv[1], "priority") == 0)
+        sched_priority = atoi(argv[2]);
+    else if (strcmp(argv[1], "policy") == 0 && strcmp(argv[2], "fifo") == 0)
+        sched_by_priority = 0;
+    else if (strcmp(argv[1], "policy") == 0 && strcmp(argv[2], "priority") == 0)
+        sched_by_priority = 1;
+    else
+    {
+        printf("USAGE: sched [jobs N | load X | mem KB | policy fifo|priority | priority N]\n");
+        return;
+    }
+
+    // thresholds may have been relaxed
+    sched_dispatch();
+}
+
+/*
+ * BACKGROUND OUTPUT MULTIPLEXING
+ */
+
+// one stdout or stderr pipe of a background job, read by the mux thread
+typedef struct mux_stream
+{
+    int fd;         /* read end of the pipe */
+    int dest;       /* STDOUT_FILENO or STDERR_FILENO */
+    char prefix[16]; /* "[job_id] " */
+    int prefix_len; /* strlen(prefix) */
+    char *buf;      /* bytes read but not written yet */
+    size_t len;     /* bytes in buf */
+    size_t cap;     /* allocated size of buf */
+    size_t used;    /* bytes of buf handed to writev this round */
+    int eof;        /* writer side closed */
+} mux_stream;
+
+#define MUX_READ_SIZE 65536
+#define MUX_MAX_LINE (1 << 20)
+#define MUX_MAX_IOV 1024
+
+int mux_enabled = 0;
+int mux_epfd = -1;
+int mux_open_streams = 0;
+pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mux_idle = PTHREAD_COND_INITIALIZER;
+
+/// @brief writev every iovec completely, retrying after short writes
+/// @param fd destination
+/// @param iov the iovecs (modified)
+/// @param n number of iovecs
+void writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+/// @brief Batch of prefixed lines for one destination, flushed with writev
+typedef struct mux_batch
+{
+    struct iovec iov[MUX_MAX_IOV];
+    int n;
+} mux_batch;
+
+/// @brief Add a prefixed line to a batch (the newline is part of the line unless missing)
+/// @param b the batch
+/// @param dest destination fd used when the batch has to be flushed early
+/// @param s the stream the line belongs to
+/// @param line start of the line
+/// @param len length of the line
+/// @param add_newline append a newline after the line
+void mux_batch_line(mux_batch *b, int dest, mux_stream *s, char *line, size_t len, int add_newline)
+{
+    static char newline = '\n';
+
+    if (b->n + 3 > MUX_MAX_IOV)
+    {
+        writev_all(dest, b->iov, b->n);
+        b->n = 0;
+    }
+    b->iov[b->n].iov_base = s->prefix;
+    b->iov[b->n++].iov_len = s->prefix_len;
+    b->iov[b->n].iov_base = line;
+    b->iov[b->n++].iov_len = len;
+    if (add_newline)
+    {
+        b->iov[b->n].iov_base = &newline;
+        b->iov[b->n++].iov_len = 1;
+    }
+}
+
+/// @brief Read what a stream has and batch all of its complete lines
+/// @param s the stream
+/// @param b the batch of the stream's destination
+void mux_collect(mux_stream *s, mux_batch *b)
+{
+    // one large read per wakeup, never byte-by-byte
+    if (s->cap - s->len < MUX_READ_SIZE)
+    {
+        s->cap = s->len + MUX_READ_SIZE;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    ssize_t n = read(s->fd, s->buf + s->len, s->cap - s->len);
+    if (n == 0)
+        s->eof = 1;
+    else if (n > 0)
+        s->len += n;
+    else if (errno != EAGAIN && errno != EINTR)
+        s->eof = 1;
+
+    char *start = s->buf, *end = s->buf + s->len, *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL)
+    {
+        mux_batch_line(b, s->dest, s, start, nl + 1 - start, 0);
+        start = nl + 1;
+    }
+    // a partial line is only written once the job closes the pipe or it gets too long
+    if (start < end && (s->eof || end - start >= MUX_MAX_LINE))
+    {
+        mux_batch_line(b, s->dest, s, start, end - start, 1);
+        start = end;
+    }
+    s->used = start - s->buf;
+}
+
+/// @brief Mux thread: wait for background job output and write it as prefixed lines
+/// @param arg unused
+/// @return NULL
+void *mux_thread(void *arg)
+{
+    struct epoll_event events[64];
+    static mux_batch out, err;
+
+    (void)arg;
+    while (true)
+    {
+        int n = epoll_wait(mux_epfd, events, 64, -1);
+        out.n = 0;
+        err.n = 0;
+        for (int i = 0; i < n; i++)
+        {
+            mux_stream *s = events[i].data.ptr;
+            mux_collect(s, s->dest == STDERR_FILENO ? &err : &out);
+        }
+
+        // one writev per destination for everything that arrived in this round
+        writev_all(STDOUT_FILENO, out.iov, out.n);
+        writev_all(STDERR_FILENO, err.iov, err.n);
+
+        for (int i = 0; i < n; i++)
+        {
+            mux_stream *s = events[i].data.ptr;
+            s->len -= s->used;
+            memmove(s->buf, s->buf + s->used, s->len);
+            s->used = 0;
+            if (s->eof)
+            {
+                epoll_ctl(mux_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+                close(s->fd);
+                free(s->buf);
+                free(s);
+
+                pthread_mutex_lock(&mux_lock);
+                if (--mux_open_streams == 0)
+                    pthread_cond_broadcast(&mux_idle);
+                pthread_mutex_unlock(&mux_lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+/// @brief Start the mux thread the first time multiplexing is turned on
+void mux_start()
+{
+    pthread_t tid;
+
+    mux_enabled = 1;
+    if (mux_epfd >= 0)
+        return;
+    mux_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    // SIGCHLD stays with the main thread, the mux thread inherits a mask that blocks it
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld_mask, &old_mask);
+    int failed = mux_epfd < 0 || pthread_create(&tid, NULL, mux_thread, NULL) != 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (failed)
+    {
+        perror("mux");
+        mux_enabled = 0;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/// @brief Create a pipe for one output stream of a background job and hand its read end to the mux thread
+/// @param job_id the id used as line prefix
+/// @param dest STDOUT_FILENO or STDERR_FILENO
+/// @return write end for the job, or dest if the pipe could not be created
+int mux_open(int job_id, int dest)
+{
+    int fds[2];
+    struct epoll_event ev;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return dest;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    mux_stream *s = calloc(1, sizeof(mux_stream));
+    s->fd = fds[0];
+    s->dest = dest;
+    s->prefix_len = snprintf(s->prefix, sizeof(s->prefix), "[%d] ", job_id);
+
+    pthread_mutex_lock(&mux_lock);
+    mux_open_streams += 1;
+    pthread_mutex_unlock(&mux_lock);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(mux_epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    return fds[1];
+}
+
+/// @brief Block until every multiplexed stream has been closed by its job and written out
+void mux_drain()
+{
+    pthread_mutex_lock(&mux_lock);
+    while (mux_open_streams > 0)
+        pthread_cond_wait(&mux_idle, &mux_lock);
+    pthread_mutex_unlock(&mux_lock);
+}
+
+/// @brief mux turns prefixed, line-batched output of background jobs on or off
+/// USAGE: mux [on|off]
+/// @param argc the argument count
+/// @param argv the argument vector
+void wsh_mux(int argc, char *argv[])
+{
+    argc -= 1;
+    if (argc == 1)
+        printf("%s\n", mux_enabled ? "on" : "off");
+    else if (argc == 2 && strcmp(argv[1], "on") == 0)
+        mux_start();
+    else if (argc == 2 && strcmp(argv[1], "off") == 0)
+        mux_enabled = 0;
+    else
+        printf("USAGE: mux [on|off]\n");
+}
+
+/*
+ * SPAWN ATTRIBUTES (nice, taskset, timeout, ulimit)
+ */
+
+// ulimit flags, their resources and the unit their values are given in (bash conventions)
+struct ulimit_flag
+{
+    char flag;
+    int resource;
+    long unit;
+    char *name;
+} ulimit_flags[] = {
+    {'c', RLIMIT_CORE, 512, "core file size (blocks)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 512, "file size (blocks)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+
+/// @brief Return true if a string is an optionally signed decimal integer
+/// @param s the string
+/// @return integer indicator
+int is_integer(char *s)
+{
+    if (*s == '-' || *s == '+')
+        s++;
+    if (*s == '\0')
+        return 0;
+    for (; *s; s++)
+        if (!isdigit((unsigned char)*s))
+            return 0;
+    return 1;
+}
+
+/// @brief Parse a cpu list ("0-3,6") or, if list is false, a hex mask ("0x3") into a cpu set
+/// @param s the list or mask
+/// @param list list syntax indicator
+/// @param set the cpu set to fill
+/// @return 0 on success, -1 on a malformed value
+int parse_cpu_set(char *s, int list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    if (!list)
+    {
+        char *end;
+        unsigned long long mask = strtoull(s, &end, 16);
+        if (*s == '\0' || *end != '\0' || mask == 0)
+            return -1;
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (mask & (1ULL << cpu))
+                CPU_SET(cpu, set);
+        return 0;
+    }
+
+    while (*s)
+    {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-')
+        {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = lo; cpu <= hi; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        s = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/// @brief Record a resource limit in a set of spawn attributes, replacing an earlier one
+/// @param attrs the spawn attributes
+/// @param resource RLIMIT_* resource
+/// @param value the limit (RLIM_INFINITY for unlimited)
+void set_spawn_rlimit(spawn_attrs *attrs, int resource, rlim_t value)
+{
+    int i;
+    for (i = 0; i < attrs->num_rlimits; i++)
+        if (attrs->rlimits[i].resource == resource)
+            break;
+    if (i == 16)
+        return;
+    if (i == attrs->num_rlimits)
+        attrs->num_rlimits += 1;
+    attrs->rlimits[i].resource = resource;
+    attrs->rlimits[i].lim.rlim_cur = value;
+    attrs->rlimits[i].lim.rlim_max = value;
+}
+
+/// @brief Print the spawn attribute defaults for a bare nice, taskset, timeout or ulimit
+/// @param which the builtin name
+void print_spawn_attrs(char *which)
+{
+    if (strcmp(which, "timeout") == 0)
+    {
+        if (shell_attrs.timeout_ms > 0)
+            printf("%ldms (kill after %ldms)\n", shell_attrs.timeout_ms, shell_attrs.kill_after_ms);
+        else
+            printf("none\n");
+    }
+    else if (strcmp(which, "nice") == 0)
+    {
+        printf("%d\n", shell_attrs.has_nice ? shell_attrs.nice : 0);
+    }
+    else if (strcmp(which, "taskset") == 0)
+    {
+        if (!shell_attrs.has_affinity)
+        {
+            printf("all\n");
+            return;
+        }
+        for (int cpu = 0, first = 1; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &shell_attrs.affinity))
+            {
+                printf(first ? "%d" : ",%d", cpu);
+                first = 0;
+            }
+        }
+        printf("\n");
+    }
+    else
+    {
+        for (size_t f = 0; f < sizeof(ulimit_flags) / sizeof(ulimit_flags[0]); f++)
+        {
+            for (int i = 0; i < shell_attrs.num_rlimits; i++)
+            {
+                if (shell_attrs.rlimits[i].resource != ulimit_flags[f].resource)
+                    continue;
+                rlim_t v = shell_attrs.rlimits[i].lim.rlim_cur;
+                if (v == RLIM_INFINITY)
+                    printf("-%c %s: unlimited\n", ulimit_flags[f].flag, ulimit_flags[f].name);
+                else
+                    printf("-%c %s: %llu\n", ulimit_flags[f].flag, ulimit_flags[f].name,
+                           (unsigned long long)(v / ulimit_flags[f].unit));
+            }
+        }
+    }
+}
+
+/// @brief Consume leading nice/taskset/timeout/ulimit words of a command into a set of spawn attributes
+/// nice [-n N | -N | N], taskset [-c LIST | MASK], timeout [-k DURATION] DURATION, ulimit -X VALUE [-X VALUE ...]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+/// @param attrs the spawn attributes to update
+/// @return number of words consumed, or -1 if the line was fully handled or malformed
+int parse_spawn_prefixes(int argc, char *argv[], spawn_attrs *attrs)
+{
+    int n = argc - 1;
+    int i = 0;
+
+    while (i < n)
+    {
+        char *word = argv[i];
+        if (strcmp(word, "nice") == 0)
+        {
+            int adjust = 10;
+            i += 1;
+            if (i < n && strcmp(argv[i], "-n") == 0)
+            {
+                if (i + 1 >= n || !is_integer(argv[i + 1]))
+                {
+                    printf("USAGE: nice [-n N] [command]\n");
+                    return -1;
+                }
+                adjust = atoi(argv[i + 1]);
+                i += 2;
+            }
+            else if (i < n && argv[i][0] == '-' && is_integer(argv[i] + 1))
+            {
+                adjust = atoi(argv[i] + 1);
+                i += 1;
+            }
+            else if (i < n && is_integer(argv[i]))
+            {
+                adjust = atoi(argv[i]);
+                i += 1;
+            }
+            else if (i == n && n == 1)
+            {
+                print_spawn_attrs(word);
+                return -1;
+            }
+            attrs->has_nice = 1;
+            attrs->nice = adjust;
+        }
+        else if (strcmp(word, "taskset") == 0)
+        {
+            int list = 0;
+            i += 1;
+            if (i == n && n == 1)
+            {
+                print_spawn_attrs(word);
+                return -1;
+            }
+            if (i < n && strcmp(argv[i], "-c") == 0)
+            {
+                list = 1;
+                i += 1;
+            }
+            if (i >= n || parse_cpu_set(argv[i], list, &attrs->affinity) < 0)
+            {
+                printf("USAGE: taskset [-c LIST | MASK] [command]\n");
+                return -1;
+            }
+            attrs->has_affinity = 1;
+            i += 1;
+        }
+        else if (strcmp(word, "timeout") == 0)
+        {
+            i += 1;
+            if (i == n && n == 1)
+            {
+                print_spawn_attrs(word);
+                return -1;
+            }
+            if (i + 1 < n && (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--kill-after") == 0))
+            {
+                if (parse_duration_ms(argv[i + 1], &attrs->kill_after_ms) < 0)
+                {
+                    printf("USAGE: timeout [-k DURATION] DURATION [command]\n");
+                    return -1;
+                }
+                i += 2;
+            }
+            if (i >= n || parse_duration_ms(argv[i], &attrs->timeout_ms) < 0)
+            {
+                printf("USAGE: timeout [-k DURATION] DURATION [command]\n");
+                return -1;
+            }
+            i += 1;
+        }
+        else if (strcmp(word, "ulimit") == 0)
+        {
+            i += 1;
+            if (i == n && n == 1)
+            {
+                print_spawn_attrs(word);
+                return -1;
+            }
+            int num_flags = 0;
+            while (i < n && argv[i][0] == '-' && strlen(argv[i]) == 2)
+            {
+                size_t f;
+                for (f = 0; f < sizeof(ulimit_flags) / sizeof(ulimit_flags[0]); f++)
+                    if (ulimit_flags[f].flag == argv[i][1])
+                        break;
+                if (f == sizeof(ulimit_flags) / sizeof(ulimit_flags[0]) || i + 1 >= n ||
+                    (strcmp(argv[i + 1], "unlimited") != 0 && !is_integer(argv[i + 1])) || argv[i + 1][0] == '-')
+                {
+                    num_flags = 0;
+                    break;
+                }
+                rlim_t value = RLIM_INFINITY;
+                if (strcmp(argv[i + 1], "unlimited") != 0)
+                    value = (rlim_t)strtoull(argv[i + 1], NULL, 10) * ulimit_flags[f].unit;
+                set_spawn_rlimit(attrs, ulimit_flags[f].resource, value);
+                num_flags += 1;
+                i += 2;
+            }
+            if (num_flags == 0)
+            {
+                printf("USAGE: ulimit -c|d|f|l|m|n|s|t|u|v N|unlimited [...] [command]\n");
+                return -1;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/// @brief Apply spawn attributes to the calling (child) process before exec
+/// @param attrs the spawn attributes
+void apply_spawn_attrs(const spawn_attrs *attrs)
+{
+    if (attrs->has_affinity && sched_setaffinity(0, sizeof(cpu_set_t), &attrs->affinity) < 0)
+    {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+    if (attrs->has_nice)
+    {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, current + attrs->nice) < 0)
+            perror("setpriority");
+    }
+    for (int i = 0; i < attrs->num_rlimits; i++)
+    {
+        if (setrlimit(attrs->rlimits[i].resource, &attrs->rlimits[i].lim) < 0)
+        {
+            perror("setrlimit");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * JOB CONTROL FUNCTIONS
+ */
+
+/// @brief launch a process in the background and set up its process group
+/// @param p a pointer to a process struct
+/// @param pgid a process group id of the parent job
+/// @param infile the input stream of the process
+/// @param outfile the output stream of the process
+/// @param errfile the error stream of the process
+/// @param foreground process is foreground indicator
+/// @param attrs affinity, niceness and resource limits of the job
+void launch_process(process *p, pid_t pgid,
+                    int infile, int outfile, int errfile,
+                    int foreground, const spawn_attrs *attrs)
+{
+    // set the process to a process group
+    pid_t pid = getpid();
+    if (pgid == 0)
+        pgid = pid;
+    if (getpid() != getsid(0))
+    {
+        setpgid(pid, pgid);
+    }
+    // give the process group control of the foreground
+    if (foreground)
+        tcsetpgrp(shell_terminal, pgid);
+
+    /* Set the handling for job control signals back to the default.  */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    /* Set the standard input/output channels of the new process.  */
+    if (infile != STDIN_FILENO)
+    {
+        dup2(infile, STDIN_FILENO);
+        close(infile);
+    }
+    if (outfile != STDOUT_FILENO)
+    {
+        dup2(outfile, STDOUT_FILENO);
+        close(outfile);
+    }
+    if (errfile != STDERR_FILENO)
+    {
+        dup2(errfile, STDERR_FILENO);
+        close(errfile);
+    }
+
+    /* Apply the job's cpu affinity, niceness and resource limits.  */
+    apply_spawn_attrs(attrs);
+
+    /* Exec the new process.  Make sure we exit.  */
+    execvp(p->argv[0], p->argv);
+    perror("execvp");
+    exit(1);
+}
+
+/// @brief Replace the shell with the single process of a job, set up like a forked child
+/// @param j pointer to a job structure
+void exec_job(job *j)
+{
+    // the new program starts from the shell's output written out, with its pipe ends inherited
+    fflush(stdout);
+    fflush(stderr);
+    board_close();
+    for (int i = 0; i < j->num_pass_fds; i++)
+        fcntl(j->pass_fds[i], F_SETFD, 0);
+    if (j->own_stdin)
+        fcntl(j->stdin, F_SETFD, 0);
+    launch_process(j->first_process, 0, j->stdin, j->stdout, j->stderr, 1, &j->attrs);
+}
+
+// output of a builtin pipeline stage too big for the pipe buffer, written by a helper thread
+typedef struct stage_output
+{
+    int memfd; /* the captured output */
+    int pipe;  /* write end of the pipe to the next stage */
+    off_t size;
+} stage_output;
+
+/// @brief Check whether a builtin can be a pipeline stage: it only prints, so it runs in the shell
+/// @param name the command name
+/// @return true if the stage is not forked
+int pipeline_builtin(char *name)
+{
+    return strcmp(name, "jobs") == 0 || strcmp(name, "history") == 0 || strcmp(name, ":") == 0;
+}
+
+/// @brief Copy a builtin's captured output into the pipe, as fast as the next stage reads it
+/// @param arg stage_output, freed here
+/// @return NULL
+void *stage_output_thread(void *arg)
+{
+    stage_output *o = arg;
+    off_t off = 0;
+    while (off < o->size && sendfile(o->pipe, o->memfd, &off, o->size - off) > 0)
+        ;
+    close(o->pipe);
+    close(o->memfd);
+    free(o);
+    return NULL;
+}
+
+/// @brief Run a builtin pipeline stage in the shell instead of forking it. At the end of the pipeline
+/// it writes to the job's stdout; otherwise its output is collected in a memfd and goes into the pipe
+/// right away if it fits in the pipe buffer (the reader is not started yet), or from a helper thread
+/// @param p the stage
+/// @param outfile where the stage writes
+/// @param piped outfile is the pipe to the next stage
+void run_builtin_stage(process *p, int outfile, int piped)
+{
+    int out = piped ? memfd_create("wsh-stage", MFD_CLOEXEC) : outfile;
+    if (out < 0)
+    {
+        perror("memfd_create");
+        out = outfile;
+        piped = 0;
+    }
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(out, STDOUT_FILENO);
+    run_builtin(p->argc, p->argv);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    p->completed = 1;
+    p->dead = 1;
+    p->status = 0;
+    if (!piped)
+        return;
+
+    off_t size = lseek(out, 0, SEEK_CUR), off = 0;
+    if (size <= fcntl(outfile, F_GETPIPE_SZ))
+    {
+        while (off < size && sendfile(outfile, out, &off, size - off) > 0)
+            ;
+        close(out);
+        return;
+    }
+
+    // the helper keeps its own write end (not inherited by the stages forked next) and never takes
+    // SIGCHLD or dies of SIGPIPE when the reader quits early
+    stage_output *o = malloc(sizeof(stage_output));
+    o->memfd = out;
+    o->pipe = fcntl(outfile, F_DUPFD_CLOEXEC, 0);
+    o->size = size;
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_t tid;
+    pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+    int failed = o->pipe < 0 || pthread_create(&tid, NULL, stage_output_thread, o) != 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (failed)
+    {
+        perror("pipeline");
+        if (o->pipe >= 0)
+            close(o->pipe);
+        close(out);
+        free(o);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/// @brief The heart of the shell. Launch a job
+/// @param j pointer to a job structure
+/// @param foreground job is foreground indicator
+void run_job(job *j, int foreground)
+{
+    process *p;
+    pid_t pid;
+    int mypipe[2], infile, outfile;
+
+    // background jobs have to pass admission control, otherwise they wait in the queue
+    if (!foreground && !j->admitted && !sched_admit(j))
+    {
+        j->queued = 1;
+        board_dirty = 1;
+        board_sync();
+        return;
+    }
+    double spawn_start = profiling ? now_seconds() : 0;
+
+    // hold SIGCHLD until every pid is recorded, otherwise a fast child can be reaped unnoticed
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+    // background output goes through the mux thread as [job_id]-prefixed lines
+    int muxed = !foreground && mux_enabled && j->stdout == STDOUT_FILENO && j->stderr == STDERR_FILENO;
+    if (muxed)
+    {
+        j->stdout = mux_open(j->job_id, STDOUT_FILENO);
+        j->stderr = mux_open(j->job_id, STDERR_FILENO);
+    }
+
+    // process substitution pipes are inherited by this job's processes only
+    for (int i = 0; i < j->num_pass_fds; i++)
+        fcntl(j->pass_fds[i], F_SETFD, 0);
+
+    infile = j->stdin;
+    // iterate over all linked processes of the job
+    for (p = j->first_process; p; p = p->next)
+    {
+        /* Set up pipes, if necessary; only the two stages they connect may hold them.  */
+        if (p->next)
+        {
+            if (pipe2(mypipe, O_CLOEXEC) < 0)
+            {
+                perror("pipe");
+                exit(1);
+            }
+            outfile = mypipe[1];
+        }
+        else
+            outfile = j->stdout;
+
+        /* Builtins run in the shell, only external commands are forked.  */
+        if (pipeline_builtin(p->argv[0]))
+            run_builtin_stage(p, outfile, p->next != NULL);
+        else if ((pid = fork()) == 0)
+            /* This is the child process.  */
+            launch_process(p, j->pgid, infile,
+                           outfile, j->stderr, foreground, &j->attrs);
+        else if (pid < 0)
+        {
+            /* The fork failed.  */
+            perror("fork");
+            exit(1);
+        }
+        else
+        {
+            /* This is the parent process.  */
+            p->pid = pid;
+            board_spawns++;
+            if (!j->pgid)
+            {
+                j->pgid = pid;
+            }
+            if (getpid() != getsid(0))
+            {
+                setpgid(pid, j->pgid);
+            }
+        }
+
+        /* Clean up after pipes.  */
+        if (infile != j->stdin)
+            close(infile);
+        if (outfile != j->stdout)
+            close(outfile);
+        infile = mypipe[0];
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    for (int i = 0; i < j->num_pass_fds; i++)
+        close(j->pass_fds[i]);
+    j->num_pass_fds = 0;
+    if (j->own_stdin)
+    {
+        close(j->stdin);
+        j->stdin = STDIN_FILENO;
+        j->own_stdin = 0;
+    }
+
+    // only the children hold the write ends of the mux pipes
+    if (muxed)
+    {
+        if (j->stdout != STDOUT_FILENO)
+            close(j->stdout);
+        if (j->stderr != STDERR_FILENO)
+            close(j->stderr);
+        j->stdout = STDOUT_FILENO;
+        j->stderr = STDERR_FILENO;
+    }
+
+    // nothing was forked: a job of builtins only is done already
+    if (j->pgid == 0)
+    {
+        j->dead = 1;
+        if (foreground)
+            last_status = 0;
+        board_dirty = 1;
+        board_sync();
+        return;
+    }
+
+    arm_job_timer(j);
+    j->start_ns = realtime_ns();
+    board_jobs_started++;
+    board_dirty = 1;
+    board_sync();
+    double forked = 0;
+    if (profiling)
+    {
+        forked = now_seconds();
+        prof_spawn += forked - spawn_start;
+    }
+
+    // administer the job to the foreground or keep in background
+    if (foreground)
+        put_job_in_foreground(j, 0);
+    else
+        put_job_in_background(j, 0);
+
+    // the children ran until the last reap, what the shell did after that is reap delay
+    if (profiling && foreground)
+    {
+        prof_run += prof_reaped_at - forked;
+        prof_reap += now_seconds() - prof_reaped_at;
+    }
+}
+
+/*
+ * INIT PROC/JOB FUNCTIONS
+ */
+
+/// @brief create a populated process struct
+/// @param p the pointer to the process
+/// @param name the name of the process
+/// @param next the next process in the job (if any)
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void populate_process_struct(process *p, char *name, process *next, int argc, char *argv[])
+{
+    // allocate and set name
+    p->name = strdup(name);
+
+    // set next pointer (for piping)
+    p->next = next;
+
+    // allocate and set cmd args (for exec)
+    p->argv = malloc(sizeof(*argv) * (argc + 1));
+    for (int i = 0; i < argc - 1; i++)
+    {
+        p->argv[i] = strdup(argv[i]);
+    }
+    p->argv[argc - 1] = NULL;
+    p->argv[argc] = NULL;
+
+    p->argc = argc;
+
+    p->pid = 0;
+    p->stopped = 0;
+    p->completed = 0;
+    p->status = 0;
+    p->dead = 0;
+    p->stat_fd = -1;
+    p->cpu_ticks = 0;
+}
+
+/// @brief create a populated job struct
+/// @param j the pointer to the job
+/// @param fp the first process in the job
+/// @param foreground job is background indicator
+/// @param piped job is piped indicator
+void populate_job_struct(job *j, process *fp, int foreground, int piped)
+{
+    // set job id
+    j->next = NULL;
+
+    // set first process in job
+    j->first_process = fp;
+
+    j->foreground = foreground;
+
+    // run_job takes the first child's pid as the group id
+    j->pgid = 0;
+
+    j->job_id = smallest_available_id();
+
+    j->dead = 0;
+
+    j->piped = piped;
+
+    // scheduling state, background jobs are admitted in run_job
+    j->queued = 0;
+    j->admitted = 0;
+    j->start_ns = 0;
+    j->journal_offset = -1;
+    j->waited = 0;
+    j->record_issued = -1;
+    j->owed = 0;
+    j->command = NULL;
+    j->end_ns = 0;
+    j->priority = sched_priority;
+    j->seq = ++sched_seq;
+
+    // inherit the shell's default spawn attributes
+    j->attrs = shell_attrs;
+    j->timerfd = -1;
+    j->timed_out = 0;
+    j->num_pass_fds = 0;
+    j->own_stdin = 0;
+
+    // set fds
+    j->stdin = 0;
+    j->stdout = 1;
+    j->stderr = 2;
+}
+
+/*
+ * DELIMITER SCANNING
+ */
+
+// scan 64 bytes: return the mask of spaces, store the mask of newlines and overwrite both with NUL
+typedef uint64_t (*scan_block_fn)(char *p, uint64_t *newlines);
+
+/// @brief Portable 64-byte block scanner (reference implementation)
+/// @param p 64 bytes to scan, delimiters are replaced by NUL
+/// @param newlines where to store the newline mask (bit i = byte i)
+/// @return the space mask
+uint64_t scan_block_scalar(char *p, uint64_t *newlines)
+{
+    uint64_t spaces = 0, nl = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        if (p[i] == ' ')
+        {
+            spaces |= 1ULL << i;
+            p[i] = '\0';
+        }
+        else if (p[i] == '\n')
+        {
+            nl |= 1ULL << i;
+            p[i] = '\0';
+        }
+    }
+    *newlines = nl;
+    return spaces;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/// @brief SSE2 block scanner: four 16-byte compares per block
+/// @param p 64 bytes to scan, delimiters are replaced by NUL
+/// @param newlines where to store the newline mask
+/// @return the space mask
+__attribute__((target("sse2"))) uint64_t scan_block_sse2(char *p, uint64_t *newlines)
+{
+    const __m128i space = _mm_set1_epi8(' '), lf = _mm_set1_epi8('\n');
+    uint64_t spaces = 0, nl = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128((__m128i *)(p + 16 * i));
+        __m128i s = _mm_cmpeq_epi8(v, space);
+        __m128i n = _mm_cmpeq_epi8(v, lf);
+        spaces |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << (16 * i);
+        nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(n) << (16 * i);
+        _mm_storeu_si128((__m128i *)(p + 16 * i), _mm_andnot_si128(_mm_or_si128(s, n), v));
+    }
+    *newlines = nl;
+    return spaces;
+}
+
+/// @brief AVX2 block scanner: two 32-byte compares per block
+/// @param p 64 bytes to scan, delimiters are replaced by NUL
+/// @param newlines where to store the newline mask
+/// @return the space mask
+__attribute__((target("avx2"))) uint64_t scan_block_avx2(char *p, uint64_t *newlines)
+{
+    const __m256i space = _mm256_set1_epi8(' '), lf = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((__m256i *)p);
+    __m256i hi = _mm256_loadu_si256((__m256i *)(p + 32));
+    __m256i lo_s = _mm256_cmpeq_epi8(lo, space), hi_s = _mm256_cmpeq_epi8(hi, space);
+    __m256i lo_n = _mm256_cmpeq_epi8(lo, lf), hi_n = _mm256_cmpeq_epi8(hi, lf);
+
+    *newlines = (uint64_t)(uint32_t)_mm256_movemask_epi8(lo_n) |
+                ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi_n) << 32);
+    _mm256_storeu_si256((__m256i *)p, _mm256_andnot_si256(_mm256_or_si256(lo_s, lo_n), lo));
+    _mm256_storeu_si256((__m256i *)(p + 32), _mm256_andnot_si256(_mm256_or_si256(hi_s, hi_n), hi));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(lo_s) |
+           ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi_s) << 32);
+}
+#endif
+
+/// @brief Pick the widest block scanner the cpu supports (WSH_SCAN=scalar|sse2|avx2 overrides)
+/// @return the scanner
+scan_block_fn select_scan_block()
+{
+    char *force = getenv("WSH_SCAN");
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((force == NULL || strcmp(force, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        return scan_block_avx2;
+    if ((force == NULL || strcmp(force, "avx2") == 0 || strcmp(force, "sse2") == 0) &&
+        __builtin_cpu_supports("sse2"))
+        return scan_block_sse2;
+#endif
+    (void)force;
+    return scan_block_scalar;
+}
+
+/// @brief Scan a 64-byte block with the selected scanner
+/// @param p 64 bytes to scan, delimiters are replaced by NUL
+/// @param newlines where to store the newline mask
+/// @return the space mask
+uint64_t scan_block(char *p, uint64_t *newlines)
+{
+    static scan_block_fn fn = NULL;
+    if (fn == NULL)
+        fn = select_scan_block();
+    return fn(p, newlines);
+}
+
+/// @brief Scan fewer than 64 bytes (the tail of a line) the same way
+/// @param p the bytes, delimiters are replaced by NUL
+/// @param len number of bytes
+/// @param newlines where to store the newline mask
+/// @return the space mask
+uint64_t scan_tail(char *p, size_t len, uint64_t *newlines)
+{
+    char block[64];
+    memset(block, 'x', sizeof(block));
+    memcpy(block, p, len);
+    uint64_t spaces = scan_block(block, newlines);
+    memcpy(p, block, len);
+    return spaces;
+}
+
+/// @brief Check for the start of a substitution: $(, <( or >(
+/// @param w the text
+/// @return true if w starts one
+int subst_start(const char *w)
+{
+    return (w[0] == '$' || w[0] == '<' || w[0] == '>') && w[1] == '(';
+}
+
+/// @brief Track the parenthesis depth of $(...), <(...) and >(...) through a word
+/// @param w the word
+/// @param depth depth before the word (0 outside a substitution)
+/// @return depth after the word
+int subst_depth(const char *w, int depth)
+{
+    for (; *w; w++)
+    {
+        if (depth == 0 && subst_start(w))
+        {
+            depth = 1;
+            w++;
+        }
+        else if (depth > 0 && *w == '(')
+            depth++;
+        else if (depth > 0 && *w == ')')
+            depth--;
+    }
+    return depth;
+}
+
+// the | and & operators: the tokenizer points operator words here, so a word that only expands to
+// "|" or "&" stays an argument and never becomes syntax
+char pipe_word[] = "|", bg_word[] = "&";
+
+/// @brief Mark the words of a command: substitutions rejoined into one word, | and & words pointed at
+/// pipe_word and bg_word and counted
+/// @param argv the words, NUL terminated and in order within one buffer
+/// @param n number of words
+/// @param num_pipes where to add the number of | words
+/// @param bg where to store whether there is an & word
+/// @return number of words after rejoining
+int classify_words(char **argv, int n, int *num_pipes, int *bg)
+{
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // the delimiters inside a substitution were spaces: put them back
+        char *w = argv[i];
+        int depth = subst_depth(w, 0);
+        while (depth > 0 && i + 1 < n)
+        {
+            for (char *p = argv[i] + strlen(argv[i]); p < argv[i + 1]; p++)
+                *p = ' ';
+            depth = subst_depth(argv[++i], depth);
+        }
+        argv[kept++] = w;
+    }
+    n = kept;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (argv[i][0] == '|' && argv[i][1] == '\0')
+        {
+            argv[i] = pipe_word;
+            *num_pipes += 1;
+        }
+        else if (argv[i][0] == '&' && argv[i][1] == '\0')
+        {
+            argv[i] = bg_word;
+            *bg = 1;
+        }
+    }
+    return n;
+}
+
+/*
+ * HERE-DOCUMENTS
+ */
+
+/// @brief Find a <<WORD (or << WORD) here-document operator among the words of a command
+/// @param argv the words
+/// @param n number of words
+/// @param delim where to store the delimiter word, quotes removed
+/// @param size size of delim
+/// @param strip_tabs where to store whether it was <<- (leading tabs are stripped)
+/// @param num where to store the number of words the operator takes (1 or 2)
+/// @return index of the operator, or -1 if there is none
+int find_heredoc(char **argv, int n, char *delim, size_t size, int *strip_tabs, int *num)
+{
+    for (int i = 0; i < n; i++)
+    {
+        char *w = argv[i];
+        if (strncmp(w, "<<", 2) != 0 || w[2] == '<')
+            continue;
+        w += 2;
+        *strip_tabs = *w == '-';
+        w += *strip_tabs;
+        *num = 1;
+        if (*w == '\0')
+        {
+            if (i + 1 >= n)
+                return -1;
+            w = argv[i + 1];
+            *num = 2;
+        }
+
+        // 'EOF' and "EOF" delimit like EOF (bodies are never expanded anyway)
+        size_t len = strlen(w);
+        if (len >= 2 && (w[0] == '\'' || w[0] == '"') && w[len - 1] == w[0])
+        {
+            w++;
+            len -= 2;
+        }
+        snprintf(delim, size, "%.*s", (int)len, w);
+        return i;
+    }
+    return -1;
+}
+
+/// @brief Check whether a line of a here-document is its delimiter
+/// @param line the line, without its newline
+/// @param len its length
+/// @param delim the delimiter
+/// @param strip_tabs leading tabs do not count (<<-)
+/// @return true if the here-document ends here
+int heredoc_end(const char *line, size_t len, const char *delim, int strip_tabs)
+{
+    while (strip_tabs && len > 0 && *line == '\t')
+    {
+        line++;
+        len--;
+    }
+    return len == strlen(delim) && memcmp(line, delim, len) == 0;
+}
+
+/// @brief Append a line of a here-document to its body
+/// @param body pointer to the malloc'd body
+/// @param len pointer to the body length
+/// @param cap pointer to the body capacity
+/// @param line the line, without its newline
+/// @param n its length
+/// @param strip_tabs drop leading tabs (<<-)
+void heredoc_append(char **body, uint32_t *len, uint32_t *cap, const char *line, size_t n, int strip_tabs)
+{
+    while (strip_tabs && n > 0 && *line == '\t')
+    {
+        line++;
+        n--;
+    }
+    grow_array(body, cap, *len + n + 2, 1);
+    memcpy(*body + *len, line, n);
+    *len += n;
+    (*body)[(*len)++] = '\n';
+    (*body)[*len] = '\0';
+}
+
+/// @brief Put here-document data into a sealed memfd, ready to be a job's stdin
+/// @param data the data
+/// @param len number of bytes
+/// @return the descriptor positioned at the start, or -1 on failure
+int heredoc_fd(const char *data, size_t len)
+{
+    int fd = memfd_create("wsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n <= 0)
+        {
+            perror("heredoc");
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+
+    // nothing can change the data once it is handed out
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/// @brief Take <<WORD and <<< word operators out of a command and build the stdin they describe
+/// @param argc pointer to the argument count (including NULL termination), updated
+/// @param argv the argument vector, operators are removed from it
+/// @param heredoc body of the line's here-document, or NULL if it has none
+/// @param fd where to store the stdin descriptor, -1 if there is no operator
+/// @return 0 on success, -1 on a malformed operator (a message is printed)
+int parse_here_input(int *argc, char **argv, char *heredoc, int *fd)
+{
+    char *data = NULL;
+    int kept = 0, stage = 0, err = 0;
+
+    *fd = -1;
+    for (int i = 0; i < *argc - 1; i++)
+    {
+        char *w = argv[i];
+        char *word = NULL;
+        if (w == pipe_word)
+            stage++;
+
+        if (strncmp(w, "<<<", 3) == 0)
+        {
+            // here-string: the word and a newline
+            word = w[3] ? w + 3 : (i + 2 < *argc ? argv[++i] : NULL);
+            if (word == NULL)
+                err = 1;
+            free(data);
+            data = word ? malloc(strlen(word) + 2) : NULL;
+            if (data)
+                sprintf(data, "%s\n", word);
+        }
+        else if (strncmp(w, "<<", 2) == 0)
+        {
+            // here-document: the body the runner collected
+            if (w[2] == '\0' || (w[2] == '-' && w[3] == '\0'))
+                i++;
+            if (heredoc == NULL || i >= *argc - 1)
+                err = 1;
+            free(data);
+            data = heredoc ? strdup(heredoc) : NULL;
+        }
+        else
+        {
+            argv[kept++] = w;
+            continue;
+        }
+        if (stage > 0)
+            err = 2;
+    }
+    argv[kept] = NULL;
+    *argc = kept + 1;
+
+    if (err)
+    {
+        printf(err == 1 ? "Error: here-document without a body.\n"
+                        : "Error: here-documents only feed the first command of a pipeline.\n");
+        free(data);
+        return -1;
+    }
+    if (data)
+    {
+        *fd = heredoc_fd(data, strlen(data));
+        free(data);
+        if (*fd < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/// @brief Take <&N and >&N operators out of a command: the job's stdin or stdout becomes descriptor N
+/// of the shell, such as an end of a coprocess
+/// @param argc pointer to the argument count (including NULL termination), updated
+/// @param argv the argument vector, operators are removed from it
+/// @param in where to store the stdin descriptor, -1 if there is no <&N
+/// @param out where to store the stdout descriptor, -1 if there is no >&N
+/// @return 0 on success, -1 on a malformed operator (a message is printed)
+int parse_fd_redirects(int *argc, char **argv, int *in, int *out)
+{
+    int kept = 0, stage = 0, stages = 1, out_stage = 0;
+
+    *in = *out = -1;
+    for (int i = 0; i < *argc - 1; i++)
+        stages += argv[i] == pipe_word;
+    for (int i = 0; i < *argc - 1; i++)
+    {
+        char *w = argv[i], *end;
+        if (w == pipe_word)
+            stage++;
+        if ((w[0] != '<' && w[0] != '>') || w[1] != '&')
+        {
+            argv[kept++] = w;
+            continue;
+        }
+
+        long fd = strtol(w + 2, &end, 10);
+        if (w[2] == '\0' || *end != '\0' || fd < 0 || fd != (int)fd || fcntl(fd, F_GETFD) < 0)
+        {
+            printf("Error: %s is not an open file descriptor.\n", w + 2);
+            return -1;
+        }
+        if (w[0] == '<' && stage > 0)
+        {
+            printf("Error: <& only feeds the first command of a pipeline.\n");
+            return -1;
+        }
+        *(w[0] == '<' ? in : out) = fd;
+        if (w[0] == '>')
+            out_stage = stage;
+    }
+    argv[kept] = NULL;
+    *argc = kept + 1;
+
+    if (*out >= 0 && out_stage != stages - 1)
+    {
+        printf("Error: >& only redirects the last command of a pipeline.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * COMMAND CACHE
+ */
+
+#define CACHE_MAGIC "WSHK" /* not WSHC_MAGIC: both kinds of file can sit in cache_dir() */
+
+// cache entries start with this header, followed by the captured stdout
+typedef struct cache_header
+{
+    char magic[4]; /* CACHE_MAGIC */
+    int32_t status; /* exit status of the command */
+    int64_t reserved;
+} cache_header;
+
+// 128-bit content key built from two FNV-1a lanes
+typedef struct cache_key
+{
+    uint64_t h1, h2;
+} cache_key;
+
+/// @brief Feed bytes into a cache key
+/// @param k the key
+/// @param data the bytes
+/// @param len number of bytes
+void cache_key_update(cache_key *k, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        k->h1 = (k->h1 ^ p[i]) * 0x100000001b3ULL;
+        k->h2 = (k->h2 ^ p[i]) * 0x100000001b3ULL;
+        k->h2 ^= k->h2 >> 29;
+    }
+}
+
+/// @brief Feed a string and its terminating NUL into a cache key
+/// @param k the key
+/// @param s the string
+void cache_key_string(cache_key *k, const char *s)
+{
+    cache_key_update(k, s, strlen(s) + 1);
+}
+
+/// @brief Feed the path, size, mtime and contents of an input file into a cache key
+/// @param k the key
+/// @param path the file
+/// @return 0 on success, -1 if the file cannot be read
+int cache_key_file(cache_key *k, const char *path)
+{
+    char buf[65536];
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    cache_key_string(k, path);
+    cache_key_update(k, &st.st_size, sizeof(st.st_size));
+    cache_key_update(k, &st.st_mtim, sizeof(st.st_mtim));
+
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        cache_key_update(k, buf, n);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/// @brief Create a directory and its parents
+/// @param path the directory
+/// @return 0 on success, -1 on failure
+int mkdir_p(char *path)
+{
+    char tmp[4096];
+
+    if (strlen(path) >= sizeof(tmp))
+        return -1;
+    strcpy(tmp, path);
+    for (char *p = tmp + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+    return (mkdir(tmp, 0755) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+/// @brief Find the cache directory: $WSH_CACHE_DIR, $XDG_CACHE_HOME/wsh or ~/.cache/wsh
+/// @param dir buffer for the path
+/// @param size size of dir
+/// @return 0 on success, -1 if no directory can be used
+int cache_dir(char *dir, size_t size)
+{
+    char *env;
+
+    if ((env = getenv("WSH_CACHE_DIR")) != NULL && *env)
+        snprintf(dir, size, "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env)
+        snprintf(dir, size, "%s/wsh", env);
+    else if ((env = getenv("HOME")) != NULL && *env)
+        snprintf(dir, size, "%s/.cache/wsh", env);
+    else
+        return -1;
+    return mkdir_p(dir);
+}
+
+/// @brief Copy a byte range of a regular file to a descriptor without going through user space
+/// @param out destination descriptor
+/// @param in source regular file
+/// @param offset where the range starts in in
+/// @param len number of bytes
+void copy_out(int out, int in, off_t offset, off_t len)
+{
+    struct stat st;
+    char buf[65536];
+
+    // copy_file_range can share extents when stdout is a file, sendfile handles pipes and terminals
+    if (fstat(out, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        loff_t off_in = offset;
+        while (len > 0)
+        {
+            ssize_t n = copy_file_range(in, &off_in, out, NULL, len, 0);
+            if (n <= 0)
+                break;
+            len -= n;
+        }
+        offset = off_in;
+    }
+    while (len > 0)
+    {
+        ssize_t n = sendfile(out, in, &offset, len);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    // last resort: plain read/write
+    while (len > 0)
+    {
+        ssize_t n = pread(in, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf), offset);
+        if (n <= 0 || write(out, buf, n) != n)
+            break;
+        offset += n;
+        len -= n;
+    }
+}
+
+/// @brief cache runs a deterministic command once and replays its stdout and exit status afterwards
+/// USAGE: cache [-i FILE]... [--inputs FILE... --] [-e VAR]... command [| command]...
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+/// @param attrs spawn attributes of the command
+/// @param cmd the command line, kept for messages
+void wsh_cache(int argc, char *argv[], spawn_attrs *attrs, char *cmd)
+{
+    char *inputs[256], *envs[256];
+    int num_inputs = 0, num_envs = 0;
+    int i = 1;
+
+    // collect options
+    while (i < argc - 1 && argv[i][0] == '-')
+    {
+        if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0) && i + 1 < argc - 1 && num_inputs < 256)
+        {
+            inputs[num_inputs++] = argv[i + 1];
+            i += 2;
+        }
+        else if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--env") == 0) && i + 1 < argc - 1 && num_envs < 256)
+        {
+            envs[num_envs++] = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--inputs") == 0)
+        {
+            for (i += 1; i < argc - 1 && strcmp(argv[i], "--") != 0 && num_inputs < 256; i++)
+                inputs[num_inputs++] = argv[i];
+            i += 1;
+        }
+        else if (strcmp(argv[i], "--") == 0)
+        {
+            i += 1;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (i >= argc - 1)
+    {
+        printf("USAGE: cache [-i FILE]... [--inputs FILE... --] [-e VAR]... command\n");
+        return;
+    }
+
+    // key: working directory, command words, inputs and chosen environment
+    cache_key k = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    char cwd[4096];
+    cache_key_string(&k, "wsh-cache-1");
+    if (getcwd(cwd, sizeof(cwd)))
+        cache_key_string(&k, cwd);
+    for (int a = i; a < argc - 1; a++)
+        cache_key_string(&k, argv[a]);
+    for (int f = 0; f < num_inputs; f++)
+    {
+        if (cache_key_file(&k, inputs[f]) < 0)
+        {
+            printf("Error: cache input %s cannot be read.\n", inputs[f]);
+            return;
+        }
+    }
+    for (int e = 0; e < num_envs; e++)
+    {
+        char *value = getenv(envs[e]);
+        cache_key_string(&k, envs[e]);
+        cache_key_string(&k, value ? value : "\001unset");
+    }
+
+    char dir[4096], path[4200], tmp_path[4300];
+    if (cache_dir(dir, sizeof(dir)) < 0)
+    {
+        printf("Error: no usable cache directory.\n");
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%016llx%016llx", dir, (unsigned long long)k.h1, (unsigned long long)k.h2);
+
+    // hit: replay stdout and exit status
+    cache_header h;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, CACHE_MAGIC, 4) == 0 && fstat(fd, &st) == 0)
+        {
+            fflush(stdout);
+            copy_out(STDOUT_FILENO, fd, sizeof(h), st.st_size - sizeof(h));
+            close(fd);
+            last_status = h.status;
+            return;
+        }
+        close(fd);
+    }
+
+    // miss: run the command with stdout going into a temporary entry
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("cache");
+        return;
+    }
+    memset(&h, 0, sizeof(h));
+    lseek(fd, sizeof(h), SEEK_SET);
+
+    process *first_p = build_pipeline(argc - i, argv + i);
+    if (first_p == NULL)
+    {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    job *j = (struct job *)malloc(sizeof(struct job));
+    populate_job_struct(j, first_p, 1, first_p->next != NULL);
+    j->attrs = *attrs;
+    j->command = strdup(cmd);
+    j->stdout = fd;
+    add_job(j);
+    run_job(j, 1);
+
+    // only normal exits are stored, interrupted or timed out runs are not
+    process *last = j->first_process;
+    while (last->next)
+        last = last->next;
+    if (!j->timed_out && job_is_completed(j) && WIFEXITED(last->status))
+    {
+        memcpy(h.magic, CACHE_MAGIC, 4);
+        h.status = WEXITSTATUS(last->status);
+        if (pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && rename(tmp_path, path) == 0)
+            tmp_path[0] = '\0';
+    }
+
+    // show the captured output
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(h))
+    {
+        fflush(stdout);
+        copy_out(STDOUT_FILENO, fd, sizeof(h), st.st_size - sizeof(h));
+    }
+    close(fd);
+    if (tmp_path[0])
+        unlink(tmp_path);
+}
+
+/*
+ * COMPILED BATCH FILES
+ */
+
+#define WSHC_MAGIC "WSHC" /* not WSH_BOARD_MAGIC or CACHE_MAGIC: no other file is taken for a compiled batch */
+#define WSHC_VERSION 3
+#define WSHC_NONE 0xffffffffu
+
+// header of a compiled batch file, followed by the line records, the token
+// string indices, the string offsets and the interned string bytes
+typedef struct wshc_header
+{
+    char magic[4];          /* WSHC_MAGIC */
+    uint32_t version;       /* WSHC_VERSION */
+    uint64_t src_size;      /* size of the batch file it was compiled from */
+    int64_t src_mtime_sec;  /* mtime of the batch file */
+    int64_t src_mtime_nsec;
+    uint64_t src_ino;       /* inode of the batch file */
+    uint64_t hash1, hash2;  /* content hash of the batch file */
+    uint32_t num_lines;     /* line records */
+    uint32_t num_tokens;    /* token string indices */
+    uint32_t num_strings;   /* interned strings */
+    uint32_t strings_size;  /* bytes of string data */
+} wshc_header;
+
+// one non-empty batch line with its precomputed pipeline structure
+typedef struct wshc_line
+{
+    uint32_t first_token; /* index of the first token */
+    uint32_t num_tokens;  /* number of words */
+    uint32_t text;        /* string index of the whole line */
+    uint16_t num_pipes;   /* number of | words */
+    uint16_t bg;          /* there is an & word */
+    uint32_t heredoc;     /* string index of the <<WORD here-document body, WSHC_NONE if none */
+    uint32_t offset;      /* byte offset of the line in the batch file */
+} wshc_line;
+
+// a compiled batch file, either mapped from disk or freshly built in memory
+typedef struct wshc
+{
+    void *base;            /* start of the header */
+    size_t size;           /* total size */
+    int mapped;            /* base is an mmap (munmap) rather than malloc (free) */
+    wshc_header *header;
+    wshc_line *lines;
+    uint32_t *tokens;
+    uint32_t *offsets;
+    char *strings;
+} wshc;
+
+// string interning table used while compiling
+typedef struct wshc_builder
+{
+    wshc_line *lines;
+    uint32_t num_lines, cap_lines;
+    uint32_t *tokens;
+    uint32_t num_tokens, cap_tokens;
+    uint32_t *offsets;
+    uint32_t num_strings, cap_strings;
+    char *strings;
+    uint32_t strings_size, cap_bytes;
+    uint32_t *table; /* open addressing, string index + 1, 0 = empty */
+    uint32_t table_size;
+} wshc_builder;
+
+/// @brief Grow a dynamic array so it holds at least need elements
+/// @param arr pointer to the array pointer
+/// @param cap pointer to the capacity in elements
+/// @param need required number of elements
+/// @param elem size of one element
+void grow_array(void *arr, uint32_t *cap, uint32_t need, size_t elem)
+{
+    if (need <= *cap)
+        return;
+    uint32_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need)
+        new_cap *= 2;
+    *(void **)arr = realloc(*(void **)arr, new_cap * elem);
+    *cap = new_cap;
+}
+
+/// @brief FNV-1a hash of a string
+/// @param s the string
+/// @param len its length
+/// @return 32-bit hash
+uint32_t hash_string(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/// @brief Intern a string, returning the index of an identical earlier string if there is one
+/// @param b the builder
+/// @param s the string
+/// @return string index
+uint32_t wshc_intern(wshc_builder *b, const char *s)
+{
+    size_t len = strlen(s);
+
+    if (b->num_strings * 2 >= b->table_size)
+    {
+        // rehash into a table twice as large
+        uint32_t new_size = b->table_size ? b->table_size * 2 : 1024;
+        uint32_t *table = calloc(new_size, sizeof(uint32_t));
+        for (uint32_t i = 0; i < b->num_strings; i++)
+        {
+            const char *str = b->strings + b->offsets[i];
+            uint32_t slot = hash_string(str, strlen(str)) & (new_size - 1);
+            while (table[slot])
+                slot = (slot + 1) & (new_size - 1);
+            table[slot] = i + 1;
+        }
+        free(b->table);
+        b->table = table;
+        b->table_size = new_size;
+    }
+
+    uint32_t slot = hash_string(s, len) & (b->table_size - 1);
+    while (b->table[slot])
+    {
+        uint32_t idx = b->table[slot] - 1;
+        if (strcmp(b->strings + b->offsets[idx], s) == 0)
+            return idx;
+        slot = (slot + 1) & (b->table_size - 1);
+    }
+
+    grow_array(&b->offsets, &b->cap_strings, b->num_strings + 1, sizeof(uint32_t));
+    grow_array(&b->strings, &b->cap_bytes, b->strings_size + len + 1, 1);
+    b->offsets[b->num_strings] = b->strings_size;
+    memcpy(b->strings + b->strings_size, s, len + 1);
+    b->strings_size += len + 1;
+    b->table[slot] = b->num_strings + 1;
+    return b->num_strings++;
+}
+
+/// @brief Point the section pointers of a compiled batch file into its buffer, checking the bounds
+/// @param c the compiled batch file (base and size set)
+/// @return 0 if the layout is consistent, -1 otherwise
+int wshc_layout(wshc *c)
+{
+    wshc_header *h = c->base;
+
+    if (c->size < sizeof(wshc_header) || memcmp(h->magic, WSHC_MAGIC, 4) != 0 || h->version != WSHC_VERSION)
+        return -1;
+    // 64-bit sums: a 32-bit size_t could wrap around to the file size
+    uint64_t need = sizeof(wshc_header) + (uint64_t)h->num_lines * sizeof(wshc_line) +
+                    (uint64_t)h->num_tokens * sizeof(uint32_t) + (uint64_t)h->num_strings * sizeof(uint32_t) +
+                    h->strings_size;
+    if (need != c->size)
+        return -1;
+    c->header = h;
+    c->lines = (wshc_line *)(h + 1);
+    c->tokens = (uint32_t *)(c->lines + h->num_lines);
+    c->offsets = c->tokens + h->num_tokens;
+    c->strings = (char *)(c->offsets + h->num_strings);
+    return 0;
+}
+
+/// @brief Check every index of a laid out compiled batch file, so that a truncated, stale or edited
+/// file is recompiled instead of read out of bounds
+/// @param c the compiled batch file (wshc_layout done)
+/// @return 0 if every index is in range, -1 otherwise
+int wshc_validate(wshc *c)
+{
+    wshc_header *h = c->header;
+
+    // the string table ends with a NUL, so every string in it is terminated
+    if (h->num_strings > 0 && (h->strings_size == 0 || c->strings[h->strings_size - 1] != '\0'))
+        return -1;
+    for (uint32_t i = 0; i < h->num_strings; i++)
+        if (c->offsets[i] >= h->strings_size)
+            return -1;
+    for (uint32_t i = 0; i < h->num_tokens; i++)
+        if (c->tokens[i] >= h->num_strings)
+            return -1;
+
+    // lines come in file order, the journal binary-searches their offsets
+    for (uint32_t l = 0; l < h->num_lines; l++)
+    {
+        wshc_line *line = &c->lines[l];
+        if ((uint64_t)line->first_token + line->num_tokens > h->num_tokens || line->num_tokens == 0 ||
+            line->num_pipes > line->num_tokens || line->text >= h->num_strings ||
+            (line->heredoc != WSHC_NONE && line->heredoc >= h->num_strings) || line->offset > h->src_size ||
+            (l > 0 && line->offset <= c->lines[l - 1].offset))
+            return -1;
+    }
+    return 0;
+}
+
+/// @brief Compile batch file contents: split lines, tokenize once, intern every word
+/// @param src the file contents
+/// @param size number of bytes
+/// @param st stat of the batch file, recorded for quick validation
+/// @param k content hash of the batch file
+/// @param c the compiled result (malloc'd)
+void wshc_compile(const char *src, size_t size, struct stat *st, cache_key *k, wshc *c)
+{
+    wshc_builder b;
+    memset(&b, 0, sizeof(b));
+
+    // one pass over a padded copy of the file: the block scanner finds newlines and spaces
+    // together and replaces them with NUL, so every word is terminated in place
+    size_t padded = (size + 1 + 63) & ~(size_t)63;
+    char *buf = malloc(padded);
+    memcpy(buf, src, size);
+    memset(buf + size, '\n', padded - size);
+
+    char **words = NULL, *line = NULL;
+    uint32_t num_words = 0, cap_words = 0, cap_line = 0;
+    size_t line_start = 0;
+    uint64_t carry = 0;
+
+    // here-document lines are collected verbatim into body instead of being tokenized
+    char delim[256], *body = NULL;
+    int in_heredoc = 0, strip_tabs = 0, num_op;
+    uint32_t heredoc_line = 0, body_len = 0, cap_body = 0;
+
+    for (size_t i = 0; i < padded && line_start <= size; i += 64)
+    {
+        uint64_t newlines, spaces = scan_block(buf + i, &newlines);
+        uint64_t word = ~(spaces | newlines);
+        uint64_t starts = word & ~((word << 1) | carry);
+        carry = word >> 63;
+
+        // walk word starts and line ends in file order
+        uint64_t events = starts | newlines;
+        while (events && line_start <= size)
+        {
+            int bit = __builtin_ctzll(events);
+            size_t pos = i + bit;
+            events &= events - 1;
+            if (!(newlines >> bit & 1))
+            {
+                if (in_heredoc)
+                    continue;
+                grow_array(&words, &cap_words, num_words + 1, sizeof(char *));
+                words[num_words++] = buf + pos;
+                continue;
+            }
+
+            size_t end = pos < size ? pos : size;
+            if (in_heredoc)
+            {
+                if (heredoc_end(src + line_start, end - line_start, delim, strip_tabs))
+                {
+                    b.lines[heredoc_line].heredoc = wshc_intern(&b, body_len ? body : "");
+                    in_heredoc = 0;
+                    body_len = 0;
+                }
+                else if (line_start < size)
+                {
+                    heredoc_append(&body, &body_len, &cap_body, src + line_start, end - line_start, strip_tabs);
+                }
+            }
+            else if (num_words > 0)
+            {
+                int num_pipes = 0, bg = 0;
+                num_words = classify_words(words, num_words, &num_pipes, &bg);
+
+                size_t len = end - line_start;
+                grow_array(&line, &cap_line, len + 1, 1);
+                memcpy(line, src + line_start, len);
+                line[len] = '\0';
+
+                grow_array(&b.lines, &b.cap_lines, b.num_lines + 1, sizeof(wshc_line));
+                grow_array(&b.tokens, &b.cap_tokens, b.num_tokens + num_words, sizeof(uint32_t));
+                wshc_line *l = &b.lines[b.num_lines++];
+                l->first_token = b.num_tokens;
+                l->num_tokens = num_words;
+                l->num_pipes = num_pipes;
+                l->bg = bg;
+                l->text = wshc_intern(&b, line);
+                l->heredoc = WSHC_NONE;
+                l->offset = line_start;
+                for (uint32_t w = 0; w < num_words; w++)
+                    b.tokens[b.num_tokens++] = wshc_intern(&b, words[w]);
+
+                // the following lines up to the delimiter are the body
+                if (find_heredoc(words, num_words, delim, sizeof(delim), &strip_tabs, &num_op) >= 0)
+                {
+                    in_heredoc = 1;
+                    heredoc_line = b.num_lines - 1;
+                }
+            }
+            num_words = 0;
+            line_start = pos + 1;
+        }
+    }
+
+    // a here-document missing its delimiter runs to the end of the file
+    if (in_heredoc)
+        b.lines[heredoc_line].heredoc = wshc_intern(&b, body_len ? body : "");
+
+    // serialize into one buffer with the on-disk layout
+    size_t total = sizeof(wshc_header) + (size_t)b.num_lines * sizeof(wshc_line) +
+                   (size_t)b.num_tokens * sizeof(uint32_t) + (size_t)b.num_strings * sizeof(uint32_t) +
+                   b.strings_size;
+    wshc_header *h = calloc(1, total);
+    memcpy(h->magic, WSHC_MAGIC, 4);
+    h->version = WSHC_VERSION;
+    h->src_size = st->st_size;
+    h->src_mtime_sec = st->st_mtim.tv_sec;
+    h->src_mtime_nsec = st->st_mtim.tv_nsec;
+    h->src_ino = st->st_ino;
+    h->hash1 = k->h1;
+    h->hash2 = k->h2;
+    h->num_lines = b.num_lines;
+    h->num_tokens = b.num_tokens;
+    h->num_strings = b.num_strings;
+    h->strings_size = b.strings_size;
+
+    c->base = h;
+    c->size = total;
+    c->mapped = 0;
+    wshc_layout(c);
+    if (b.num_lines)
+        memcpy(c->lines, b.lines, b.num_lines * sizeof(wshc_line));
+    if (b.num_tokens)
+        memcpy(c->tokens, b.tokens, b.num_tokens * sizeof(uint32_t));
+    if (b.num_strings)
+        memcpy(c->offsets, b.offsets, b.num_strings * sizeof(uint32_t));
+    if (b.strings_size)
+        memcpy(c->strings, b.strings, b.strings_size);
+
+    free(buf);
+    free(line);
+    free(words);
+    free(body);
+    free(b.lines);
+    free(b.tokens);
+    free(b.offsets);
+    free(b.strings);
+    free(b.table);
+}
+
+/// @brief Find where the compiled form of a batch file lives: next to it, or in the cache directory
+/// @param batch_file the batch file
+/// @param path buffer for the path
+/// @param size size of path
+/// @param next_to_file try the batch file's directory (1) or the cache directory (0)
+/// @return 0 on success, -1 if there is no such location
+int wshc_path(char *batch_file, char *path, size_t size, int next_to_file)
+{
+    if (next_to_file)
+    {
+        snprintf(path, size, "%s.wshc", batch_file);
+        return 0;
+    }
+
+    char dir[4096], real[4096];
+    if (cache_dir(dir, sizeof(dir)) < 0 || realpath(batch_file, real) == NULL)
+        return -1;
+    cache_key k = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    cache_key_string(&k, real);
+    snprintf(path, size, "%s/%016llx%016llx.wshc", dir, (unsigned long long)k.h1, (unsigned long long)k.h2);
+    return 0;
+}
+
+/// @brief Map a compiled batch file and check that it belongs to the current batch file contents
+/// @param path the compiled file
+/// @param st stat of the batch file
+/// @param src batch file contents, hashed only if the stat check fails (may be NULL to skip)
+/// @param k where the content hash is computed (h1 == 0 if not computed yet)
+/// @param c the mapped result
+/// @return 0 if it is valid, -1 otherwise
+int wshc_load(char *path, struct stat *st, const char *src, cache_key *k, wshc *c)
+{
+    struct stat cst;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &cst) < 0 || cst.st_size < (off_t)sizeof(wshc_header))
+    {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    c->base = base;
+    c->size = cst.st_size;
+    c->mapped = 1;
+    if (wshc_layout(c) == 0 && wshc_validate(c) == 0)
+    {
+        wshc_header *h = c->header;
+        // same size, mtime and inode: trust it without reading the batch file
+        if (h->src_size == (uint64_t)st->st_size && h->src_mtime_sec == st->st_mtim.tv_sec &&
+            h->src_mtime_nsec == st->st_mtim.tv_nsec && h->src_ino == (uint64_t)st->st_ino)
+            return 0;
+        // otherwise the content hash decides (e.g. the file was only touched or copied)
+        if (src != NULL)
+        {
+            if (k->h1 == 0)
+            {
+                *k = (cache_key){0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+                cache_key_update(k, src, st->st_size);
+            }
+            if (h->hash1 == k->h1 && h->hash2 == k->h2)
+                return 0;
+        }
+    }
+    munmap(base, cst.st_size);
+    return -1;
+}
+
+/// @brief Write a compiled batch file atomically (temporary file + rename)
+/// @param path destination
+/// @param c the compiled batch file
+/// @return 0 on success, -1 on failure
+int wshc_store(char *path, wshc *c)
+{
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    fchmod(fd, 0644);
+    const char *p = c->base;
+    size_t left = c->size;
+    while (left > 0)
+    {
+        ssize_t n = write(fd, p, left);
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    close(fd);
+    if (left > 0 || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Get the compiled form of a batch file: map a valid .wshc or compile (and store) a new one
+/// @param batch_file the batch file
+/// @param c the compiled result
+/// @return 0 on success, -1 if the batch file cannot be read
+int wshc_open(char *batch_file, wshc *c)
+{
+    struct stat st;
+    char path[4200];
+    cache_key k = {0, 0};
+
+    int fd = open(batch_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // fast path: the compiled form matches size/mtime/inode, the batch file is never read
+    for (int next_to = 1; next_to >= 0; next_to--)
+    {
+        if (wshc_path(batch_file, path, sizeof(path), next_to) == 0 && wshc_load(path, &st, NULL, &k, c) == 0)
+        {
+            close(fd);
+            return 0;
+        }
+    }
+
+    char *src = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (src == MAP_FAILED)
+        return -1;
+
+    // same contents under a new mtime: reuse it and refresh the recorded stat by storing it again
+    for (int next_to = 1; next_to >= 0; next_to--)
+    {
+        if (src && wshc_path(batch_file, path, sizeof(path), next_to) == 0 && wshc_load(path, &st, src, &k, c) == 0)
+        {
+            wshc fresh = *c;
+            void *copy = malloc(c->size);
+            memcpy(copy, c->base, c->size);
+            munmap(c->base, c->size);
+            fresh.base = copy;
+            fresh.mapped = 0;
+            wshc_layout(&fresh);
+            fresh.header->src_size = st.st_size;
+            fresh.header->src_mtime_sec = st.st_mtim.tv_sec;
+            fresh.header->src_mtime_nsec = st.st_mtim.tv_nsec;
+            fresh.header->src_ino = st.st_ino;
+            wshc_store(path, &fresh);
+            *c = fresh;
+            munmap(src, st.st_size);
+            return 0;
+        }
+    }
+
+    if (k.h1 == 0)
+    {
+        k = (cache_key){0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+        cache_key_update(&k, src ? src : "", st.st_size);
+    }
+    wshc_compile(src ? src : "", st.st_size, &st, &k, c);
+    if (src)
+        munmap(src, st.st_size);
+
+    // store it next to the batch file if possible, in the cache directory otherwise
+    for (int next_to = 1; next_to >= 0; next_to--)
+        if (wshc_path(batch_file, path, sizeof(path), next_to) == 0 && wshc_store(path, c) == 0)
+            break;
+    return 0;
+}
+
+/// @brief Release a compiled batch file
+/// @param c the compiled batch file
+void wshc_close(wshc *c)
+{
+    if (c->mapped)
+        munmap(c->base, c->size);
+    else
+        free(c->base);
+}
+
+/*
+ * COMMAND HISTORY
+ */
+
+#define HIST_VERSION 1
+#define HIST_DEAD 1
+#define HIST_GRAM_BUCKETS 65536
+
+// history file header, followed by records appended back to back
+typedef struct hist_header
+{
+    char magic[4];    /* "WSHH" */
+    uint32_t version; /* HIST_VERSION */
+    uint64_t used;    /* bytes in use, header included */
+    uint64_t dead;    /* bytes of records superseded by a later duplicate */
+} hist_header;
+
+// one command, followed by its NUL terminated text and padded to 8 bytes
+typedef struct hist_record
+{
+    uint32_t len;   /* text length without the NUL */
+    uint32_t flags; /* HIST_DEAD once the same command was added again */
+} hist_record;
+
+// entries containing a (hashed) trigram, oldest first
+typedef struct hist_postings
+{
+    uint32_t *ids;
+    uint32_t len, cap;
+} hist_postings;
+
+// this session's view of the mapped history file
+typedef struct hist_index
+{
+    int fd;
+    ino_t ino;
+    char path[4096];
+    char *map;
+    size_t map_size;
+    uint64_t indexed;  /* file offset up to which records are indexed */
+    uint64_t *offsets; /* record offsets, oldest first */
+    uint32_t num, cap_offsets;
+    uint32_t *table; /* text hash -> newest entry index + 1, 0 = empty */
+    uint32_t table_size, table_used;
+    hist_postings *grams; /* trigram index, built on the first search */
+    uint32_t grams_indexed; /* entries covered by the trigram index */
+} hist_index;
+
+hist_index history = {.fd = -1};
+
+/// @brief Trigram index bucket of the three bytes at s
+/// @param s the bytes
+/// @return bucket number
+uint32_t hist_gram(const char *s)
+{
+    uint32_t gram = (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+    return (gram * 2654435761u) >> 16;
+}
+
+/// @brief Size of a record holding a text of len bytes
+/// @param len text length
+/// @return record size in bytes
+uint64_t hist_record_size(uint32_t len)
+{
+    return (sizeof(hist_record) + len + 1 + 7) & ~(uint64_t)7;
+}
+
+/// @brief Record of a history entry
+/// @param i entry index
+/// @return the record
+hist_record *hist_record_at(uint32_t i)
+{
+    return (hist_record *)(history.map + history.offsets[i]);
+}
+
+/// @brief Text of a history entry
+/// @param i entry index, 0 is the oldest
+/// @return the command line
+char *hist_text(uint32_t i)
+{
+    return (char *)(hist_record_at(i) + 1);
+}
+
+/// @brief Find the slot of a text in the dedup table
+/// @param text the command line
+/// @param len its length
+/// @return pointer to the slot, empty or holding the entry with this text
+uint32_t *hist_slot(const char *text, uint32_t len)
+{
+    uint32_t mask = history.table_size - 1;
+    uint32_t s = hash_string(text, len) & mask;
+    while (history.table[s])
+    {
+        hist_record *r = hist_record_at(history.table[s] - 1);
+        if (r->len == len && memcmp(r + 1, text, len) == 0)
+            break;
+        s = (s + 1) & mask;
+    }
+    return &history.table[s];
+}
+
+/// @brief Make an entry the one the dedup table returns for its text
+/// @param i entry index
+void hist_table_put(uint32_t i)
+{
+    if ((history.table_used + 1) * 2 > history.table_size)
+    {
+        // rebuild twice as large from the entries that are still live
+        free(history.table);
+        history.table_size *= 2;
+        history.table = calloc(history.table_size, sizeof(uint32_t));
+        history.table_used = 0;
+        for (uint32_t e = 0; e < i; e++)
+            if (!(hist_record_at(e)->flags & HIST_DEAD))
+                hist_table_put(e);
+    }
+
+    hist_record *r = hist_record_at(i);
+    uint32_t *slot = hist_slot((char *)(r + 1), r->len);
+    if (*slot == 0)
+        history.table_used++;
+    *slot = i + 1;
+}
+
+/// @brief Forget the mapping and index of the history file
+void hist_reset()
+{
+    if (history.map)
+        munmap(history.map, history.map_size);
+    if (history.fd >= 0)
+        close(history.fd);
+    free(history.offsets);
+    free(history.table);
+    if (history.grams)
+        for (int g = 0; g < HIST_GRAM_BUCKETS; g++)
+            free(history.grams[g].ids);
+    free(history.grams);
+    char path[sizeof(history.path)];
+    strcpy(path, history.path);
+    memset(&history, 0, sizeof(history));
+    strcpy(history.path, path);
+    history.fd = -1;
+}
+
+/// @brief Map the history file and index the records other sessions appended since the last call
+void hist_sync()
+{
+    struct stat st;
+
+    if (history.fd < 0 || fstat(history.fd, &st) < 0)
+        return;
+    if ((size_t)st.st_size > history.map_size)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, history.fd, 0);
+        if (map == MAP_FAILED)
+            return;
+        if (history.map)
+            munmap(history.map, history.map_size);
+        history.map = map;
+        history.map_size = st.st_size;
+    }
+
+    hist_header *h = (hist_header *)history.map;
+    uint64_t used = __atomic_load_n(&h->used, __ATOMIC_ACQUIRE);
+    if (used > history.map_size)
+        return;
+    if (used < history.indexed)
+    {
+        // the history was cleared: index it again from the start
+        history.num = 0;
+        history.indexed = sizeof(hist_header);
+        memset(history.table, 0, history.table_size * sizeof(uint32_t));
+        history.table_used = 0;
+        history.grams_indexed = 0;
+        if (history.grams)
+            for (int g = 0; g < HIST_GRAM_BUCKETS; g++)
+                history.grams[g].len = 0;
+    }
+
+    while (history.indexed + sizeof(hist_record) <= used)
+    {
+        hist_record *r = (hist_record *)(history.map + history.indexed);
+        uint32_t i = history.num;
+        grow_array(&history.offsets, &history.cap_offsets, i + 1, sizeof(uint64_t));
+        history.offsets[i] = history.indexed;
+        history.num++;
+        if (!(r->flags & HIST_DEAD))
+            hist_table_put(i);
+        history.indexed += hist_record_size(r->len);
+    }
+}
+
+/// @brief Open (creating it if needed) and index the history file at history.path
+/// @return 0 on success, -1 if history is unavailable
+int hist_open_file()
+{
+    struct stat st;
+
+    history.fd = open(history.path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd < 0 || flock(history.fd, LOCK_EX) < 0 || fstat(history.fd, &st) < 0)
+    {
+        perror("history");
+        hist_reset();
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(hist_header))
+    {
+        hist_header h = {.magic = "WSHH", .version = HIST_VERSION, .used = sizeof(hist_header)};
+        if (ftruncate(history.fd, 65536) < 0 || pwrite(history.fd, &h, sizeof(h), 0) != sizeof(h))
+        {
+            perror("history");
+            hist_reset();
+            return -1;
+        }
+    }
+    else
+    {
+        hist_header h;
+        if (pread(history.fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "WSHH", 4) != 0 ||
+            h.version != HIST_VERSION)
+        {
+            fprintf(stderr, "history: %s is not a wsh history file\n", history.path);
+            hist_reset();
+            return -1;
+        }
+    }
+    history.ino = st.st_ino;
+    history.indexed = sizeof(hist_header);
+    // size the dedup table for the file up front (commands average well over 16 bytes)
+    history.table_size = 1024;
+    while (history.table_size < st.st_size / 16)
+        history.table_size *= 2;
+    history.table = calloc(history.table_size, sizeof(uint32_t));
+    hist_sync();
+    flock(history.fd, LOCK_UN);
+    return history.map ? 0 : -1;
+}
+
+/// @brief Open the history file: $WSH_HISTFILE (empty disables history) or ~/.wsh_history
+void hist_open()
+{
+    char *env = getenv("WSH_HISTFILE");
+
+    if (env != NULL)
+    {
+        if (*env == '\0')
+            return;
+        snprintf(history.path, sizeof(history.path), "%s", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && *env)
+        snprintf(history.path, sizeof(history.path), "%s/.wsh_history", env);
+    else
+        return;
+    hist_open_file();
+}
+
+/// @brief Take the history file lock, following the file if another session compacted it
+/// @return 0 with the lock held and the index up to date, -1 if history is unavailable
+int hist_lock()
+{
+    struct stat st;
+
+    while (history.fd >= 0)
+    {
+        flock(history.fd, LOCK_EX);
+        if (stat(history.path, &st) == 0 && st.st_ino == history.ino)
+        {
+            hist_sync();
+            return 0;
+        }
+        // replaced by compaction: our descriptor points at the old file
+        hist_reset();
+        if (hist_open_file() < 0)
+            return -1;
+    }
+    return -1;
+}
+
+/// @brief Rewrite the history file without dead records and switch to it (called with the lock held)
+void hist_compact()
+{
+    hist_header *h = (hist_header *)history.map;
+    size_t size = h->used - h->dead;
+    char *buf = malloc(size);
+    hist_header *nh = (hist_header *)buf;
+    uint64_t off = sizeof(hist_header);
+
+    memcpy(nh, h, sizeof(hist_header));
+    for (uint32_t i = 0; i < history.num; i++)
+    {
+        hist_record *r = hist_record_at(i);
+        if (r->flags & HIST_DEAD)
+            continue;
+        uint64_t rs = hist_record_size(r->len);
+        memcpy(buf + off, r, rs);
+        off += rs;
+    }
+    nh->used = off;
+    nh->dead = 0;
+
+    // readers keep the old file until they notice it was replaced
+    char tmp[sizeof(history.path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", history.path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || write(fd, buf, off) != (ssize_t)off || ftruncate(fd, off * 2) < 0 ||
+        rename(tmp, history.path) < 0)
+    {
+        perror("history");
+        unlink(tmp);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    hist_reset();
+    hist_open_file();
+}
+
+/// @brief Append a command line to the history, dropping an earlier copy of it
+/// @param line the command line; empty lines and lines starting with a space are not recorded
+void hist_add(const char *line)
+{
+    uint32_t len = strlen(line);
+
+    if (len == 0 || line[0] == ' ' || hist_lock() < 0)
+        return;
+
+    hist_header *h = (hist_header *)history.map;
+    uint32_t *slot = hist_slot(line, len);
+    if (*slot)
+    {
+        // already the most recent command: nothing to add
+        if (*slot == history.num)
+        {
+            flock(history.fd, LOCK_UN);
+            return;
+        }
+        hist_record *old = hist_record_at(*slot - 1);
+        old->flags |= HIST_DEAD;
+        h->dead += hist_record_size(old->len);
+    }
+
+    uint64_t rs = hist_record_size(len);
+    if (h->used + rs > history.map_size)
+    {
+        size_t size = history.map_size;
+        while (h->used + rs > size)
+            size *= 2;
+        if (ftruncate(history.fd, size) < 0)
+        {
+            flock(history.fd, LOCK_UN);
+            return;
+        }
+        hist_sync();
+        h = (hist_header *)history.map;
+    }
+
+    hist_record *r = (hist_record *)(history.map + h->used);
+    r->len = len;
+    r->flags = 0;
+    memcpy(r + 1, line, len + 1);
+    __atomic_store_n(&h->used, h->used + rs, __ATOMIC_RELEASE);
+    hist_sync();
+
+    // duplicates are dropped in place, compaction gives the space back
+    if (h->dead > 65536 && h->dead * 2 > h->used)
+        hist_compact();
+    if (history.fd >= 0)
+        flock(history.fd, LOCK_UN);
+}
+
+/// @brief Add the entries indexed since the last search to the trigram index
+void hist_index_grams()
+{
+    if (history.grams == NULL)
+        history.grams = calloc(HIST_GRAM_BUCKETS, sizeof(hist_postings));
+
+    for (uint32_t i = history.grams_indexed; i < history.num; i++)
+    {
+        hist_record *r = hist_record_at(i);
+        char *text = (char *)(r + 1);
+        for (uint32_t k = 0; k + 3 <= r->len; k++)
+        {
+            hist_postings *p = &history.grams[hist_gram(text + k)];
+            // ids arrive in order, so a repeated trigram only needs checking against the last one
+            if (p->len && p->ids[p->len - 1] == i)
+                continue;
+            grow_array(&p->ids, &p->cap, p->len + 1, sizeof(uint32_t));
+            p->ids[p->len++] = i;
+        }
+    }
+    history.grams_indexed = history.num;
+}
+
+/// @brief Count the ids of a posting list below a limit
+/// @param p the posting list
+/// @param end only look at the first end ids
+/// @param limit the limit
+/// @return number of ids among the first end that are smaller than limit
+uint32_t hist_postings_below(hist_postings *p, uint32_t end, uint32_t limit)
+{
+    uint32_t lo = 0, hi = end;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (p->ids[mid] < limit)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/// @brief Check whether a history entry matches a query
+/// @param i entry index
+/// @param query the text to look for
+/// @param qlen its length
+/// @param prefix match at the start of the command only
+/// @return true on a match
+int hist_match(uint32_t i, const char *query, size_t qlen, int prefix)
+{
+    hist_record *r = hist_record_at(i);
+    char *text = (char *)(r + 1);
+
+    if ((r->flags & HIST_DEAD) || r->len < qlen)
+        return 0;
+    return prefix ? memcmp(text, query, qlen) == 0 : memmem(text, r->len, query, qlen) != NULL;
+}
+
+/// @brief Find the most recent history entry older than before that contains (or starts with) query
+/// @param query the text to look for
+/// @param before only consider entries with a smaller index (history.num for all)
+/// @param prefix match at the start of the command only
+/// @return entry index, or -1 if there is no match
+int hist_search(const char *query, int before, int prefix)
+{
+    size_t qlen = strlen(query);
+
+    // one or two characters match most commands, a backwards scan finds one quickly
+    if (qlen < 3)
+    {
+        for (int i = before - 1; i >= 0; i--)
+            if (hist_match(i, query, qlen, prefix))
+                return i;
+        return -1;
+    }
+
+    // otherwise a match is in the posting list of every trigram of the query, rarest first
+    hist_index_grams();
+    hist_postings *lists[16];
+    uint32_t ends[16];
+    int n = 0;
+    for (size_t k = 0; k + 3 <= qlen; k++)
+    {
+        hist_postings *p = &history.grams[hist_gram(query + k)];
+        int j;
+        if (n < 16)
+            j = n++;
+        else if (p->len < lists[15]->len)
+            j = 15;
+        else
+            continue;
+        while (j > 0 && lists[j - 1]->len > p->len)
+        {
+            lists[j] = lists[j - 1];
+            j--;
+        }
+        lists[j] = p;
+    }
+    for (int j = 0; j < n; j++)
+        ends[j] = hist_postings_below(lists[j], lists[j]->len, before);
+
+    // walk the rarest list towards older entries, the others only move down with it
+    while (ends[0] > 0)
+    {
+        uint32_t id = lists[0]->ids[--ends[0]];
+        int j;
+        for (j = 1; j < n; j++)
+        {
+            ends[j] = hist_postings_below(lists[j], ends[j], id + 1);
+            if (ends[j] == 0)
+                return -1;
+            if (lists[j]->ids[ends[j] - 1] != id)
+                break;
+        }
+        if (j == n && hist_match(id, query, qlen, prefix))
+            return id;
+    }
+    return -1;
+}
+
+/// @brief history builtin: list, search or clear the command history
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_history(int argc, char *argv[])
+{
+    if (history.fd < 0)
+    {
+        printf("history: no history file\n");
+        return;
+    }
+    hist_sync();
+
+    // history -c
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        if (hist_lock() < 0)
+            return;
+        hist_header *h = (hist_header *)history.map;
+        __atomic_store_n(&h->used, sizeof(hist_header), __ATOMIC_RELEASE);
+        h->dead = 0;
+        hist_sync();
+        flock(history.fd, LOCK_UN);
+        return;
+    }
+
+    // history -s TEXT / history -p PREFIX, newest match first
+    if (argc >= 4 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-p") == 0))
+    {
+        char query[4096] = "";
+        for (int i = 2; argv[i] != NULL; i++)
+        {
+            if (i > 2)
+                strncat(query, " ", sizeof(query) - strlen(query) - 1);
+            strncat(query, argv[i], sizeof(query) - strlen(query) - 1);
+        }
+        int prefix = argv[1][1] == 'p';
+        for (int i = hist_search(query, history.num, prefix); i >= 0; i = hist_search(query, i, prefix))
+            printf("%5d  %s\n", i + 1, hist_text(i));
+        return;
+    }
+
+    // history [N]
+    if (argc > 3 || (argc == 3 && !is_integer(argv[1])))
+    {
+        printf("USAGE: history [N | -s TEXT | -p PREFIX | -c]\n");
+        return;
+    }
+    long count = argc == 3 ? atol(argv[1]) : (long)history.num;
+    uint32_t first = history.num;
+    while (first > 0 && count > 0)
+        if (!(hist_record_at(--first)->flags & HIST_DEAD))
+            count--;
+    for (uint32_t i = first; i < history.num; i++)
+        if (!(hist_record_at(i)->flags & HIST_DEAD))
+            printf("%5u  %s\n", i + 1, hist_text(i));
+}
+
+/*
+ * LINE EDITOR
+ */
+
+#define COMP_CACHE_SIZE 32
+
+// sorted listing of one directory, directories carry a trailing '/'
+typedef struct comp_dir
+{
+    char *path;
+    int execs_only; /* only executables (a $PATH directory) */
+    ino_t ino;
+    struct timespec mtime; /* the listing is rebuilt when the directory's mtime changes */
+    char **names;
+    uint32_t num, cap;
+    unsigned long used; /* for evicting the least recently used listing */
+} comp_dir;
+
+// state of the line being edited
+typedef struct line_editor
+{
+    const char *prompt;
+    char *buf;
+    size_t size, len, pos;
+    uint32_t hist_pos; /* history entry shown by up/down, history.num for the new line */
+    char *saved;       /* the new line while browsing history */
+    int last_tab;      /* the previous key was tab: list the candidates */
+} line_editor;
+
+// up to COMP_CACHE_SIZE listings, more only while one call pins them all
+comp_dir *comp_cache;
+uint32_t comp_cache_num, comp_cache_cap;
+unsigned long comp_tick;
+// listings used since this tick hold the candidates being collected, they are not evicted or rebuilt
+unsigned long comp_pinned;
+const char *builtin_names[] = {"bg", "cache", "cd", "coproc", "exit", "fg", "history", "jobs",
+                               "mux", "nice", "pack", "read", "sched", "taskset", "timeout", "ulimit", "wait"};
+
+// keystrokes read from the terminal but not handled yet (pasted text arrives in one read)
+char edit_input[256];
+size_t edit_input_len, edit_input_pos;
+
+/// @brief qsort comparator for strings
+/// @param a pointer to the first string
+/// @param b pointer to the second string
+/// @return strcmp order
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/// @brief Read a directory into a listing
+/// @param d the listing, path and execs_only already set
+/// @param st stat of the directory
+void comp_dir_build(comp_dir *d, struct stat *st)
+{
+    for (uint32_t i = 0; i < d->num; i++)
+        free(d->names[i]);
+    d->num = 0;
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+
+    DIR *dir = opendir(d->path);
+    if (dir == NULL)
+        return;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL)
+    {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        // only stat entries whose type readdir did not tell us
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK)
+        {
+            struct stat est;
+            is_dir = fstatat(dirfd(dir), e->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode);
+        }
+        if (d->execs_only && (is_dir || faccessat(dirfd(dir), e->d_name, X_OK, 0) < 0))
+            continue;
+
+        size_t len = strlen(e->d_name);
+        char *name = malloc(len + 2);
+        memcpy(name, e->d_name, len);
+        strcpy(name + len, is_dir ? "/" : "");
+        grow_array(&d->names, &d->cap, d->num + 1, sizeof(char *));
+        d->names[d->num++] = name;
+    }
+    closedir(dir);
+    qsort(d->names, d->num, sizeof(char *), compare_names);
+}
+
+/// @brief Get the listing of a directory, reading it only if it changed since the last time
+/// @param path the directory
+/// @param execs_only list only executables
+/// @return the listing, or NULL if the directory cannot be read
+comp_dir *comp_dir_get(const char *path, int execs_only)
+{
+    struct stat st;
+    comp_dir *d = NULL, *lru = NULL;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+    for (uint32_t i = 0; i < comp_cache_num && d == NULL; i++)
+    {
+        comp_dir *c = &comp_cache[i];
+        if (c->path && c->execs_only == execs_only && strcmp(c->path, path) == 0)
+            d = c;
+        else if (c->used < comp_pinned && (lru == NULL || c->used < lru->used))
+            lru = c;
+    }
+    if (d == NULL)
+    {
+        // take over the least recently used listing, or add one if all of them are pinned
+        if (comp_cache_num < COMP_CACHE_SIZE || lru == NULL)
+        {
+            grow_array(&comp_cache, &comp_cache_cap, comp_cache_num + 1, sizeof(comp_dir));
+            lru = &comp_cache[comp_cache_num++];
+            memset(lru, 0, sizeof(*lru));
+        }
+        d = lru;
+        free(d->path);
+        d->path = strdup(path);
+        d->execs_only = execs_only;
+        d->ino = 0;
+    }
+    if (d->used < comp_pinned &&
+        (d->ino != st.st_ino || d->mtime.tv_sec != st.st_mtim.tv_sec || d->mtime.tv_nsec != st.st_mtim.tv_nsec))
+        comp_dir_build(d, &st);
+    d->used = ++comp_tick;
+    return d;
+}
+
+/// @brief Find the names of a listing that start with a prefix
+/// @param d the listing
+/// @param prefix the prefix
+/// @param first where to store the index of the first match
+/// @return number of matches
+uint32_t comp_dir_range(comp_dir *d, const char *prefix, uint32_t *first)
+{
+    size_t plen = strlen(prefix);
+    uint32_t lo = 0, hi = d->num;
+
+    // names are sorted, so the matches are one run found by two binary searches
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(d->names[mid], prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *first = lo;
+    hi = d->num;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strncmp(d->names[mid], prefix, plen) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - *first;
+}
+
+/// @brief Collect completion candidates for a word
+/// @param word the word before the cursor
+/// @param command the word is in command position
+/// @param cands where to store the candidates (pointers into the listings, which stay pinned until the next call)
+/// @param num where to store the number of candidates
+/// @param cap capacity of cands
+/// @return length of the part of the word the candidates complete (after the last '/')
+size_t comp_candidates(const char *word, int command, char ***cands, uint32_t *num, uint32_t *cap)
+{
+    uint32_t first, n;
+    comp_dir *d;
+
+    *num = 0;
+    comp_pinned = comp_tick + 1;
+    if (command && strchr(word, '/') == NULL)
+    {
+        for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+        {
+            if (strncmp(builtin_names[i], word, strlen(word)) == 0)
+            {
+                grow_array(cands, cap, *num + 1, sizeof(char *));
+                (*cands)[(*num)++] = (char *)builtin_names[i];
+            }
+        }
+
+        char *path = getenv("PATH");
+        char dir[4096];
+        while (path && *path)
+        {
+            size_t len = strcspn(path, ":");
+            snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? path : ".");
+            path += len + (path[len] == ':');
+            if ((d = comp_dir_get(dir, 1)) == NULL)
+                continue;
+            n = comp_dir_range(d, word, &first);
+            grow_array(cands, cap, *num + n, sizeof(char *));
+            memcpy(*cands + *num, d->names + first, n * sizeof(char *));
+            *num += n;
+        }
+
+        // the same command can be in several $PATH directories
+        qsort(*cands, *num, sizeof(char *), compare_names);
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < *num; i++)
+            if (kept == 0 || strcmp((*cands)[kept - 1], (*cands)[i]) != 0)
+                (*cands)[kept++] = (*cands)[i];
+        *num = kept;
+        return strlen(word);
+    }
+
+    // path: list the directory part, match the rest
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    char dir[4096];
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (word[0] == '~' && word + 1 == slash && getenv("HOME"))
+        snprintf(dir, sizeof(dir), "%s/", getenv("HOME"));
+    else if (word[0] == '~' && word[1] == '/' && getenv("HOME"))
+        snprintf(dir, sizeof(dir), "%s/%.*s", getenv("HOME"), (int)(slash - word - 1), word + 2);
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word + 1), word);
+
+    if ((d = comp_dir_get(dir, 0)) == NULL)
+        return strlen(base);
+    n = comp_dir_range(d, base, &first);
+    for (uint32_t i = first; i < first + n; i++)
+    {
+        // hidden entries only when asked for
+        if (d->names[i][0] == '.' && base[0] != '.')
+            continue;
+        grow_array(cands, cap, *num + 1, sizeof(char *));
+        (*cands)[(*num)++] = d->names[i];
+    }
+    return strlen(base);
+}
+
+/// @brief Width of the terminal
+/// @return number of columns
+int term_columns()
+{
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0)
+        return 80;
+    return ws.ws_col;
+}
+
+/// @brief Redraw the prompt and line, scrolling sideways to keep the cursor visible
+/// @param prompt the prompt
+/// @param text the line
+/// @param len length of the line
+/// @param pos cursor position in the line
+void edit_draw(const char *prompt, const char *text, size_t len, size_t pos)
+{
+    size_t cols = term_columns(), plen = strlen(prompt);
+
+    while (plen + pos >= cols && pos > 0)
+    {
+        text++;
+        len--;
+        pos--;
+    }
+    if (plen + len > cols)
+        len = cols > plen ? cols - plen : 0;
+
+    char out[plen + len + 32];
+    int n = sprintf(out, "\r%s%.*s\x1b[0K\r", prompt, (int)len, text);
+    if (plen + pos > 0)
+        n += sprintf(out + n, "\x1b[%zuC", plen + pos);
+    if (write(STDOUT_FILENO, out, n) < 0)
+        return;
+}
+
+/// @brief Redraw the line being edited
+/// @param ed the editor
+void edit_refresh(line_editor *ed)
+{
+    edit_draw(ed->prompt, ed->buf, ed->len, ed->pos);
+}
+
+/// @brief Read one key from the terminal, starting queued background jobs while waiting
+/// @return the byte, or -1 at end of input
+int edit_getc()
+{
+    while (edit_input_pos == edit_input_len)
+    {
+        sched_wait(STDIN_FILENO);
+        ssize_t n = read(STDIN_FILENO, edit_input, sizeof(edit_input));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        edit_input_len = n;
+        edit_input_pos = 0;
+    }
+    return (unsigned char)edit_input[edit_input_pos++];
+}
+
+/// @brief Insert text at the cursor
+/// @param ed the editor
+/// @param s the text
+/// @param n its length
+void edit_insert(line_editor *ed, const char *s, size_t n)
+{
+    if (ed->len + n >= ed->size)
+        n = ed->size - 1 - ed->len;
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    ed->pos += n;
+    ed->buf[ed->len] = '\0';
+}
+
+/// @brief Delete the text between two positions
+/// @param ed the editor
+/// @param from start of the text
+/// @param to end of the text
+void edit_delete(line_editor *ed, size_t from, size_t to)
+{
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->buf[ed->len] = '\0';
+    if (ed->pos > to)
+        ed->pos -= to - from;
+    else if (ed->pos > from)
+        ed->pos = from;
+}
+
+/// @brief Replace the whole line
+/// @param ed the editor
+/// @param s the new line
+void edit_set(line_editor *ed, const char *s)
+{
+    ed->len = ed->pos = 0;
+    ed->buf[0] = '\0';
+    edit_insert(ed, s, strlen(s));
+}
+
+/// @brief Print completion candidates in columns below the line
+/// @param cands the candidates
+/// @param num number of candidates
+void edit_list(char **cands, uint32_t num)
+{
+    size_t width = 0;
+    uint32_t shown = num < 200 ? num : 200;
+
+    for (uint32_t i = 0; i < shown; i++)
+        if (strlen(cands[i]) + 2 > width)
+            width = strlen(cands[i]) + 2;
+    int per_row = term_columns() / width;
+    if (per_row < 1)
+        per_row = 1;
+
+    printf("\r\n");
+    for (uint32_t i = 0; i < shown; i++)
+        printf("%-*s%s", (int)width, cands[i], ((i + 1) % per_row == 0 || i + 1 == shown) ? "\r\n" : "");
+    if (shown < num)
+        printf("... and %u more\r\n", num - shown);
+    fflush(stdout);
+}
+
+/// @brief Complete the word before the cursor: insert the common part of all candidates, list them on a second tab
+/// @param ed the editor
+void edit_complete(line_editor *ed)
+{
+    static char **cands;
+    static uint32_t cap;
+    uint32_t num;
+
+    size_t start = ed->pos;
+    while (start > 0 && ed->buf[start - 1] != ' ')
+        start--;
+
+    // the first word of the line or of a pipeline stage names a command
+    size_t prev = start;
+    while (prev > 0 && ed->buf[prev - 1] == ' ')
+        prev--;
+    int command = prev == 0 || ed->buf[prev - 1] == '|';
+
+    char word[ed->pos - start + 1];
+    memcpy(word, ed->buf + start, ed->pos - start);
+    word[ed->pos - start] = '\0';
+    size_t done = comp_candidates(word, command, &cands, &num, &cap);
+    if (num == 0)
+    {
+        if (write(STDOUT_FILENO, "\a", 1) < 0)
+            return;
+        return;
+    }
+
+    // longest common prefix of the candidates beyond what is typed
+    size_t common = strlen(cands[0]);
+    for (uint32_t i = 1; i < num; i++)
+    {
+        size_t k = done;
+        while (k < common && cands[i][k] == cands[0][k])
+            k++;
+        common = k;
+    }
+    if (common > done)
+    {
+        edit_insert(ed, cands[0] + done, common - done);
+        if (num == 1 && cands[0][common - 1] != '/')
+            edit_insert(ed, " ", 1);
+    }
+    else if (num == 1 && cands[0][common - 1] != '/')
+    {
+        edit_insert(ed, " ", 1);
+    }
+    else if (ed->last_tab)
+    {
+        edit_list(cands, num);
+    }
+    else
+    {
+        if (write(STDOUT_FILENO, "\a", 1) < 0)
+            return;
+    }
+}
+
+/// @brief Show another history entry (up/down), keeping the new line to come back to
+/// @param ed the editor
+/// @param dir -1 for older, 1 for newer
+void edit_history(line_editor *ed, int dir)
+{
+    uint32_t i = ed->hist_pos;
+
+    hist_sync();
+    do
+    {
+        if ((dir < 0 && i == 0) || (dir > 0 && i >= history.num))
+            return;
+        i += dir;
+    } while (i < history.num && (hist_record_at(i)->flags & HIST_DEAD));
+
+    if (ed->hist_pos >= history.num)
+    {
+        free(ed->saved);
+        ed->saved = strdup(ed->buf);
+    }
+    ed->hist_pos = i;
+    edit_set(ed, i < history.num ? hist_text(i) : (ed->saved ? ed->saved : ""));
+}
+
+/// @brief Ctrl-R: search the history backwards as the query is typed
+/// @param ed the editor, holding the match when the search ends
+/// @return 1 to run the match, 0 to keep editing it, -1 if the search was cancelled
+int edit_search(line_editor *ed)
+{
+    char query[256] = "";
+    size_t qlen = 0;
+    int match = -1, failed = 0;
+    char *orig = strdup(ed->buf);
+
+    hist_sync();
+    while (true)
+    {
+        char prompt[sizeof(query) + 32];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+        char *text = match >= 0 ? hist_text(match) : "";
+        char *at = match >= 0 && qlen ? strstr(text, query) : NULL;
+        edit_draw(prompt, text, strlen(text), at ? (size_t)(at - text) : 0);
+
+        int c = edit_getc();
+        int found = -2;
+        if (c == 18 && qlen)
+        {
+            // ctrl-r again: the next older match
+            found = hist_search(query, match >= 0 ? match : (int)history.num, 0);
+        }
+        else if ((c == 127 || c == 8) && qlen)
+        {
+            query[--qlen] = '\0';
+            found = qlen ? hist_search(query, history.num, 0) : -1;
+        }
+        else if (c >= 32 && c < 127 && qlen + 1 < sizeof(query))
+        {
+            // a longer query still matches the current entry or an older one
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            found = hist_search(query, match >= 0 ? match + 1 : (int)history.num, 0);
+        }
+        else if (c == 7 || c == 3 || c < 0)
+        {
+            // ctrl-g / ctrl-c: back to the line as it was
+            edit_set(ed, orig);
+            free(orig);
+            return -1;
+        }
+        else if (c != 18 && c != 127 && c != 8)
+        {
+            if (match >= 0)
+            {
+                edit_set(ed, hist_text(match));
+                ed->hist_pos = match;
+            }
+            free(orig);
+            return (c == '\r' || c == '\n') ? 1 : 0;
+        }
+
+        if (found >= 0)
+            match = found;
+        failed = found == -1 && qlen > 0;
+    }
+}
+
+/// @brief Read a command line from the terminal in raw mode with editing, completion and history search
+/// @param prompt the prompt
+/// @param buf where to store the line, without a newline
+/// @param size size of buf
+/// @return buf, or NULL at end of input
+char *edit_line(const char *prompt, char *buf, size_t size)
+{
+    line_editor ed = {.prompt = prompt, .buf = buf, .size = size};
+    char *result = buf;
+
+    // raw mode derived from the shell's own terminal modes, which put_job_in_foreground restores
+    struct termios raw = shell_tmodes;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(shell_terminal, TCSADRAIN, &raw);
+
+    hist_sync();
+    ed.hist_pos = history.num;
+    buf[0] = '\0';
+    edit_refresh(&ed);
+    while (true)
+    {
+        int c = edit_getc(), tab = 0;
+        if (c < 0)
+        {
+            result = NULL;
+            break;
+        }
+        if (c == '\r' || c == '\n')
+            break;
+
+        switch (c)
+        {
+        case 1: /* ctrl-a */
+            ed.pos = 0;
+            break;
+        case 2: /* ctrl-b */
+            if (ed.pos > 0)
+                ed.pos--;
+            break;
+        case 3: /* ctrl-c: drop the line */
+            ed.len = ed.pos = 0;
+            buf[0] = '\0';
+            printf("^C\r\n");
+            fflush(stdout);
+            break;
+        case 4: /* ctrl-d: end of input on an empty line, else delete */
+            if (ed.len == 0)
+                result = NULL;
+            else if (ed.pos < ed.len)
+                edit_delete(&ed, ed.pos, ed.pos + 1);
+            break;
+        case 5: /* ctrl-e */
+            ed.pos = ed.len;
+            break;
+        case 6: /* ctrl-f */
+            if (ed.pos < ed.len)
+                ed.pos++;
+            break;
+        case 9: /* tab */
+            edit_complete(&ed);
+            tab = 1;
+            break;
+        case 11: /* ctrl-k */
+            edit_delete(&ed, ed.pos, ed.len);
+            break;
+        case 12: /* ctrl-l */
+            printf("\x1b[H\x1b[2J");
+            fflush(stdout);
+            break;
+        case 14: /* ctrl-n */
+            edit_history(&ed, 1);
+            break;
+        case 16: /* ctrl-p */
+            edit_history(&ed, -1);
+            break;
+        case 18: /* ctrl-r */
+        {
+            int r = edit_search(&ed);
+            if (r == 1)
+                goto done;
+            break;
+        }
+        case 21: /* ctrl-u */
+            edit_delete(&ed, 0, ed.pos);
+            break;
+        case 23: /* ctrl-w: delete the word before the cursor */
+        {
+            size_t from = ed.pos;
+            while (from > 0 && buf[from - 1] == ' ')
+                from--;
+            while (from > 0 && buf[from - 1] != ' ')
+                from--;
+            edit_delete(&ed, from, ed.pos);
+            break;
+        }
+        case 8:
+        case 127: /* backspace */
+            if (ed.pos > 0)
+                edit_delete(&ed, ed.pos - 1, ed.pos);
+            break;
+        case 27: /* escape sequences: arrows, home, end, delete */
+        {
+            int c1 = edit_getc(), c2 = edit_getc();
+            if (c1 != '[' && c1 != 'O')
+                break;
+            if (c2 >= '0' && c2 <= '9')
+            {
+                if (edit_getc() != '~')
+                    break;
+                c2 = c2 == '1' || c2 == '7' ? 'H' : c2 == '4' || c2 == '8' ? 'F' : c2 == '3' ? 'X' : 0;
+            }
+            if (c2 == 'A')
+                edit_history(&ed, -1);
+            else if (c2 == 'B')
+                edit_history(&ed, 1);
+            else if (c2 == 'C' && ed.pos < ed.len)
+                ed.pos++;
+            else if (c2 == 'D' && ed.pos > 0)
+                ed.pos--;
+            else if (c2 == 'H')
+                ed.pos = 0;
+            else if (c2 == 'F')
+                ed.pos = ed.len;
+            else if (c2 == 'X' && ed.pos < ed.len)
+                edit_delete(&ed, ed.pos, ed.pos + 1);
+            break;
+        }
+        default:
+            if (c >= 32)
+            {
+                char ch = c;
+                edit_insert(&ed, &ch, 1);
+            }
+            break;
+        }
+        if (result == NULL)
+            break;
+        ed.last_tab = tab;
+        edit_refresh(&ed);
+    }
+
+done:
+    if (result)
+    {
+        ed.pos = ed.len;
+        edit_refresh(&ed);
+    }
+    printf("\r\n");
+    fflush(stdout);
+    free(ed.saved);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    return result;
+}
+
+/*
+ * COMMAND SUBSTITUTION
+ */
+
+// growing buffer the words of an expanded command line are built in
+typedef struct expansion
+{
+    char *buf;
+    uint32_t len, cap;
+    uint32_t *words; /* offsets of the words in buf */
+    uint32_t num_words, cap_words;
+    int pass_fds[16]; /* pipe ends of <(...) and >(...) for the job that runs the line */
+    int num_pass_fds;
+} expansion;
+
+/// @brief Find the ) closing a $(, <( or >(
+/// @param s the text just after the $(
+/// @return the closing ), or NULL if there is none
+char *subst_end(char *s)
+{
+    int depth = 1;
+    for (; *s; s++)
+    {
+        if (*s == '(')
+            depth++;
+        else if (*s == ')' && --depth == 0)
+            return s;
+    }
+    return NULL;
+}
+
+/// @brief Append bytes to an expansion
+/// @param e the expansion
+/// @param s the bytes
+/// @param n number of bytes
+void expansion_append(expansion *e, const char *s, uint32_t n)
+{
+    grow_array(&e->buf, &e->cap, e->len + n + 1, 1);
+    memcpy(e->buf + e->len, s, n);
+    e->len += n;
+}
+
+/// @brief Run a command line with stdout going to a memfd and append its output to an expansion
+/// @param e the expansion
+/// @param inner the command line
+/// @return 0 on success, -1 if the output could not be captured
+int capture_output(expansion *e, char *inner)
+{
+    int fd = memfd_create("wsh-subst", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+
+    // a file instead of a pipe: the job never blocks on a full pipe while the shell waits for it
+    int saved = eval_stdout;
+    eval_stdout = fd;
+    eval_line(inner, 0);
+    eval_stdout = saved;
+
+    // read the whole output with one pread straight into place
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    grow_array(&e->buf, &e->cap, e->len + st.st_size + 1, 1);
+    off_t off = 0;
+    while (off < st.st_size)
+    {
+        ssize_t n = pread(fd, e->buf + e->len + off, st.st_size - off, off);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    close(fd);
+    e->len += off;
+
+    // like other shells, trailing newlines are dropped
+    while (off-- > 0 && e->buf[e->len - 1] == '\n')
+        e->len--;
+    return 0;
+}
+
+/// @brief Start the job of a <(...) or >(...) in the background, connected to a pipe
+/// @param e the expansion, which gets the shell's end of the pipe and its /dev/fd path
+/// @param inner the command line
+/// @param output >(...): the job reads what the command writes to the path
+/// @return 0 on success, -1 on failure
+int process_subst(expansion *e, char *inner, int output)
+{
+    int fds[2];
+
+    if (e->num_pass_fds == 16)
+    {
+        printf("Error: too many process substitutions.\n");
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    // the inner job is an ordinary background job with one end of the pipe as stdin or stdout
+    int *io = output ? &eval_stdin : &eval_stdout;
+    int saved = *io;
+    *io = output ? fds[0] : fds[1];
+    job *j = eval_line(inner, 1);
+    *io = saved;
+
+    // it has to run now: the outer command would wait forever on a queued writer or reader
+    if (j && j->queued)
+    {
+        j->queued = 0;
+        j->admitted = 1;
+        run_job(j, 0);
+    }
+    close(output ? fds[0] : fds[1]);
+    int fd = output ? fds[1] : fds[0];
+    if (j == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char path[32];
+    e->pass_fds[e->num_pass_fds++] = fd;
+    expansion_append(e, path, snprintf(path, sizeof(path), "/dev/fd/%d", fd));
+    return 0;
+}
+
+/// @brief Check whether a word has a $NAME or ${NAME} variable at p
+/// @param p position in the word
+/// @return length of the name, 0 if there is no variable
+size_t var_name_len(char *p)
+{
+    int brace = p[1] == '{';
+    char *name = p + 1 + brace;
+    size_t len = 0;
+
+    if (p[0] != '$' || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+        return 0;
+    while (isalnum((unsigned char)name[len]) || name[len] == '_')
+        len++;
+    return brace && name[len] != '}' ? 0 : len;
+}
+
+/// @brief Expand one word into an expansion: $(...) by the command's output, <(...) and >(...) by a
+/// /dev/fd path, $? by the last exit status and $NAME or ${NAME} by the variable (never split)
+/// @param e the expansion
+/// @param w the word
+/// @param split split the output of $(...) into words
+/// @return 0 on success, -1 on an unterminated $( or a failed capture
+int expand_word(expansion *e, char *w, int split)
+{
+    uint32_t start = e->len;
+    int substituted = 0;
+
+    for (char *p = w; *p;)
+    {
+        if (subst_start(p))
+        {
+            char *end = subst_end(p + 2);
+            if (end == NULL)
+            {
+                printf("Error: unterminated %.2s.\n", p);
+                return -1;
+            }
+            char inner[end - p - 1];
+            memcpy(inner, p + 2, end - p - 2);
+            inner[end - p - 2] = '\0';
+            if (p[0] == '$' ? capture_output(e, inner) < 0 : process_subst(e, inner, p[0] == '>') < 0)
+                return -1;
+            substituted |= p[0] == '$';
+            p = end + 1;
+        }
+        else if (p[0] == '$' && p[1] == '?')
+        {
+            char status[16];
+            expansion_append(e, status, snprintf(status, sizeof(status), "%d", last_status));
+            p += 2;
+        }
+        else if (var_name_len(p) > 0)
+        {
+            size_t len = var_name_len(p);
+            int brace = p[1] == '{';
+            char *value = get_var(p + 1 + brace, len);
+            if (value)
+                expansion_append(e, value, strlen(value));
+            p += 1 + brace + len + brace;
+        }
+        else
+        {
+            expansion_append(e, p++, 1);
+        }
+    }
+
+    // split the captured output in place: whitespace becomes NUL, each run of other bytes a word
+    grow_array(&e->buf, &e->cap, e->len + 1, 1);
+    e->buf[e->len] = '\0';
+    if (!substituted || !split)
+    {
+        grow_array(&e->words, &e->cap_words, e->num_words + 1, sizeof(uint32_t));
+        e->words[e->num_words++] = start;
+        e->len++;
+        return 0;
+    }
+    for (uint32_t i = start; i < e->len; i++)
+    {
+        if (e->buf[i] == ' ' || e->buf[i] == '\t' || e->buf[i] == '\n')
+        {
+            e->buf[i] = '\0';
+        }
+        else if (i == start || e->buf[i - 1] == '\0')
+        {
+            grow_array(&e->words, &e->cap_words, e->num_words + 1, sizeof(uint32_t));
+            e->words[e->num_words++] = i;
+        }
+    }
+    e->len++;
+    return 0;
+}
+
+/// @brief Check whether a command line has words to expand
+/// @param argv the argument vector, NULL terminated
+/// @return true if a word contains $(, <(, >(, $? or a variable
+int needs_expansion(char **argv)
+{
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        if (strstr(argv[i], "$(") || strstr(argv[i], "<(") || strstr(argv[i], ">(") || strstr(argv[i], "$?"))
+            return 1;
+        for (char *p = strchr(argv[i], '$'); p; p = strchr(p + 1, '$'))
+            if (var_name_len(p) > 0)
+                return 1;
+    }
+    return 0;
+}
+
+/// @brief Expand every word of a command line
+/// @param argv the argument vector, NULL terminated
+/// @param e the expansion to build
+/// @return a malloc'd NULL terminated argument vector pointing into e, or NULL on error
+char **expand_words(char **argv, expansion *e)
+{
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        // operators are not expanded, their slots are marked past the end of any buffer
+        if (argv[i] == pipe_word || argv[i] == bg_word)
+        {
+            grow_array(&e->words, &e->cap_words, e->num_words + 1, sizeof(uint32_t));
+            e->words[e->num_words++] = argv[i] == pipe_word ? UINT32_MAX : UINT32_MAX - 1;
+            continue;
+        }
+
+        // a here-string is one word whatever its expansion contains
+        int here = strncmp(argv[i], "<<<", 3) == 0 || (i > 0 && strcmp(argv[i - 1], "<<<") == 0);
+        if (expand_word(e, argv[i], !here) < 0)
+            return NULL;
+    }
+
+    char **words = malloc((e->num_words + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < e->num_words; i++)
+        words[i] = e->words[i] == UINT32_MAX       ? pipe_word
+                   : e->words[i] == UINT32_MAX - 1 ? bg_word
+                                                   : e->buf + e->words[i];
+    words[e->num_words] = NULL;
+    return words;
+}
+
+/// @brief Point the shell's own stdout at the capture file while a builtin runs inside $(...)
+/// @return the saved stdout to pass to restore_stdout, or -1 if nothing was redirected
+int redirect_stdout()
+{
+    if (eval_stdout == STDOUT_FILENO)
+        return -1;
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(eval_stdout, STDOUT_FILENO);
+    return saved;
+}
+
+/// @brief Undo redirect_stdout
+/// @param saved its return value
+void restore_stdout(int saved)
+{
+    if (saved < 0)
+        return;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+/*
+ * LOOPS AND READ
+ */
+
+// input the read builtin consumes, with its read-ahead
+typedef struct read_buffer
+{
+    int fd;
+    int owned;  /* only read uses fd (a loop's pipe or here-document): read ahead freely */
+    int mode;   /* 0 = byte at a time, 1 = read ahead, 2 = read ahead and seek back; -1 = not decided */
+    size_t pos, len;
+    char buf[65536];
+} read_buffer;
+
+read_buffer shell_input = {.fd = STDIN_FILENO, .mode = -1};
+read_buffer *read_input = &shell_input;
+
+// variables set by read: not exported, a loop overwrites them in place every line
+typedef struct shell_var
+{
+    char *name;
+    char *value;
+    uint32_t cap;
+} shell_var;
+
+shell_var *shell_vars;
+uint32_t num_shell_vars, cap_shell_vars;
+
+/// @brief Look up a shell variable, then the environment
+/// @param name the name
+/// @param len length of the name
+/// @return the value, or NULL if it is not set
+char *get_var(const char *name, size_t len)
+{
+    for (uint32_t i = 0; i < num_shell_vars; i++)
+        if (strncmp(shell_vars[i].name, name, len) == 0 && shell_vars[i].name[len] == '\0')
+            return shell_vars[i].value;
+    char tmp[len + 1];
+    memcpy(tmp, name, len);
+    tmp[len] = '\0';
+    return getenv(tmp);
+}
+
+/// @brief Set a shell variable, reusing its buffer
+/// @param name the name
+/// @param value the value
+void set_var(const char *name, const char *value)
+{
+    shell_var *v = NULL;
+    for (uint32_t i = 0; i < num_shell_vars && v == NULL; i++)
+        if (strcmp(shell_vars[i].name, name) == 0)
+            v = &shell_vars[i];
+    if (v == NULL)
+    {
+        grow_array(&shell_vars, &cap_shell_vars, num_shell_vars + 1, sizeof(shell_var));
+        v = &shell_vars[num_shell_vars++];
+        v->name = strdup(name);
+        v->value = NULL;
+        v->cap = 0;
+    }
+    size_t len = strlen(value);
+    grow_array(&v->value, &v->cap, len + 1, 1);
+    memcpy(v->value, value, len + 1);
+}
+
+/// @brief Read one line for the read builtin
+/// @param rb the input
+/// @param line pointer to a growable line buffer, NUL terminated on return
+/// @param cap pointer to its capacity
+/// @return length of the line without its newline, or -1 at end of input with nothing read
+long read_line(read_buffer *rb, char **line, uint32_t *cap)
+{
+    uint32_t n = 0;
+    int got_newline = 0;
+
+    // other processes share a pipe or terminal we do not own: never take more than the line
+    if (rb->mode < 0)
+    {
+        struct stat st;
+        rb->mode = rb->owned ? 1 : (fstat(rb->fd, &st) == 0 && S_ISREG(st.st_mode)) ? 2 : 0;
+    }
+
+    grow_array(line, cap, 1, 1);
+    if (rb->mode == 0)
+    {
+        char c;
+        ssize_t r;
+        while ((r = read(rb->fd, &c, 1)) == 1 || (r < 0 && errno == EINTR))
+        {
+            if (r < 0)
+                continue;
+            if (c == '\n')
+            {
+                got_newline = 1;
+                break;
+            }
+            grow_array(line, cap, n + 2, 1);
+            (*line)[n++] = c;
+        }
+    }
+    else
+    {
+        // a shared regular file is read in small chunks, the unused rest is given back with lseek
+        size_t chunk = rb->mode == 2 ? 512 : sizeof(rb->buf);
+        while (!got_newline)
+        {
+            if (rb->pos == rb->len)
+            {
+                ssize_t r = read(rb->fd, rb->buf, chunk);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                rb->pos = 0;
+                rb->len = r;
+                if (rb->mode == 2 && chunk < sizeof(rb->buf))
+                    chunk *= 2;
+            }
+            char *start = rb->buf + rb->pos;
+            char *nl = memchr(start, '\n', rb->len - rb->pos);
+            size_t take = nl ? (size_t)(nl - start) : rb->len - rb->pos;
+            grow_array(line, cap, n + take + 1, 1);
+            memcpy(*line + n, start, take);
+            n += take;
+            rb->pos += take + (nl != NULL);
+            got_newline = nl != NULL;
+        }
+        if (rb->mode == 2 && rb->pos < rb->len)
+        {
+            lseek(rb->fd, -(off_t)(rb->len - rb->pos), SEEK_CUR);
+            rb->pos = rb->len = 0;
+        }
+    }
+    (*line)[n] = '\0';
+    return (n == 0 && !got_newline) ? -1 : (long)n;
+}
+
+/// @brief read reads a line and splits it into shell variables (the last one takes the rest)
+/// USAGE: read [-r] [NAME...]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_read(int argc, char *argv[])
+{
+    static char *line;
+    static uint32_t cap;
+    int raw = 0, first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-r") == 0)
+    {
+        raw = 1;
+        first = 2;
+    }
+    long len = read_line(read_input, &line, &cap);
+    if (len < 0)
+    {
+        last_status = 1;
+        return;
+    }
+
+    // without -r a backslash keeps the next character as it is
+    if (!raw)
+    {
+        char *out = line;
+        for (char *in = line; *in; in++)
+        {
+            if (*in == '\\' && in[1])
+                in++;
+            *out++ = *in;
+        }
+        *out = '\0';
+    }
+
+    char *reply[] = {"read", "REPLY", NULL};
+    char **names = argc - 1 > first ? argv + first : reply + 1;
+    char *p = line;
+    for (int i = 0; names[i] != NULL; i++)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        char *value = p;
+        if (names[i + 1] != NULL)
+        {
+            p += strcspn(p, " \t");
+            if (*p)
+                *p++ = '\0';
+        }
+        else
+        {
+            char *end = p + strlen(p);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+            *end = '\0';
+        }
+        set_var(names[i], value);
+    }
+    last_status = 0;
+}
+
+/// @brief Run some words as a command line
+/// @param words the words
+/// @param n number of words
+/// @param force_bg run in the background
+/// @return the job that was started, or NULL
+job *eval_words(char **words, int n, int force_bg)
+{
+    char *argv[n + 1];
+    int num_pipes = 0, bg = 0;
+    size_t len = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        argv[i] = words[i];
+        num_pipes += words[i] == pipe_word;
+        bg |= words[i] == bg_word;
+        len += strlen(words[i]) + 1;
+    }
+    argv[n] = NULL;
+
+    // rebuild the command line for messages
+    char cmd[len + 1];
+    cmd[0] = '\0';
+    for (int i = 0; i < n; i++)
+    {
+        strcat(cmd, words[i]);
+        if (i + 1 < n)
+            strcat(cmd, " ");
+    }
+    return eval_argv(n + 1, argv, num_pipes, bg, cmd, force_bg);
+}
+
+/// @brief Find a while loop: a while word starting the line or its last pipeline stage
+/// @param argv the argument vector, NULL terminated
+/// @return index of the while word, or -1
+int find_while(char **argv)
+{
+    int start = 0;
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        if (argv[i] == pipe_word)
+            start = i + 1;
+        else if (i == start && strcmp(argv[i], "while") == 0)
+            return i;
+    }
+    return -1;
+}
+
+/// @brief Run [producer |] while COND; do CMD; ...; done [<<< word | <<WORD] in the shell
+/// @param argv the argument vector, NULL terminated
+/// @param w index of the while word
+void run_while(char **argv, int w)
+{
+    // split ; off the words it is glued to ("x;" -> "x" ";"), in a copy since the words may be read-only
+    int n = 0;
+    size_t size = 0;
+    while (argv[n] != NULL)
+        size += strlen(argv[n++]) + 2;
+    char *arena = malloc(size), *a = arena;
+    char *words[2 * n + 1];
+    int num = 0;
+    for (int i = w; i < n; i++)
+    {
+        if (argv[i] == pipe_word || argv[i] == bg_word)
+        {
+            words[num++] = argv[i];
+            continue;
+        }
+        size_t len = strlen(argv[i]);
+        int semi = len > 1 && argv[i][len - 1] == ';';
+        memcpy(a, argv[i], len - semi);
+        a[len - semi] = '\0';
+        words[num++] = a;
+        a += len - semi + 1;
+        if (semi)
+            words[num++] = ";";
+    }
+
+    // while COND [;] do BODY [; BODY]... [;] done [here-document]
+    int cond = 1, cond_end = cond;
+    while (cond_end < num && strcmp(words[cond_end], "do") != 0)
+        cond_end++;
+    int body = cond_end + 1, done = body;
+    while (done < num && strcmp(words[done], "done") != 0)
+        done++;
+    int cond_len = cond_end - cond - (cond_end > cond && strcmp(words[cond_end - 1], ";") == 0);
+    if (cond_len <= 0 || done >= num)
+    {
+        printf("Error: malformed while loop.\n");
+        free(arena);
+        return;
+    }
+
+    // the loop reads from its own input when it has one: a producer pipeline or a here-document
+    read_buffer *rb = calloc(1, sizeof(read_buffer));
+    rb->fd = shell_input.fd;
+    rb->mode = -1;
+    job *producer = NULL;
+    int trailing = num - done - 1;
+    if (trailing > 0)
+    {
+        char *here[trailing + 2];
+        int here_argc = trailing + 2;
+        here[0] = "done";
+        memcpy(here + 1, words + done + 1, trailing * sizeof(char *));
+        here[trailing + 1] = NULL;
+        int rc = parse_here_input(&here_argc, here, eval_heredoc, &rb->fd);
+        if (rc < 0 || rb->fd < 0 || here_argc != 2)
+        {
+            if (rb->fd >= 0)
+                close(rb->fd);
+            if (rc == 0)
+                printf("Error: malformed while loop.\n");
+            free(rb);
+            free(arena);
+            return;
+        }
+        rb->owned = 1;
+    }
+    else if (w > 0)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            perror("pipe");
+            free(rb);
+            free(arena);
+            return;
+        }
+        int saved = eval_stdout;
+        eval_stdout = fds[1];
+        producer = eval_words(argv, w - 1, 1);
+        if (producer)
+            producer->owed = 1;
+        eval_stdout = saved;
+        if (producer && producer->queued)
+        {
+            producer->queued = 0;
+            producer->admitted = 1;
+            run_job(producer, 0);
+        }
+        close(fds[1]);
+        rb->fd = fds[0];
+        rb->owned = 1;
+    }
+
+    read_buffer *saved_input = read_input;
+    read_input = rb;
+    int status = 0;
+    while (true)
+    {
+        eval_words(words + cond, cond_len, 0);
+        if (last_status != 0)
+            break;
+
+        // each ;-separated command of the body, expanded again every time around
+        int start = body, interrupted = 0;
+        for (int i = body; i <= done; i++)
+        {
+            if (i < done && strcmp(words[i], ";") != 0)
+                continue;
+            if (i > start)
+            {
+                eval_words(words + start, i - start, 0);
+                status = last_status;
+                interrupted |= status == 128 + SIGINT;
+            }
+            start = i + 1;
+        }
+        if (interrupted)
+            break;
+    }
+    read_input = saved_input;
+
+    if (rb->owned)
+        close(rb->fd);
+    if (producer && !producer->dead)
+        wait_for_job(producer);
+    if (producer)
+        producer->owed = 0;
+    last_status = status;
+    free(rb);
+    free(arena);
+}
+
+/*
+ * COPROCESSES
+ */
+
+// a background job the shell talks to through a pipe in each direction
+typedef struct coproc
+{
+    char *name; /* NULL if the slot is free */
+    int job_id; /* the job, its slot may be reused once it is done */
+    pid_t pid;  /* its first process */
+    int in;     /* the shell's end of the coprocess's stdin */
+    int out;    /* the shell's end of the coprocess's stdout */
+} coproc;
+
+coproc coprocs[16];
+
+/// @brief Set the NAME_SUFFIX variable of a coprocess
+/// @param name the coprocess name
+/// @param suffix the variable suffix
+/// @param value the value, or -1 for an empty one
+void coproc_var(char *name, char *suffix, int value)
+{
+    char var[256], num[16] = "";
+    snprintf(var, sizeof(var), "%s_%s", name, suffix);
+    if (value >= 0)
+        snprintf(num, sizeof(num), "%d", value);
+    set_var(var, num);
+}
+
+/// @brief Close the shell's ends of a coprocess, it sees EOF on its stdin
+/// @param c the coprocess
+void coproc_close(coproc *c)
+{
+    close(c->in);
+    close(c->out);
+    coproc_var(c->name, "IN", -1);
+    coproc_var(c->name, "OUT", -1);
+    free(c->name);
+    c->name = NULL;
+}
+
+/// @brief coproc starts a command as a long-lived background job with a pipe to its stdin and one from
+/// its stdout. The shell's ends are $NAME_IN and $NAME_OUT, for >&$NAME_IN and <&$NAME_OUT, and its
+/// pid is $NAME_PID. Without arguments coproc lists the coprocesses, -c closes one.
+/// USAGE: coproc [NAME command [args...] | -c NAME]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_coproc(int argc, char *argv[])
+{
+    coproc *c = NULL;
+
+    if (argc - 1 == 1)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            if (coprocs[i].name == NULL)
+                continue;
+            int running = 0;
+            for (int k = 0; k < 256; k++)
+                if (jobs[k] != NULL && jobs[k]->dead == 0 && jobs[k]->job_id == coprocs[i].job_id &&
+                    jobs[k]->first_process->pid == coprocs[i].pid)
+                    running = !job_is_completed(jobs[k]);
+            printf("%s: job %d, in %d, out %d (%s)\n", coprocs[i].name, coprocs[i].job_id, coprocs[i].in,
+                   coprocs[i].out, running ? "running" : "done");
+        }
+        return;
+    }
+    if (argc - 1 < 3 || (strcmp(argv[1], "-c") == 0 && argc - 1 != 3))
+    {
+        printf("USAGE: coproc [NAME command [args...] | -c NAME]\n");
+        return;
+    }
+
+    char *name = strcmp(argv[1], "-c") == 0 ? argv[2] : argv[1];
+    for (int i = 0; i < 16 && c == NULL; i++)
+        if (coprocs[i].name && strcmp(coprocs[i].name, name) == 0)
+            c = &coprocs[i];
+    if (strcmp(argv[1], "-c") == 0)
+    {
+        if (c == NULL)
+            printf("Error: no coprocess %s.\n", name);
+        else
+            coproc_close(c);
+        return;
+    }
+    if (c != NULL)
+    {
+        printf("Error: coprocess %s is still open.\n", name);
+        return;
+    }
+    for (int i = 0; i < 16 && c == NULL; i++)
+        if (coprocs[i].name == NULL)
+            c = &coprocs[i];
+    if (c == NULL)
+    {
+        printf("Error: too many coprocesses.\n");
+        return;
+    }
+
+    // both pipes are close-on-exec: no other job keeps the coprocess's stdin open behind the shell's back
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+    {
+        perror("pipe");
+        return;
+    }
+    int saved_stdin = eval_stdin, saved_stdout = eval_stdout;
+    eval_stdin = in[0];
+    eval_stdout = out[1];
+    job *j = eval_words(argv + 2, argc - 3, 1);
+    eval_stdin = saved_stdin;
+    eval_stdout = saved_stdout;
+    close(in[0]);
+    close(out[1]);
+    if (j == NULL)
+    {
+        close(in[1]);
+        close(out[0]);
+        return;
+    }
+
+    // the first request would wait forever on a queued coprocess
+    if (j->queued)
+    {
+        j->queued = 0;
+        j->admitted = 1;
+        run_job(j, 0);
+    }
+    c->name = strdup(name);
+    c->job_id = j->job_id;
+    c->pid = j->first_process->pid;
+    c->in = in[1];
+    c->out = out[0];
+    coproc_var(name, "IN", c->in);
+    coproc_var(name, "OUT", c->out);
+    coproc_var(name, "PID", c->pid);
+}
+
+/*
+ * ARGUMENT PACKING
+ */
+
+/// @brief Read the items for pack: what the read buffer already holds, then its descriptor to EOF
+/// @param rb the input, its read-ahead is consumed
+/// @param len where to store the length
+/// @return the malloc'd input with room for a terminating NUL, or NULL on a read error
+char *pack_read_input(read_buffer *rb, uint32_t *len)
+{
+    char *buf = NULL;
+    uint32_t cap = 0;
+
+    *len = rb->len - rb->pos;
+    grow_array(&buf, &cap, *len + 65536, 1);
+    memcpy(buf, rb->buf + rb->pos, *len);
+    rb->pos = rb->len;
+    while (true)
+    {
+        ssize_t n = read(rb->fd, buf + *len, cap - *len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("pack");
+            free(buf);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        *len += n;
+        grow_array(&buf, &cap, *len + 65536, 1);
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+/// @brief Start one batch: the command words followed by items, which stay in the input buffer
+/// @param argc the command word count (including NULL termination)
+/// @param argv the command words
+/// @param items the items of this batch
+/// @param n number of items
+/// @param foreground run it in the foreground
+/// @return the job
+job *pack_spawn(int argc, char *argv[], char **items, uint32_t n, int foreground)
+{
+    process *p = malloc(sizeof(process));
+    populate_process_struct(p, argv[0], NULL, argc, argv);
+    p->argv = realloc(p->argv, (argc + n) * sizeof(char *));
+    memcpy(p->argv + argc - 1, items, n * sizeof(char *));
+    p->argv[argc - 1 + n] = NULL;
+    p->argc = argc + n;
+
+    // the table shows the command words and the batch size, not every item
+    size_t len = 32;
+    for (int i = 0; i < argc - 1; i++)
+        len += strlen(argv[i]) + 1;
+    char *cmd = malloc(len);
+    cmd[0] = '\0';
+    for (int i = 0; i < argc - 1; i++)
+        strcat(strcat(cmd, argv[i]), " ");
+    sprintf(cmd + strlen(cmd), "[%u items]", n);
+
+    job *j = malloc(sizeof(job));
+    populate_job_struct(j, p, foreground, 0);
+    j->command = cmd;
+    j->stdin = eval_stdin;
+    j->stdout = eval_stdout;
+    j->waited = 1;
+    j->owed = 1;
+    add_job(j);
+    run_job(j, foreground);
+    return j;
+}
+
+/// @brief Settle a batch that finished or stopped: fold its status into the run's, let go of the items
+/// (a stopped batch gets its own copies, for bg or fg) and free its job slot
+/// @param j the batch
+/// @param argc the argument count of the command words (including NULL termination)
+/// @param status the status of the run
+/// @return true if the run ends here: the batch stopped or was killed by a signal, as for xargs
+int pack_settle(job *j, int argc, int *status)
+{
+    process *p = j->first_process;
+    int stop = 1;
+
+    if (!job_is_completed(j))
+    {
+        *status = 128 + SIGTSTP;
+        for (int k = argc - 1; k < p->argc - 1; k++)
+            p->argv[k] = strdup(p->argv[k]);
+    }
+    else
+    {
+        if (WIFSIGNALED(p->status))
+            *status = 125;
+        else if (job_exit_status(j) != 0 && *status == 0)
+            *status = 123;
+        stop = WIFSIGNALED(p->status);
+        p->argv[argc - 1] = NULL;
+        p->argc = argc;
+    }
+    j->owed = 0;
+    return stop;
+}
+
+/// @brief pack runs a command with items appended, one per input line (or NUL-terminated with -0), as
+/// few times as the kernel's argument limit (ARG_MAX less the environment) allows. The items come
+/// from FILE, or else from <&N, a here-document or the shell's stdin. -n caps the items per exec,
+/// -P runs up to N batches at a time. The status is 0, or 123 if a batch failed.
+/// USAGE: pack [-0] [-n MAX] [-P N] [-a FILE] command [args...]
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+void wsh_pack(int argc, char *argv[])
+{
+    long max_items = 0, parallel = 1;
+    char *file = NULL, delim = '\n';
+    int a = 1;
+
+    for (; a < argc - 1 && argv[a][0] == '-'; a++)
+    {
+        if (strcmp(argv[a], "-0") == 0)
+            delim = '\0';
+        else if (strcmp(argv[a], "-n") == 0 && a + 1 < argc - 1 && (max_items = atol(argv[a + 1])) > 0)
+            a++;
+        else if (strcmp(argv[a], "-P") == 0 && a + 1 < argc - 1 && (parallel = atol(argv[a + 1])) > 0 &&
+                 parallel <= 256)
+            a++;
+        else if (strcmp(argv[a], "-a") == 0 && a + 1 < argc - 1)
+            file = argv[++a];
+        else
+            break;
+    }
+    if (a == argc - 1 || argv[a][0] == '-')
+    {
+        printf("USAGE: pack [-0] [-n MAX] [-P N] [-a FILE] command [args...]\n");
+        return;
+    }
+    argv += a;
+    argc -= a;
+
+    // read everything first: items are split in place and handed to exec without copies
+    static read_buffer file_input;
+    read_buffer *rb = read_input;
+    if (file)
+    {
+        file_input.fd = open(file, O_RDONLY | O_CLOEXEC);
+        file_input.pos = file_input.len = 0;
+        if (file_input.fd < 0)
+        {
+            perror(file);
+            last_status = 1;
+            return;
+        }
+        rb = &file_input;
+    }
+    uint32_t len;
+    char *buf = pack_read_input(rb, &len);
+    if (file)
+        close(file_input.fd);
+    if (buf == NULL)
     {
-        for (int i = 0; i < 256; i++)
+        last_status = 1;
+        return;
+    }
+    char **items = NULL;
+    uint32_t num_items = 0, cap_items = 0;
+    for (uint32_t i = 0, start = 0; i <= len; i++)
+    {
+        if (i < len && buf[i] != delim)
+            continue;
+        buf[i] = '\0';
+        if (i > start)
         {
-            if (jobs[i] != NULL && (jobs[i]->dead == 0) && jobs[i]->job_id == atoi(argv[1]))
-            {
-                put_job_in_background(jobs[i], 1);
-                return;
-            }
+            grow_array(&items, &cap_items, num_items + 1, sizeof(char *));
+            items[num_items++] = buf + start;
         }
+        start = i + 1;
     }
-    // use most recent id
-    else if (argc == 1)
+
+    // exec takes the arguments and the environment, each string with its pointer; leave what
+    // POSIX xargs leaves for the program to grow its environment
+    long budget = sysconf(_SC_ARG_MAX) - 2048;
+    for (char **e = environ; *e; e++)
+        budget -= strlen(*e) + 1 + sizeof(char *);
+    for (int i = 0; i < argc - 1; i++)
+        budget -= strlen(argv[i]) + 1 + sizeof(char *);
+
+    // with -P, no batch takes more than its share, so every slot gets work
+    if (parallel > 1 && (max_items == 0 || max_items > (num_items + parallel - 1) / parallel))
+        max_items = (num_items + parallel - 1) / parallel;
+
+    // running is handed to wait_jobs, which clears the finished entries; held keeps them to settle
+    job *running[256] = {NULL}, *held[256] = {NULL};
+    uint32_t next = 0;
+    int stop = 0, status = 0;
+    while (next < num_items && !stop)
     {
-        for (int i = 0; i < 256; i++)
+        // a single item has to fit under the kernel's limit for one string as well
+        long room = budget;
+        uint32_t n = 0;
+        while (next + n < num_items && (max_items == 0 || n < max_items))
         {
-            if (jobs[i] != NULL && (jobs[i]->dead == 0))
+            long size = strlen(items[next + n]) + 1;
+            if (size + (long)sizeof(char *) > room || size > 32 * 4096)
+                break;
+            room -= size + sizeof(char *);
+            n++;
+        }
+        if (n == 0)
+        {
+            printf("Error: item %u does not fit in an exec.\n", next + 1);
+            status = 1;
+            break;
+        }
+
+        // a foreground batch is settled at once, a background one in a free slot as it finishes
+        if (parallel == 1)
+        {
+            stop = pack_settle(pack_spawn(argc, argv, items + next, n, 1), argc, &status);
+            next += n;
+            continue;
+        }
+        int slot = 0;
+        while (true)
+        {
+            for (slot = 0; slot < parallel; slot++)
             {
-                put_job_in_background(jobs[i], 1);
-                return;
+                if (held[slot] != NULL && running[slot] == NULL)
+                {
+                    stop |= pack_settle(held[slot], argc, &status);
+                    held[slot] = NULL;
+                }
             }
+            for (slot = 0; slot < parallel && held[slot] != NULL; slot++)
+                ;
+            if (slot < parallel || stop)
+                break;
+            wait_jobs(running, parallel, 1, -1);
         }
+        if (stop)
+            break;
+        held[slot] = running[slot] = pack_spawn(argc, argv, items + next, n, 0);
+        next += n;
     }
-    else
+    if (parallel > 1)
     {
-        printf("USAGE: fg [job_id]\n");
-        // wsh_exit();
+        wait_jobs(running, parallel, 0, -1);
+        for (int slot = 0; slot < parallel; slot++)
+            if (held[slot] != NULL)
+                pack_settle(held[slot], argc, &status);
     }
+    last_status = status;
+    free(buf);
+    free(items);
 }
 
 /*
- * JOB CONTROL FUNCTIONS
+ * BATCH PROFILER
  */
 
-/// @brief launch a process in the background and set up its process group
-/// @param p a pointer to a process struct
-/// @param pgid a process group id of the parent job
-/// @param infile the input stream of the process
-/// @param outfile the output stream of the process
-/// @param errfile the error stream of the process
-/// @param foreground process is foreground indicator
-void launch_process(process *p, pid_t pgid,
-                    int infile, int outfile, int errfile,
-                    int foreground)
+#define PROF_TOP 10
+#define PROF_BUCKETS 24 /* log2 buckets of line time, from below 16us to 2^(PROF_BUCKETS+3)us */
+
+// timings of one batch line, in seconds
+typedef struct profile_line
 {
-    // set the process to a process group
-    pid_t pid = getpid();
-    if (pgid == 0)
-        pgid = pid;
-    if (getpid() != getsid(0))
+    uint32_t index; /* position among the command lines (blank lines and bodies do not count) */
+    char *text;     /* the command line */
+    double parse;   /* tokens, expansion, here-documents and prefixes: the rest of the line's time */
+    double spawn;   /* forking the processes */
+    double run;     /* from the last fork to the last reap */
+    double reap;    /* from the last reap until the line was done */
+    double total;
+} profile_line;
+
+// a command name with the lines that ran it
+typedef struct profile_command
+{
+    char name[64];
+    uint32_t count;
+    double total;
+    double max;
+} profile_command;
+
+char *profile_path = NULL;
+profile_line *prof_lines;
+uint32_t num_prof_lines, cap_prof_lines;
+char *prof_batch_file;
+double prof_start, prof_load;
+pid_t prof_pid;
+
+/// @brief Record the timings of a batch line and reset the counters for the next one
+/// @param index position of the line among the command lines
+/// @param text the command line
+/// @param start when the line started
+void prof_record(uint32_t index, char *text, double start)
+{
+    grow_array(&prof_lines, &cap_prof_lines, num_prof_lines + 1, sizeof(profile_line));
+    profile_line *p = &prof_lines[num_prof_lines++];
+    p->index = index;
+    p->text = strdup(text);
+    p->total = now_seconds() - start;
+    p->spawn = prof_spawn;
+    p->run = prof_run;
+    p->reap = prof_reap;
+    p->parse = p->total - p->spawn - p->run - p->reap;
+    if (p->parse < 0)
+        p->parse = 0;
+    prof_spawn = prof_run = prof_reap = 0;
+}
+
+/// @brief Order lines by total time, slowest first
+int prof_cmp_lines(const void *a, const void *b)
+{
+    double d = ((const profile_line *)b)->total - ((const profile_line *)a)->total;
+    return (d > 0) - (d < 0);
+}
+
+/// @brief Order commands by total time, slowest first
+int prof_cmp_commands(const void *a, const void *b)
+{
+    double d = ((const profile_command *)b)->total - ((const profile_command *)a)->total;
+    return (d > 0) - (d < 0);
+}
+
+/// @brief Write a string as a JSON string literal
+/// @param f the stream
+/// @param s the string
+void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
     {
-        setpgid(pid, pgid);
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
     }
-    // give the process group control of the foreground
-    if (foreground)
-        tcsetpgrp(shell_terminal, pgid);
-
-    /* Set the handling for job control signals back to the default.  */
-    signal(SIGINT, SIG_DFL);
-    signal(SIGQUIT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
-    signal(SIGTTIN, SIG_DFL);
-    signal(SIGTTOU, SIG_DFL);
-    signal(SIGCHLD, SIG_DFL);
+    fputc('"', f);
+}
 
-    /* Set the standard input/output channels of the new process.  */
-    if (infile != STDIN_FILENO)
+/// @brief Group the profiled lines by command name (the first word)
+/// @param cmds where to store the groups, room for num_prof_lines entries
+/// @return number of groups
+uint32_t prof_commands(profile_command *cmds)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num_prof_lines; i++)
     {
-        dup2(infile, STDIN_FILENO);
-        close(infile);
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(prof_lines[i].text, " "), prof_lines[i].text);
+        uint32_t c = 0;
+        while (c < n && strcmp(cmds[c].name, name) != 0)
+            c++;
+        if (c == n)
+        {
+            memset(&cmds[n], 0, sizeof(profile_command));
+            strcpy(cmds[n++].name, name);
+        }
+        cmds[c].count++;
+        cmds[c].total += prof_lines[i].total;
+        if (prof_lines[i].total > cmds[c].max)
+            cmds[c].max = prof_lines[i].total;
     }
-    if (outfile != STDOUT_FILENO)
+    qsort(cmds, n, sizeof(profile_command), prof_cmp_commands);
+    return n;
+}
+
+/// @brief Print the profile of the batch run to stderr and write it as JSON to profile_path
+void prof_report()
+{
+    // children exit through here when exec fails
+    if (getpid() != prof_pid)
+        return;
+
+    double wall = now_seconds() - prof_start;
+    double parse = 0, spawn = 0, run = 0, reap = 0, lines = 0;
+    uint32_t hist[PROF_BUCKETS] = {0};
+    for (uint32_t i = 0; i < num_prof_lines; i++)
     {
-        dup2(outfile, STDOUT_FILENO);
-        close(outfile);
+        profile_line *p = &prof_lines[i];
+        parse += p->parse;
+        spawn += p->spawn;
+        run += p->run;
+        reap += p->reap;
+        lines += p->total;
+
+        // bucket b holds times below 2^(b+4) microseconds
+        int b = 0;
+        while (b < PROF_BUCKETS - 1 && p->total * 1e6 >= (double)(16ULL << b))
+            b++;
+        hist[b]++;
     }
-    if (errfile != STDERR_FILENO)
+    // time between lines (dispatching, draining output) and loading the batch file is the shell's too
+    double between = wall - lines - prof_load;
+    if (between < 0)
+        between = 0;
+    double shell = parse + spawn + reap + between + prof_load;
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    double cpu_self = self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6 + self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6;
+    double cpu_children = children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6 +
+                          children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+
+    profile_command *cmds = malloc((num_prof_lines + 1) * sizeof(profile_command));
+    uint32_t num_cmds = prof_commands(cmds);
+    profile_line *sorted = malloc((num_prof_lines + 1) * sizeof(profile_line));
+    memcpy(sorted, prof_lines, num_prof_lines * sizeof(profile_line));
+    qsort(sorted, num_prof_lines, sizeof(profile_line), prof_cmp_lines);
+
+    fprintf(stderr, "profile: %u lines, wall %.3fs, shell %.3fs (%.1f%%), children %.3fs (%.1f%%)\n",
+            num_prof_lines, wall, shell, wall > 0 ? 100 * shell / wall : 0, run, wall > 0 ? 100 * run / wall : 0);
+    fprintf(stderr, "profile: shell load %.3fs, parse %.3fs, spawn %.3fs, reap %.3fs, between lines %.3fs\n",
+            prof_load, parse, spawn, reap, between);
+    fprintf(stderr, "profile: cpu shell %.3fs, children %.3fs\n", cpu_self, cpu_children);
+
+    fprintf(stderr, "\n%4s %6s %10s %10s %10s %10s %10s  %s\n", "rank", "#", "total ms", "parse", "spawn", "run",
+            "reap", "command");
+    for (uint32_t i = 0; i < num_prof_lines && i < PROF_TOP; i++)
     {
-        dup2(errfile, STDERR_FILENO);
-        close(errfile);
+        profile_line *p = &sorted[i];
+        fprintf(stderr, "%4u %6u %10.3f %10.3f %10.3f %10.3f %10.3f  %.40s\n", i + 1, p->index, p->total * 1e3,
+                p->parse * 1e3, p->spawn * 1e3, p->run * 1e3, p->reap * 1e3, p->text);
     }
 
-    /* Exec the new process.  Make sure we exit.  */
-    execvp(p->argv[0], p->argv);
-    perror("execvp");
-    exit(1);
-}
-
-/// @brief The heart of the shell. Launch a job
-/// @param j pointer to a job structure
-/// @param foreground job is foreground indicator
-void run_job(job *j, int foreground)
-{
-    process *p;
-    pid_t pid;
-    int mypipe[2], infile, outfile;
+    fprintf(stderr, "\n%-20s %6s %10s %10s %10s\n", "command", "count", "total ms", "mean ms", "max ms");
+    for (uint32_t i = 0; i < num_cmds && i < PROF_TOP; i++)
+        fprintf(stderr, "%-20.20s %6u %10.3f %10.3f %10.3f\n", cmds[i].name, cmds[i].count, cmds[i].total * 1e3,
+                cmds[i].total * 1e3 / cmds[i].count, cmds[i].max * 1e3);
+
+    // only the range of buckets that has lines in it
+    int lo = 0, hi = PROF_BUCKETS - 1;
+    uint32_t most = 0;
+    while (lo < hi && hist[lo] == 0)
+        lo++;
+    while (hi > lo && hist[hi] == 0)
+        hi--;
+    for (int b = lo; b <= hi; b++)
+        most = hist[b] > most ? hist[b] : most;
+    fprintf(stderr, "\n%12s %8s\n", "line time", "count");
+    for (int b = lo; b <= hi && num_prof_lines > 0; b++)
+    {
+        char bound[16];
+        unsigned long long us = 16ULL << b;
+        if (b == PROF_BUCKETS - 1)
+            snprintf(bound, sizeof(bound), "more");
+        else if (us >= 1000000)
+            snprintf(bound, sizeof(bound), "< %llus", us / 1000000);
+        else if (us >= 1000)
+            snprintf(bound, sizeof(bound), "< %llums", us / 1000);
+        else
+            snprintf(bound, sizeof(bound), "< %lluus", us);
+        int bar = most ? (int)(40.0 * hist[b] / most + 0.5) : 0;
+        fprintf(stderr, "%12s %8u %.*s\n", bound, hist[b], bar, "########################################");
+    }
 
-    infile = j->stdin;
-    // iterate over all linked processes of the job
-    for (p = j->first_process; p; p = p->next)
+    FILE *f = fopen(profile_path, "w");
+    if (f == NULL)
     {
-        /* Set up pipes, if necessary.  */
-        if (p->next)
+        perror(profile_path);
+    }
+    else
+    {
+        fprintf(f, "{\"file\":");
+        json_string(f, prof_batch_file);
+        fprintf(f, ",\"wall\":%.6f,\"shell\":%.6f,\"children\":%.6f,\"load\":%.6f,\"parse\":%.6f,\"spawn\":%.6f,"
+                   "\"reap\":%.6f,\"between\":%.6f,\"cpu\":{\"shell\":%.6f,\"children\":%.6f},\"histogram\":[",
+                wall, shell, run, prof_load, parse, spawn, reap, between, cpu_self, cpu_children);
+        for (int b = 0; b < PROF_BUCKETS; b++)
         {
-            if (pipe(mypipe) < 0)
-            {
-                perror("pipe");
-                exit(1);
-            }
-            outfile = mypipe[1];
+            if (b == PROF_BUCKETS - 1)
+                fprintf(f, "%s{\"lt_us\":null,\"count\":%u}", b ? "," : "", hist[b]);
+            else
+                fprintf(f, "%s{\"lt_us\":%llu,\"count\":%u}", b ? "," : "", 16ULL << b, hist[b]);
         }
-        else
-            outfile = j->stdout;
-
-        /* Fork the child processes.  */
-        pid = fork();
-        if (pid == 0)
-            /* This is the child process.  */
-            launch_process(p, j->pgid, infile,
-                           outfile, j->stderr, foreground);
-        else if (pid < 0)
+        fprintf(f, "],\"commands\":[");
+        for (uint32_t i = 0; i < num_cmds; i++)
         {
-            /* The fork failed.  */
-            perror("fork");
-            exit(1);
+            fprintf(f, "%s{\"name\":", i ? "," : "");
+            json_string(f, cmds[i].name);
+            fprintf(f, ",\"count\":%u,\"total\":%.6f,\"max\":%.6f}", cmds[i].count, cmds[i].total, cmds[i].max);
         }
-        else
+        fprintf(f, "],\"lines\":[");
+        for (uint32_t i = 0; i < num_prof_lines; i++)
         {
-            /* This is the parent process.  */
-            p->pid = pid;
-            if (!j->pgid)
-            {
-                j->pgid = pid;
-            }
-            if (getpid() != getsid(0))
-            {
-                setpgid(pid, j->pgid);
-            }
+            profile_line *p = &prof_lines[i];
+            fprintf(f, "%s{\"index\":%u,\"command\":", i ? "," : "", p->index);
+            json_string(f, p->text);
+            fprintf(f, ",\"total\":%.6f,\"parse\":%.6f,\"spawn\":%.6f,\"run\":%.6f,\"reap\":%.6f}", p->total, p->parse,
+                    p->spawn, p->run, p->reap);
         }
-
-        /* Clean up after pipes.  */
-        if (infile != j->stdin)
-            close(infile);
-        if (outfile != j->stdout)
-            close(outfile);
-        infile = mypipe[0];
+        fprintf(f, "]}\n");
+        fclose(f);
     }
+    free(cmds);
+    free(sorted);
+}
 
-    // administer the job to the foreground or keep in background
-    if (foreground)
-        put_job_in_foreground(j, 0);
-    else
-        put_job_in_background(j, 0);
+/// @brief Start profiling a batch run; the report is written when the shell exits, however it exits
+/// @param batch_file the batch file
+void prof_start_run(char *batch_file)
+{
+    profiling = 1;
+    prof_pid = getpid();
+    prof_batch_file = batch_file;
+    prof_start = now_seconds();
+    atexit(prof_report);
 }
 
 /*
- * INIT PROC/JOB FUNCTIONS
+ * BATCH JOURNAL
  */
 
-/// @brief create a populated process struct
-/// @param p the pointer to the process
-/// @param name the name of the process
-/// @param next the next process in the job (if any)
-/// @param argc the argument count
-/// @param argv the argument vector
-/// @param pipe process is piped indicator
-void populate_process_struct(process *p, char *name, process *next, int argc, char *argv[], int pipe)
+#define JOURNAL_VERSION 1
+#define JOURNAL_SYNC_MS 100 /* at most one fdatasync per this many milliseconds */
+
+// start of a journal file, records follow
+typedef struct journal_header
 {
-    // allocate and set name
-    p->name = malloc(256);
-    strcpy(p->name, name);
+    char magic[4];         /* "WSHJ" */
+    uint32_t version;      /* JOURNAL_VERSION */
+    uint64_t hash1, hash2; /* content hash of the batch file the records belong to */
+} journal_header;
 
-    // allocate and set next pointer (for piping)
-    p->next = (struct process *)malloc(sizeof(struct process));
-    p->next = next;
+// one finished batch line
+typedef struct journal_record
+{
+    uint32_t offset; /* byte offset of the line in the batch file */
+    int32_t status;  /* its exit status */
+    uint32_t seq;    /* record number */
+    uint32_t check;  /* hash of the fields above: a record torn by a crash fails it */
+} journal_record;
+
+// the journal of the batch run, synced by a helper thread so lines never wait for the disk
+typedef struct batch_journal
+{
+    int fd;
+    uint32_t seq;
+    uint8_t *done;         /* per compiled line: finished in an earlier run */
+    uint32_t num_done;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int dirty;             /* records written since the last fdatasync */
+    int stop;
+} batch_journal;
+
+char *journal_path = NULL;
+int journal_resume = 0;
+batch_journal journal = {.fd = -1};
+
+/// @brief Checksum of a journal record
+/// @param r the record
+/// @return hash of everything but the check field
+uint32_t journal_check(const journal_record *r)
+{
+    return hash_string((const char *)r, offsetof(journal_record, check)) ^ 0x4a524e4cu;
+}
 
-    // only do this on pipes
-    if (pipe)
+/// @brief Group commit: one fdatasync covers every record written since the previous one
+/// @param arg unused
+/// @return NULL
+void *journal_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&journal.lock);
+    while (true)
     {
-        argc += 1;
+        while (!journal.dirty && !journal.stop)
+            pthread_cond_wait(&journal.cond, &journal.lock);
+        if (!journal.dirty && journal.stop)
+            break;
+        journal.dirty = 0;
+        pthread_mutex_unlock(&journal.lock);
+
+        fdatasync(journal.fd);
+
+        // lines that finish meanwhile wait for the next sync together
+        struct timespec ts = {0, JOURNAL_SYNC_MS * 1000000L};
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&journal.lock);
     }
+    pthread_mutex_unlock(&journal.lock);
+    return NULL;
+}
 
-    // allocate and set cmd args (for exec)
-    p->argv = malloc(sizeof(*argv) * argc);
-    for (int i = 0; i < argc - 1; i++)
+/// @brief Append the record of a finished line; it is on disk within JOURNAL_SYNC_MS
+/// @param offset byte offset of the line in the batch file
+/// @param status its exit status
+void journal_record_line(uint32_t offset, int status)
+{
+    if (journal.fd < 0)
+        return;
+    journal_record r = {offset, status, journal.seq++, 0};
+    r.check = journal_check(&r);
+    if (write(journal.fd, &r, sizeof(r)) != sizeof(r))
+        perror("journal");
+
+    pthread_mutex_lock(&journal.lock);
+    journal.dirty = 1;
+    pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/// @brief Record a background line whose job has finished
+/// @param j job struct pointer
+void journal_reap_job(job *j)
+{
+    if (j->journal_offset >= 0 && (j->dead || job_is_completed(j)))
     {
-        p->argv[i] = strdup(argv[i]);
+        journal_record_line(j->journal_offset, job_exit_status(j));
+        j->journal_offset = -1;
     }
-    p->argv[argc] = NULL;
+}
 
-    p->argc = argc;
+/// @brief Record every background line whose job has finished
+void journal_reap()
+{
+    if (journal.fd < 0)
+        return;
+    for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL)
+            journal_reap_job(jobs[i]);
+}
 
-    p->dead = 0;
+/// @brief Open the journal of a batch run; when resuming, learn which lines already finished
+/// @param path the journal file
+/// @param c the compiled batch file
+/// @return 0 on success, -1 on error (a message is printed)
+int journal_open(char *path, wshc *c)
+{
+    journal_header want = {{'W', 'S', 'H', 'J'}, JOURNAL_VERSION, c->header->hash1, c->header->hash2};
+    journal_header have;
+    journal.done = calloc(c->header->num_lines + 1, 1);
+
+    journal.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal.fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // a journal of another version of the batch file is never resumed, nor silently overwritten by --resume
+    off_t end = sizeof(journal_header);
+    ssize_t n = pread(journal.fd, &have, sizeof(have), 0);
+    if (journal_resume && n == sizeof(have))
+    {
+        if (memcmp(&have, &want, sizeof(want)) != 0)
+        {
+            printf("Error: %s was not written for this version of the batch file.\n", path);
+            close(journal.fd);
+            journal.fd = -1;
+            return -1;
+        }
+
+        // records up to the first torn one count, each marks its line by byte offset
+        journal_record r;
+        while (pread(journal.fd, &r, sizeof(r), end) == sizeof(r) && r.check == journal_check(&r))
+        {
+            uint32_t lo = 0, hi = c->header->num_lines;
+            while (lo < hi)
+            {
+                uint32_t mid = (lo + hi) / 2;
+                if (c->lines[mid].offset < r.offset)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < c->header->num_lines && c->lines[lo].offset == r.offset && !journal.done[lo])
+            {
+                journal.done[lo] = 1;
+                journal.num_done++;
+            }
+            journal.seq = r.seq + 1;
+            end += sizeof(r);
+        }
+    }
+    else if (pwrite(journal.fd, &want, sizeof(want), 0) != sizeof(want))
+    {
+        perror(path);
+        close(journal.fd);
+        journal.fd = -1;
+        return -1;
+    }
+    if (ftruncate(journal.fd, end) < 0 || lseek(journal.fd, end, SEEK_SET) < 0)
+        perror(path);
+    fdatasync(journal.fd);
+
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.cond, NULL);
+
+    // SIGCHLD stays with the main thread, the sync thread inherits a mask that blocks it
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld_mask, &old_mask);
+    pthread_create(&journal.thread, NULL, journal_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (journal_resume)
+        fprintf(stderr, "wsh: resuming, %u of %u lines already done\n", journal.num_done, c->header->num_lines);
+    return 0;
 }
 
-/// @brief create a populated job struct
-/// @param j the pointer to the job
-/// @param fp the first process in the job
-/// @param foreground job is background indicator
-/// @param piped job is piped indicator
-void populate_job_struct(job *j, process *fp, int foreground, int piped)
+/// @brief Wait for the background lines still running, then make every record durable
+void journal_close()
 {
-    // set job id
-    j->next = NULL;
+    if (journal.fd < 0)
+        return;
+    for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL && jobs[i]->journal_offset >= 0 && !jobs[i]->dead)
+            wait_for_job_polling(jobs[i]);
+    journal_reap();
+
+    pthread_mutex_lock(&journal.lock);
+    journal.stop = 1;
+    pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.thread, NULL);
+    fdatasync(journal.fd);
+    close(journal.fd);
+    journal.fd = -1;
+    free(journal.done);
+}
 
-    // allocate and set first process in job
-    j->first_process = (struct process *)malloc(sizeof(struct process));
-    j->first_process = fp;
+/// @brief Check whether a finished line has to run again on resume because it sets shell state
+/// (cd, sched, mux, coproc, read and prefixes on their own, which set the defaults for later lines)
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+/// @return true if the line is replayed
+int journal_replays(int argc, char **argv)
+{
+    if (argc - 1 <= 0)
+        return 0;
+    if (strcmp(argv[0], "cd") == 0 || strcmp(argv[0], "sched") == 0 || strcmp(argv[0], "mux") == 0 ||
+        strcmp(argv[0], "coproc") == 0 || strcmp(argv[0], "read") == 0)
+        return 1;
+    char *copy[argc];
+    memcpy(copy, argv, argc * sizeof(char *));
+    spawn_attrs attrs = shell_attrs;
+    return parse_spawn_prefixes(argc, copy, &attrs) == argc - 1;
+}
 
-    j->foreground = foreground;
+/*
+ * SESSION RECORDER
+ */
 
-    j->job_id = smallest_available_id();
+// --record: one line per command line the shell ran, read back by wshreplay; written with one
+// write() per line, so a forked child never holds a buffered copy
+int record_fd = -1;
+double record_start;
+pid_t record_pid;
+
+/// @brief Write one command line to the record
+/// @param issued when the line was started, in seconds since the record began
+/// @param bg the line was a background job
+/// @param status its exit status, -1 if it had not finished when the shell exited
+/// @param elapsed seconds until it was seen done
+/// @param cmd the command line
+void record_write(double issued, int bg, int status, double elapsed, char *cmd)
+{
+    char line[8192];
+    int n = snprintf(line, sizeof(line), "%.6f\t%s\t%d\t%.6f\t%s\n", issued, bg ? "bg" : "fg", status, elapsed, cmd);
+    if (n >= (int)sizeof(line))
+    {
+        n = sizeof(line);
+        line[n - 1] = '\n';
+    }
+    if (write(record_fd, line, n) != n)
+        perror("record");
+}
 
-    j->dead = 0;
+/// @brief Record a background job once it is seen done
+/// @param j job struct pointer
+void record_job(job *j)
+{
+    if (j->record_issued >= 0 && (j->dead || job_is_completed(j)))
+    {
+        record_write(j->record_issued, 1, job_exit_status(j), now_seconds() - record_start - j->record_issued,
+                     j->command);
+        j->record_issued = -1;
+    }
+}
 
-    j->piped = piped;
+/// @brief Record every background job that finished
+void record_reap()
+{
+    if (record_fd < 0)
+        return;
+    for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL)
+            record_job(jobs[i]);
+}
 
-    // set fds
-    j->stdin = 0;
-    j->stdout = 1;
-    j->stderr = 2;
+/// @brief Record a command line right after eval returned: a foreground line is done, a background one
+/// is recorded when its job finishes
+/// @param j the job the line started, or NULL
+/// @param cmd the command line
+/// @param issued when eval was called, from now_seconds()
+void record_command(job *j, char *cmd, double issued)
+{
+    if (record_fd < 0 || cmd[strspn(cmd, " \t")] == '\0')
+        return;
+    if (j != NULL && !j->foreground && !j->dead)
+        j->record_issued = issued - record_start;
+    else
+        record_write(issued - record_start, j != NULL && !j->foreground, last_status, now_seconds() - issued, cmd);
+}
+
+/// @brief Write out the background jobs still running at exit and close the record
+void record_close()
+{
+    if (record_fd < 0 || getpid() != record_pid)
+        return;
+    record_reap();
+    for (int i = 0; i < 256; i++)
+        if (jobs[i] != NULL && jobs[i]->record_issued >= 0)
+            record_write(jobs[i]->record_issued, 1, -1, now_seconds() - record_start - jobs[i]->record_issued,
+                         jobs[i]->command);
+    close(record_fd);
+    record_fd = -1;
+}
+
+/// @brief Start recording the session
+/// @param path the record file
+/// @return 0 on success, -1 on error
+int record_open(char *path)
+{
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (record_fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    record_start = now_seconds();
+    record_pid = getpid();
+    dprintf(record_fd, "# wsh record 1 started %lld\n", (long long)time(NULL));
+    atexit(record_close);
+    return 0;
 }
 
 /*
  * RUNNER FUNCTIONS
  */
 
-/// @brief run function for interactive mode
-/// @return exit code
-int runi()
+/// @brief Put the shell in its own process group, grab the terminal and ignore job control signals
+void init_shell()
 {
     shell_terminal = STDIN_FILENO;
+    int tty = isatty(shell_terminal);
 
-    /* Loop until we are in the foreground.  */
-    while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
+    /* Loop until we are in the foreground (a batch run from a file or a pipe has no terminal).  */
+    while (tty && tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
         kill(-shell_pgid, SIGTTIN);
 
     // ignore job control signals
@@ -724,6 +6976,7 @@ int runi()
     signal(SIGTTIN, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
     signal(SIGQUIT, SIG_IGN);
+    init_sigchld_pipe();
     signal(SIGCHLD, sigchld_handler);
     // signal(SIGCHLD, SIG_IGN);
 
@@ -739,560 +6992,1478 @@ int runi()
     }
 
     // Grab control of the terminal
+    if (!tty)
+        return;
     tcsetpgrp(shell_terminal, shell_pgid);
     // Save default terminal attributes for shell.
     tcgetattr(shell_terminal, &shell_tmodes);
+}
 
-    // iterate until an exit call is processed
-    while (true)
+/// @brief Build the linked processes of a job from a command split on `|`
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+/// @return the first process of the pipeline, or NULL on an empty pipeline stage
+process *build_pipeline(int argc, char *argv[])
+{
+    process *next = NULL;
+    int end = argc - 1;
+
+    // we have to go backwards to link the processes together upon creation
+    for (int i = argc - 2; i >= -1; i--)
     {
-        printf("wsh> ");
+        if (i == -1 || argv[i] == pipe_word)
+        {
+            // the stage's words are copied by populate_process_struct, straight from argv
+            int idx = end - (i + 1);
+            if (idx == 0)
+            {
+                printf("Error: empty command in pipeline.\n");
+                return NULL;
+            }
 
-        // collect user cmd
-        char cmd[256];
-        char *line = fgets(cmd, sizeof(cmd), stdin);
+            process *p = (struct process *)malloc(sizeof(struct process));
+            populate_process_struct(p, argv[i + 1], next, idx + 1, argv + i + 1);
+            next = p;
+            end = i;
+        }
+    }
+    return next;
+}
 
-        // check if EOF is reached/input
-        if (line == NULL)
+/// @brief Run a builtin command if argv names one
+/// @param argc the argument count (including NULL termination)
+/// @param argv the argument vector
+/// @return true if argv was a builtin
+int run_builtin(int argc, char *argv[])
+{
+    // exit
+    if (strcmp(argv[0], "exit") == 0)
+    {
+        wsh_exit();
+    }
+    // cd
+    else if (strcmp(argv[0], "cd") == 0)
+    {
+        wsh_cd(argc, argv);
+    }
+    // jobs
+    else if (strcmp(argv[0], "jobs") == 0)
+    {
+        wsh_jobs(argc, argv);
+    }
+    // fg
+    else if (strcmp(argv[0], "fg") == 0)
+    {
+        wsh_fg(argc, argv);
+    }
+    // bg
+    else if (strcmp(argv[0], "bg") == 0)
+    {
+        wsh_bg(argc, argv);
+    }
+    // sched
+    else if (strcmp(argv[0], "sched") == 0)
+    {
+        wsh_sched(argc, argv);
+    }
+    // mux
+    else if (strcmp(argv[0], "mux") == 0)
+    {
+        wsh_mux(argc, argv);
+    }
+    // history
+    else if (strcmp(argv[0], "history") == 0)
+    {
+        wsh_history(argc, argv);
+    }
+    // pack
+    else if (strcmp(argv[0], "pack") == 0)
+    {
+        wsh_pack(argc, argv);
+    }
+    // wait
+    else if (strcmp(argv[0], "wait") == 0)
+    {
+        wsh_wait(argc, argv);
+    }
+    // read
+    else if (strcmp(argv[0], "read") == 0)
+    {
+        wsh_read(argc, argv);
+    }
+    // :
+    else if (strcmp(argv[0], ":") == 0)
+    {
+        last_status = 0;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/// @brief Split a command line on spaces in place, counting pipes and &
+/// @param line the command line (modified)
+/// @param argv where to store the words, NULL terminated (room for max + 1 entries)
+/// @param max maximum number of words
+/// @param num_pipes where to store the number of | words
+/// @param bg where to store whether there is an & word
+/// @return number of words
+int tokenize_line(char *line, char **argv, int max, int *num_pipes, int *bg)
+{
+    size_t len = strlen(line);
+    uint64_t carry = 0;
+    int n = 0;
+
+    *num_pipes = 0;
+    *bg = 0;
+    // whole 64-byte blocks go through the vector scanner, the tail through a padded copy
+    for (size_t i = 0; i < len && n < max; i += 64)
+    {
+        uint64_t newlines, spaces, valid = ~0ULL;
+        if (len - i >= 64)
         {
-            printf("EOF\n");
-            wsh_exit();
+            spaces = scan_block(line + i, &newlines);
+        }
+        else
+        {
+            spaces = scan_tail(line + i, len - i, &newlines);
+            valid = (1ULL << (len - i)) - 1;
         }
 
-        // remove newline
-        if (cmd[strlen(cmd) - 1] == '\n')
+        // a word starts at a non-delimiter byte whose predecessor is a delimiter
+        uint64_t word = ~(spaces | newlines) & valid;
+        uint64_t starts = word & ~((word << 1) | carry);
+        carry = word >> 63;
+        while (starts && n < max)
         {
-            cmd[strlen(cmd) - 1] = '\0';
+            argv[n++] = line + i + __builtin_ctzll(starts);
+            starts &= starts - 1;
         }
+    }
+    // the last word may run into a block that was not scanned
+    if (n == max && n > 0)
+        argv[n - 1][strcspn(argv[n - 1], " \n")] = '\0';
+    n = classify_words(argv, n, num_pipes, bg);
+    argv[n] = NULL;
+    return n;
+}
 
-        int num_pipes = 0;
-        int bg = 0;
+/// @brief Parse and run one command line: builtins, foreground/background and piped jobs
+/// @param cmd the command line without its trailing newline
+/// @param force_bg run the job in the background even without a trailing & (builtins are not run)
+/// @return the job that was started, or NULL for builtins, empty lines and errors
+job *eval_line(char *cmd, int force_bg)
+{
+    int num_pipes = 0;
+    int bg = 0;
+
+    // parse command
+    size_t len = strlen(cmd);
+    char tmp_cmd[len + 1];
+    memcpy(tmp_cmd, cmd, len + 1);
+    int max_words = len / 2 + 1;
+    char *cmd_argv[max_words + 1];
+    int cmd_argc = tokenize_line(tmp_cmd, cmd_argv, max_words, &num_pipes, &bg);
+
+    // add room for NULL termination
+    return eval_argv(cmd_argc + 1, cmd_argv, num_pipes, bg, cmd, force_bg);
+}
+
+/// @brief Run a tokenized and expanded command line: builtins, foreground/background and piped jobs
+/// @param cmd_argc the argument count (including NULL termination)
+/// @param cmd_argv the argument vector (the array is modified, the words are not)
+/// @param num_pipes number of | words
+/// @param bg there is an & word
+/// @param cmd the command line, kept for messages
+/// @param force_bg run the job in the background even without a trailing & (builtins are not run)
+/// @param e the expansion the words came from (its pipe ends go to the job), or NULL
+/// @return the job that was started, or NULL for builtins, empty lines and errors
+job *eval_expanded(int cmd_argc, char **cmd_argv, int num_pipes, int bg, char *cmd, int force_bg, expansion *e)
+{
+    int exec = eval_exec;
+    eval_exec = 0;
+    if (cmd_argc - 1 <= 0)
+        return NULL;
 
-        // parse command
-        char tmp_cmd[256];
-        strcpy(tmp_cmd, cmd);
-        int cmd_argc = 0;
+    // drop the trailing &
+    if (bg)
+    {
+        cmd_argv[cmd_argc - 2] = NULL;
+        cmd_argc -= 1;
+        if (cmd_argc - 1 <= 0)
+            return NULL;
+    }
 
-        char *cmd_seg = strtok(tmp_cmd, " ");
-        while (cmd_seg != NULL)
+    // exec replaces the shell with the command (2), the last line of a batch file may do so too (1)
+    if (strcmp(cmd_argv[0], "exec") == 0)
+    {
+        if (num_pipes > 0 || bg || force_bg)
         {
-            cmd_argc += 1;
-            cmd_seg = strtok(NULL, " ");
+            printf("Error: exec takes a single foreground command.\n");
+            return NULL;
         }
-        // add room for NULL termination
-        cmd_argc += 1;
+        cmd_argv++;
+        cmd_argc--;
+        exec = 2;
+        if (cmd_argc - 1 <= 0)
+            return NULL;
+    }
+
+    // strip per-job prefixes (nice, taskset, timeout, ulimit); on their own they set the shell defaults
+    spawn_attrs attrs = shell_attrs;
+    int skip = parse_spawn_prefixes(cmd_argc, cmd_argv, &attrs);
+    if (skip < 0)
+        return NULL;
+    if (skip > 0 && skip == cmd_argc - 1)
+    {
+        shell_attrs = attrs;
+        return NULL;
+    }
+    cmd_argv += skip;
+    cmd_argc -= skip;
+    if (exec == 2 && attrs.timeout_ms > 0)
+    {
+        printf("Error: exec cannot keep a timeout, the shell would be gone.\n");
+        return NULL;
+    }
+
+    // <<WORD and <<< word become the job's stdin (of the builtins only read and pack take it)
+    int here_fd;
+    if (parse_here_input(&cmd_argc, cmd_argv, eval_heredoc, &here_fd) < 0)
+        return NULL;
+    if (cmd_argc - 1 <= 0)
+    {
+        if (here_fd >= 0)
+            close(here_fd);
+        return NULL;
+    }
 
-        strcpy(tmp_cmd, cmd);
-        char *cmd_argv[cmd_argc];
-        cmd_seg = strtok(tmp_cmd, " ");
-        for (int i = 0; i < cmd_argc; i++)
+    // <&N and >&N hand the job one of the shell's descriptors, the shell keeps it open
+    int in_fd, out_fd;
+    if (parse_fd_redirects(&cmd_argc, cmd_argv, &in_fd, &out_fd) < 0 || cmd_argc - 1 <= 0 ||
+        (in_fd >= 0 && here_fd >= 0))
+    {
+        if (in_fd >= 0 && here_fd >= 0)
+            printf("Error: a command takes one of <& and here-documents.\n");
+        if (here_fd >= 0)
+            close(here_fd);
+        return NULL;
+    }
+
+    // coproc starts the whole (possibly piped) rest of the line
+    if (strcmp(cmd_argv[0], "coproc") == 0 && !bg && !force_bg && exec != 2)
+    {
+        if (here_fd >= 0)
+            close(here_fd);
+        int saved = redirect_stdout();
+        wsh_coproc(cmd_argc, cmd_argv);
+        restore_stdout(saved);
+        return NULL;
+    }
+
+    // cache wraps the whole (possibly piped) command line
+    if (strcmp(cmd_argv[0], "cache") == 0 && !bg && !force_bg && exec != 2)
+    {
+        if (here_fd >= 0)
+            close(here_fd);
+        int saved = redirect_stdout();
+        wsh_cache(cmd_argc, cmd_argv, &attrs, cmd);
+        restore_stdout(saved);
+        return NULL;
+    }
+
+    // built-ins run in the shell itself, only in the foreground and outside pipelines
+    if (num_pipes == 0 && !bg && !force_bg && exec != 2)
+    {
+        // read and pack take <&N or the here-document; read takes a line from a pipe one byte at a
+        // time, so a coprocess's next reply stays in the pipe
+        static read_buffer fd_input;
+        read_buffer *saved_input = read_input;
+        int saved_stdout = eval_stdout;
+        if (in_fd >= 0 || here_fd >= 0)
         {
-            if (i != cmd_argc - 1 && strcmp(cmd_seg, "|") == 0)
-            {
-                num_pipes += 1;
-            }
-            else if (i != cmd_argc - 1 && strcmp(cmd_seg, "&") == 0)
-            {
-                bg = 1;
-            }
-            cmd_argv[i] = cmd_seg;
-            cmd_seg = strtok(NULL, " ");
+            fd_input.fd = in_fd >= 0 ? in_fd : here_fd;
+            fd_input.mode = -1;
+            fd_input.pos = fd_input.len = 0;
+            read_input = &fd_input;
         }
-        // NULL terminate
-        cmd_argv[cmd_argc] = NULL;
-
-        if (cmd_argc - 1 > 0)
+        if (out_fd >= 0)
+            eval_stdout = out_fd;
+        int saved = redirect_stdout();
+        int builtin = run_builtin(cmd_argc, cmd_argv);
+        restore_stdout(saved);
+        read_input = saved_input;
+        eval_stdout = saved_stdout;
+        if (builtin)
         {
-            if (num_pipes > 0)
-            {
-                // handle a background process
-                if (bg)
-                {
-                    cmd_argv[cmd_argc - 2] = NULL;
-                    cmd_argc -= 1;
+            if (here_fd >= 0)
+                close(here_fd);
+            return NULL;
+        }
+    }
 
-                    int tmp_argc = cmd_argc - 2;
-                    int num_itr = 0;
+    // create a process for each pipe stage (or the single process)
+    process *first_p = build_pipeline(cmd_argc, cmd_argv);
+    if (first_p == NULL)
+    {
+        if (here_fd >= 0)
+            close(here_fd);
+        return NULL;
+    }
 
-                    process *prev_p = (struct process *)malloc(sizeof(struct process));
-                    process *first_p = (struct process *)malloc(sizeof(struct process));
+    // create the job and link it to the first process
+    bg = bg || force_bg;
+    job *j = (struct job *)malloc(sizeof(struct job));
+    populate_job_struct(j, first_p, !bg, num_pipes > 0);
+    j->attrs = attrs;
+    j->command = strdup(cmd);
+    j->stdin = here_fd >= 0 ? here_fd : in_fd >= 0 ? in_fd : eval_stdin;
+    j->own_stdin = here_fd >= 0;
+    j->stdout = out_fd >= 0 ? out_fd : eval_stdout;
+    if (e)
+    {
+        memcpy(j->pass_fds, e->pass_fds, sizeof(e->pass_fds));
+        j->num_pass_fds = e->num_pass_fds;
+        e->num_pass_fds = 0;
+    }
 
-                    // create a process for each pipe
-                    while (num_itr != num_pipes + 1)
-                    {
-                        // we have to go backwards to link the processes together upon creation
-                        char *tmp_argv[256];
-                        int idx = 0;
-                        for (int i = tmp_argc; i >= 0; i--)
-                        {
-                            tmp_argc -= 1;
-                            if (strcmp(cmd_argv[i], "|") == 0)
-                            {
-                                break;
-                            }
+    // nothing is left for the shell to do after a simple command nobody else is waiting beside
+    if (exec == 2 || (exec && num_pipes == 0 && !bg && !force_bg && attrs.timeout_ms == 0 && !jobs_pending()))
+        exec_job(j);
 
-                            tmp_argv[idx] = cmd_argv[i];
-                            idx += 1;
-                        }
+    // add job to jobs array
+    add_job(j);
 
-                        int tmp_argc_2 = reverse_array(tmp_argv, idx);
+    // run the job in the foreground or background
+    run_job(j, !bg);
+    return j;
+}
 
-                        // first iteration, link process to nothing (is last proc of pipe)
-                        if (num_itr == 0)
-                        {
-                            populate_process_struct(prev_p, tmp_argv[0], NULL, tmp_argc_2, tmp_argv, 1);
-                        }
-                        else
-                        {
-                            process *p = (struct process *)malloc(sizeof(struct process));
-                            // last iteration, populate the first process of the pipe
-                            if (num_itr == num_pipes)
-                            {
-                                populate_process_struct(first_p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                            }
-                            // create a middle process and link it to the previous process
-                            else
-                            {
-                                populate_process_struct(p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                                prev_p = p;
-                            }
-                        }
+/// @brief Run a tokenized command line, expanding substitutions and $? words first
+/// @param cmd_argc the argument count (including NULL termination)
+/// @param cmd_argv the argument vector (the array is modified, the words are not)
+/// @param num_pipes number of | words
+/// @param bg there is an & word
+/// @param cmd the command line, kept for messages
+/// @param force_bg run the job in the background even without a trailing & (builtins are not run)
+/// @return the job that was started, or NULL for builtins, empty lines and errors
+job *eval_argv(int cmd_argc, char **cmd_argv, int num_pipes, int bg, char *cmd, int force_bg)
+{
+    // only the line itself may replace the shell, not the commands its loops and expansions run
+    int exec = eval_exec;
+    eval_exec = 0;
 
-                        num_itr += 1;
-                    }
-                    // create the job and link it to the first process
-                    job *j = (struct job *)malloc(sizeof(struct job));
-                    populate_job_struct(j, first_p, 0, 1);
+    // a while loop is run by the shell itself, its commands come back here every iteration
+    int w = cmd_argc - 1 > 0 ? find_while(cmd_argv) : -1;
+    if (w >= 0)
+    {
+        run_while(cmd_argv, w);
+        return NULL;
+    }
 
-                    // add job to jobs array
-                    jobs[curr_id] = j;
-                    curr_id = curr_id + 1;
+    if (cmd_argc - 1 <= 0 || !needs_expansion(cmd_argv))
+    {
+        eval_exec = exec;
+        return eval_expanded(cmd_argc, cmd_argv, num_pipes, bg, cmd, force_bg, NULL);
+    }
 
-                    // run the job in the background
-                    run_job(j, 0);
-                }
-                // handle a foreground process -- see above comments
-                else
-                {
-                    int tmp_argc = cmd_argc - 2;
-                    int num_itr = 0;
+    // the expanded words live in e until the job's processes have copied them
+    expansion e;
+    memset(&e, 0, sizeof(e));
+    char **words = expand_words(cmd_argv, &e);
+    job *j = NULL;
+    if (words)
+    {
+        int n = 0;
+        while (words[n] != NULL)
+            n++;
+        eval_exec = exec;
+        j = eval_expanded(n + 1, words, num_pipes, bg, cmd, force_bg, &e);
+    }
 
-                    process *prev_p = (struct process *)malloc(sizeof(struct process));
-                    process *first_p = (struct process *)malloc(sizeof(struct process));
+    // pipe ends no job took (a builtin, an error): the inner jobs see EOF or EPIPE
+    for (int i = 0; i < e.num_pass_fds; i++)
+        close(e.pass_fds[i]);
+    free(words);
+    free(e.buf);
+    free(e.words);
+    return j;
+}
 
-                    while (num_itr != num_pipes + 1)
-                    {
-                        char *tmp_argv[256];
-                        int idx = 0;
-                        for (int i = tmp_argc; i >= 0; i--)
-                        {
-                            tmp_argc -= 1;
-                            if (strcmp(cmd_argv[i], "|") == 0)
-                            {
-                                break;
-                            }
+/// @brief Read the body of a command line's <<WORD here-document from the terminal
+/// @param cmd the command line
+/// @param edit read with the line editor
+/// @return the malloc'd body, or NULL if the line has no here-document
+char *read_heredoc(char *cmd, int edit)
+{
+    size_t len = strlen(cmd);
+    char tmp[len + 1];
+    memcpy(tmp, cmd, len + 1);
+    char *argv[len / 2 + 2];
+    char delim[256];
+    int num_pipes, bg, strip_tabs, num_op;
+    int n = tokenize_line(tmp, argv, len / 2 + 1, &num_pipes, &bg);
+    if (find_heredoc(argv, n, delim, sizeof(delim), &strip_tabs, &num_op) < 0)
+        return NULL;
+
+    char *body = NULL;
+    uint32_t body_len = 0, cap_body = 0;
+    grow_array(&body, &cap_body, 1, 1);
+    body[0] = '\0';
+    while (true)
+    {
+        char line[4096];
+        char *got;
+        if (edit)
+        {
+            got = edit_line("> ", line, sizeof(line));
+        }
+        else
+        {
+            printf("> ");
+            fflush(stdout);
+            got = fgets(line, sizeof(line), stdin);
+        }
+        if (got == NULL)
+            break;
+        size_t n = strlen(line);
+        if (n > 0 && line[n - 1] == '\n')
+            line[--n] = '\0';
+        if (heredoc_end(line, n, delim, strip_tabs))
+            break;
+        heredoc_append(&body, &body_len, &cap_body, line, n, strip_tabs);
+    }
+    return body;
+}
 
-                            tmp_argv[idx] = cmd_argv[i];
-                            idx += 1;
-                        }
+/// @brief run function for interactive mode
+/// @return exit code
+int runi()
+{
+    init_shell();
+    hist_open();
 
-                        int tmp_argc_2 = reverse_array(tmp_argv, idx);
+    // the line editor needs a terminal that understands escape sequences
+    char *term = getenv("TERM");
+    int edit = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0);
 
-                        if (num_itr == 0)
-                        {
-                            populate_process_struct(prev_p, tmp_argv[0], NULL, tmp_argc_2, tmp_argv, 1);
-                        }
-                        else
-                        {
-                            process *p = (struct process *)malloc(sizeof(struct process));
-                            if (num_itr == num_pipes)
-                            {
-                                populate_process_struct(first_p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                            }
-                            else
-                            {
-                                populate_process_struct(p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                                prev_p = p;
-                            }
-                        }
+    // iterate until an exit call is processed
+    while (true)
+    {
+        sched_dispatch();
 
-                        num_itr += 1;
-                    }
-                    job *j = (struct job *)malloc(sizeof(struct job));
+        // collect user cmd
+        char cmd[4096];
+        char *line;
+        if (edit)
+        {
+            line = edit_line("wsh> ", cmd, sizeof(cmd));
+        }
+        else
+        {
+            printf("wsh> ");
+            fflush(stdout);
 
-                    populate_job_struct(j, first_p, 1, 1);
+            // keep starting queued background jobs until the user types something
+            sched_wait(STDIN_FILENO);
+            line = fgets(cmd, sizeof(cmd), stdin);
+        }
 
-                    jobs[curr_id] = j;
-                    curr_id = curr_id + 1;
+        // check if EOF is reached/input
+        if (line == NULL)
+        {
+            printf("EOF\n");
+            wsh_exit();
+        }
 
-                    run_job(j, 1);
-                }
+        // remove newline
+        size_t len = strlen(cmd);
+        if (len > 0 && cmd[len - 1] == '\n')
+        {
+            cmd[len - 1] = '\0';
+        }
+
+        // a <<WORD here-document continues on the following lines
+        char *body = read_heredoc(cmd, edit);
+        hist_add(cmd);
+        record_reap();
+        double issued = now_seconds();
+        eval_heredoc = body;
+        job *j = eval_line(cmd, 0);
+        eval_heredoc = NULL;
+        record_command(j, cmd, issued);
+        free(body);
+    }
+    return 0;
+}
+
+/// @brief batch mode runner function
+/// @param batch_file the file of batch commands
+/// @return exit code
+int runb(char *batch_file)
+{
+    init_shell();
+
+    printf("%s\n", batch_file);
+    if (profile_path)
+        prof_start_run(batch_file);
+
+    // the compiled form has every line tokenized already, the batch file is only parsed when it changed
+    wshc c;
+    if (wshc_open(batch_file, &c) < 0)
+    {
+        perror(batch_file);
+        return 1;
+    }
+    if (profiling)
+        prof_load = now_seconds() - prof_start;
+    if (journal_path && journal_open(journal_path, &c) < 0)
+    {
+        wshc_close(&c);
+        return 1;
+    }
+
+    for (uint32_t l = 0; l < c.header->num_lines; l++)
+    {
+        sched_dispatch();
+        journal_reap();
+        record_reap();
+        double line_start = profiling || record_fd >= 0 ? now_seconds() : 0;
+
+        // point the argument vector straight into the compiled strings
+        wshc_line *line = &c.lines[l];
+        char *cmd_argv[line->num_tokens + 1];
+        for (uint32_t t = 0; t < line->num_tokens; t++)
+        {
+            cmd_argv[t] = c.strings + c.offsets[c.tokens[line->first_token + t]];
+            if (strcmp(cmd_argv[t], "|") == 0 || strcmp(cmd_argv[t], "&") == 0)
+                cmd_argv[t] = cmd_argv[t][0] == '|' ? pipe_word : bg_word;
+        }
+        cmd_argv[line->num_tokens] = NULL;
+
+        // lines finished by an earlier run are skipped, unless later lines depend on the state they set
+        if (journal.done && journal.done[l] && !journal_replays(line->num_tokens + 1, cmd_argv))
+            continue;
+
+        // handle each command whatever it is -- see eval_argv; the last one may take the shell's place
+        eval_heredoc = line->heredoc != WSHC_NONE ? c.strings + c.offsets[line->heredoc] : NULL;
+        eval_exec = l + 1 == c.header->num_lines && !profiling && !journal_path && record_fd < 0;
+        job *j = eval_argv(line->num_tokens + 1, cmd_argv, line->num_pipes, line->bg,
+                           c.strings + c.offsets[line->text], 0);
+        eval_heredoc = NULL;
+        if (profiling)
+            prof_record(l + 1, c.strings + c.offsets[line->text], line_start);
+        record_command(j, c.strings + c.offsets[line->text], line_start);
+
+        // a background line is journaled when its job is seen done
+        if (journal_path && !journal.done[l])
+        {
+            if (j != NULL && line->bg)
+            {
+                j->journal_offset = line->offset;
+                journal_reap_job(j);
             }
-            // non piped job
             else
-            {
-                // handle a background job
-                if (bg)
-                {
-                    cmd_argv[cmd_argc - 2] = NULL;
-                    cmd_argc -= 1;
+                journal_record_line(line->offset, last_status);
+        }
+    }
+    wshc_close(&c);
 
-                    process *p = (struct process *)malloc(sizeof(struct process));
-                    job *j = (struct job *)malloc(sizeof(struct job));
+    // every queued background job still gets started
+    sched_wait(-1);
+    journal_close();
 
-                    populate_process_struct(p, cmd_argv[0], NULL, cmd_argc, cmd_argv, 0);
-                    populate_job_struct(j, p, 0, 0);
+    // let multiplexed background jobs finish writing before the shell goes away
+    mux_drain();
+    return 0;
+}
 
-                    jobs[curr_id] = j;
-                    curr_id += 1;
+/*
+ * DEPENDENCY GRAPH BATCHES
+ */
 
-                    run_job(j, 0);
-                }
-                // it is a foreground job or a built-in call
-                else
-                {
-                    // exit
-                    if (strcmp(cmd_argv[0], "exit") == 0)
-                    {
-                        wsh_exit();
-                    }
-                    // cd
-                    else if (strcmp(cmd_argv[0], "cd") == 0)
-                    {
-                        wsh_cd(cmd_argc, cmd_argv);
-                    }
-                    // jobs
-                    else if (strcmp(cmd_argv[0], "jobs") == 0)
-                    {
-                        wsh_jobs();
-                    }
-                    // fg
-                    else if (strcmp(cmd_argv[0], "fg") == 0)
-                    {
-                        wsh_fg(cmd_argc, cmd_argv);
-                    }
-                    // bg
-                    else if (strcmp(cmd_argv[0], "bg") == 0)
-                    {
-                        wsh_bg(cmd_argc, cmd_argv);
-                    }
-                    // run foreground job
-                    else
-                    {
-                        process *p = (struct process *)malloc(sizeof(struct process));
-                        job *j = (struct job *)malloc(sizeof(struct job));
+enum dag_state
+{
+    DAG_PENDING,
+    DAG_RUNNING,
+    DAG_DONE,
+    DAG_SKIPPED,
+    DAG_FAILED,
+    DAG_BLOCKED
+};
+
+// one line of a batch file run as a dependency graph
+typedef struct dag_node
+{
+    char *label;     /* @label, or NULL for a plain (barrier) line */
+    char *cmd;       /* command line handed to eval_line */
+    char *after[64]; /* labels this node waits for */
+    int num_after;
+    char *in[64];    /* files this node reads */
+    int num_in;
+    char *out[64];   /* files this node produces */
+    int num_out;
+    int *deps;       /* indices of the nodes this node waits for */
+    int num_deps;
+    int state;       /* dag_state */
+    job *j;          /* the running job */
+    int status;      /* exit status */
+    double start;    /* seconds since the run started */
+    double end;
+    double path;     /* longest chain of run time ending in this node */
+    int path_prev;   /* previous node on that chain, -1 if none */
+} dag_node;
+
+int dag_mode = 0;
+int dag_max_jobs = 0;
+
+/// @brief Seconds on the monotonic clock
+/// @return time in seconds
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief Split a comma separated list into a node's list, duplicating each entry
+/// @param list the comma separated values
+/// @param dst the list to append to
+/// @param n number of entries in dst
+void dag_split(char *list, char **dst, int *n)
+{
+    char *save;
+    for (char *v = strtok_r(list, ",", &save); v && *n < 64; v = strtok_r(NULL, ",", &save))
+        dst[(*n)++] = strdup(v);
+}
 
-                        populate_process_struct(p, cmd_argv[0], NULL, cmd_argc, cmd_argv, 0);
-                        populate_job_struct(j, p, 1, 0);
+/// @brief Parse a batch line: "@label [after=a,b] [in=f,g] [out=h] : command" or a plain command
+/// @param line the line without its newline
+/// @param node the node to fill
+/// @return 0 on success, -1 on a malformed line
+int dag_parse_line(char *line, dag_node *node)
+{
+    memset(node, 0, sizeof(*node));
+    node->path_prev = -1;
 
-                        jobs[curr_id] = j;
-                        curr_id = curr_id + 1;
+    while (*line == ' ')
+        line++;
+    if (*line != '@')
+    {
+        node->cmd = strdup(line);
+        return 0;
+    }
 
-                        run_job(j, 1);
-                    }
+    char *colon = strstr(line, " : ");
+    if (colon == NULL)
+        return -1;
+    *colon = '\0';
+    node->cmd = strdup(colon + 3);
+
+    char *save;
+    char *word = strtok_r(line + 1, " ", &save);
+    if (word == NULL)
+        return -1;
+    node->label = strdup(word);
+    while ((word = strtok_r(NULL, " ", &save)) != NULL)
+    {
+        if (strncmp(word, "after=", 6) == 0)
+            dag_split(word + 6, node->after, &node->num_after);
+        else if (strncmp(word, "in=", 3) == 0)
+            dag_split(word + 3, node->in, &node->num_in);
+        else if (strncmp(word, "out=", 4) == 0)
+            dag_split(word + 4, node->out, &node->num_out);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+/// @brief Add a dependency edge if it is not there yet
+/// @param node the dependent node
+/// @param dep index of the node it waits for
+void dag_add_dep(dag_node *node, int dep)
+{
+    for (int i = 0; i < node->num_deps; i++)
+        if (node->deps[i] == dep)
+            return;
+    node->deps = realloc(node->deps, sizeof(int) * (node->num_deps + 1));
+    node->deps[node->num_deps++] = dep;
+}
+
+/// @brief Resolve labels, produced/consumed files and barriers into edges
+/// @param nodes the nodes
+/// @param n number of nodes
+/// @return 0 on success, -1 on an unknown label
+int dag_link(dag_node *nodes, int n)
+{
+    int barrier = -1;
+
+    for (int i = 0; i < n; i++)
+    {
+        dag_node *node = &nodes[i];
+        if (node->label == NULL)
+        {
+            // a plain line waits for everything before it and everything after it waits for it
+            for (int k = 0; k < i; k++)
+                dag_add_dep(node, k);
+            barrier = i;
+            continue;
+        }
+        if (barrier >= 0)
+            dag_add_dep(node, barrier);
+
+        for (int a = 0; a < node->num_after; a++)
+        {
+            int found = 0;
+            for (int k = 0; k < n; k++)
+            {
+                if (k != i && nodes[k].label && strcmp(nodes[k].label, node->after[a]) == 0)
+                {
+                    dag_add_dep(node, k);
+                    found = 1;
                 }
             }
+            if (!found)
+            {
+                fprintf(stderr, "wsh: dag: %s waits for unknown label %s\n", node->label, node->after[a]);
+                return -1;
+            }
         }
+        for (int f = 0; f < node->num_in; f++)
+            for (int k = 0; k < n; k++)
+                for (int o = 0; k != i && o < nodes[k].num_out; o++)
+                    if (strcmp(nodes[k].out[o], node->in[f]) == 0)
+                        dag_add_dep(node, k);
     }
     return 0;
 }
 
-/// @brief batch mode runner function
-/// @param batch_file the file of batch commands
-/// @return exit code
-int runb(char *batch_file)
+/// @brief Return true if every output exists and is newer than every input
+/// @param node the node
+/// @return up to date indicator
+int dag_up_to_date(dag_node *node)
 {
-    shell_terminal = STDIN_FILENO;
+    struct stat st;
+    struct timespec oldest_out = {0, 0};
 
-    /* Loop until we are in the foreground.  */
-    while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
-        kill(-shell_pgid, SIGTTIN);
+    if (node->num_out == 0)
+        return 0;
+    for (int o = 0; o < node->num_out; o++)
+    {
+        if (stat(node->out[o], &st) < 0)
+            return 0;
+        if (o == 0 || st.st_mtim.tv_sec < oldest_out.tv_sec ||
+            (st.st_mtim.tv_sec == oldest_out.tv_sec && st.st_mtim.tv_nsec < oldest_out.tv_nsec))
+            oldest_out = st.st_mtim;
+    }
+    for (int f = 0; f < node->num_in; f++)
+    {
+        if (stat(node->in[f], &st) < 0)
+            return 0;
+        if (st.st_mtim.tv_sec > oldest_out.tv_sec ||
+            (st.st_mtim.tv_sec == oldest_out.tv_sec && st.st_mtim.tv_nsec >= oldest_out.tv_nsec))
+            return 0;
+    }
+    return 1;
+}
 
-    // ignore job control signals
-    signal(SIGINT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGQUIT, SIG_IGN);
-    signal(SIGCHLD, sigchld_handler);
-    // signal(SIGCHLD, SIG_IGN);
+/// @brief Name of a node for the report
+/// @param node the node
+/// @return label or command
+char *dag_name(dag_node *node)
+{
+    return node->label ? node->label : node->cmd;
+}
 
-    // Put ourselves in our own process group
-    shell_pgid = getpid();
-    if (getpid() != getsid(0))
+/// @brief Compute the longest chain of run time ending in a node (memoized, path < 0 means not computed)
+/// @param nodes the nodes
+/// @param i index of the node
+/// @return run time of the chain in seconds
+double dag_path(dag_node *nodes, int i)
+{
+    dag_node *node = &nodes[i];
+
+    if (node->path >= 0)
+        return node->path;
+    // guards against cycles among nodes that never ran
+    node->path = 0;
+
+    double longest = 0;
+    for (int d = 0; d < node->num_deps; d++)
     {
-        if (setpgid(shell_pgid, shell_pgid) < 0)
+        double p = dag_path(nodes, node->deps[d]);
+        if (p > longest || node->path_prev < 0)
         {
-            perror("Couldn't put the shell in its own process group");
-            exit(1);
+            longest = p;
+            node->path_prev = node->deps[d];
         }
     }
+    double duration = (node->state == DAG_DONE || node->state == DAG_FAILED) ? node->end - node->start : 0;
+    node->path = longest + duration;
+    return node->path;
+}
 
-    // Grab control of the terminal
-    tcsetpgrp(shell_terminal, shell_pgid);
-    // Save default terminal attributes for shell.
-    tcgetattr(shell_terminal, &shell_tmodes);
-
-    printf("%s\n", batch_file);
+/// @brief Print run statistics and the critical path (the longest chain of run time)
+/// @param nodes the nodes
+/// @param n number of nodes
+/// @param wall wall clock time of the whole run
+void dag_report(dag_node *nodes, int n, double wall)
+{
+    int count[DAG_BLOCKED + 1] = {0};
+    double work = 0;
+    int last = -1;
 
-    // open file and iterate line by line
-    FILE *file = fopen(batch_file, "r");
+    for (int i = 0; i < n; i++)
+        nodes[i].path = -1;
+    for (int i = 0; i < n; i++)
+    {
+        dag_node *node = &nodes[i];
+        count[node->state] += 1;
+        if (node->state == DAG_DONE || node->state == DAG_FAILED)
+            work += node->end - node->start;
+        if (last < 0 || dag_path(nodes, i) > nodes[last].path)
+            last = i;
+    }
 
-    char inner_line[256];
-    char inner_cmd[256];
-    while (fgets(inner_line, sizeof(inner_line), file))
+    fprintf(stderr, "dag: %d nodes, %d ran, %d skipped, %d failed, %d blocked, wall %.3fs, work %.3fs\n",
+            n, count[DAG_DONE] + count[DAG_FAILED], count[DAG_SKIPPED], count[DAG_FAILED], count[DAG_BLOCKED],
+            wall, work);
+    if (last < 0)
+        return;
+
+    int chain[n], len = 0;
+    for (int v = last; v >= 0 && len < n; v = nodes[v].path_prev)
+        chain[len++] = v;
+    fprintf(stderr, "dag: critical path %.3fs:", nodes[last].path);
+    for (int c = len - 1; c >= 0; c--)
     {
-        strcpy(inner_cmd, inner_line);
-        // remove newline
-        if (inner_cmd[strlen(inner_cmd) - 1] == '\n')
-        {
-            inner_cmd[strlen(inner_cmd) - 1] = '\0';
-        }
+        dag_node *node = &nodes[chain[c]];
+        int ran = node->state == DAG_DONE || node->state == DAG_FAILED;
+        fprintf(stderr, "%s %s (%.3fs)", c == len - 1 ? "" : " ->", dag_name(node),
+                ran ? node->end - node->start : 0.0);
+    }
+    fprintf(stderr, "\n");
+}
+
+/// @brief Return true if a node runs in the shell itself: a barrier line or a line headed by a builtin
+/// (prefixes on their own set the shell defaults either way, before a command they make a job)
+/// @param node the node
+/// @return in shell indicator
+int dag_in_shell(dag_node *node)
+{
+    if (node->label == NULL)
+        return 1;
 
-        int num_pipes = 0;
-        int bg = 0;
+    char *cmd = node->cmd + strspn(node->cmd, " ");
+    size_t len = strcspn(cmd, " ");
+    if (len == 1 && cmd[0] == ':')
+        return 1;
+    for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+    {
+        const char *name = builtin_names[i];
+        if (strlen(name) == len && strncmp(name, cmd, len) == 0)
+            return strcmp(name, "nice") != 0 && strcmp(name, "taskset") != 0 && strcmp(name, "timeout") != 0 &&
+                   strcmp(name, "ulimit") != 0;
+    }
+    return 0;
+}
 
-        // parse command
-        char tmp_cmd[256];
-        strcpy(tmp_cmd, inner_cmd);
-        int cmd_argc = 0;
+/// @brief Run the nodes of a dependency graph, ready nodes concurrently up to dag_max_jobs
+/// @param nodes the nodes
+/// @param n number of nodes
+/// @return 1 if a node failed or was blocked, 0 otherwise
+int dag_run(dag_node *nodes, int n)
+{
+    struct pollfd fds[1 + 256];
+    double t0 = now_seconds();
+    int remaining = n, running = 0;
 
-        char *cmd_seg = strtok(tmp_cmd, " ");
-        while (cmd_seg != NULL)
+    while (remaining > 0)
+    {
+        // collect finished nodes
+        for (int i = 0; i < n; i++)
         {
-            cmd_argc += 1;
-            cmd_seg = strtok(NULL, " ");
+            dag_node *node = &nodes[i];
+            if (node->state != DAG_RUNNING || node->j->queued || !job_is_completed(node->j))
+                continue;
+            node->end = now_seconds() - t0;
+            node->status = job_exit_status(node->j);
+            node->j->owed = 0;
+            node->state = node->status == 0 ? DAG_DONE : DAG_FAILED;
+            if (node->state == DAG_FAILED)
+                fprintf(stderr, "wsh: dag: %s failed with status %d\n", dag_name(node), node->status);
+            running -= 1;
+            remaining -= 1;
         }
-        // add room for NULL termination
-        cmd_argc += 1;
 
-        strcpy(tmp_cmd, inner_cmd);
-        char *cmd_argv[cmd_argc];
-        cmd_seg = strtok(tmp_cmd, " ");
-        for (int i = 0; i < cmd_argc; i++)
+        // start or settle ready nodes
+        int progress = 0;
+        for (int i = 0; i < n; i++)
         {
-            if (i != cmd_argc - 1 && strcmp(cmd_seg, "|") == 0)
+            dag_node *node = &nodes[i];
+            if (node->state != DAG_PENDING)
+                continue;
+
+            int ready = 1, blocked = 0;
+            for (int d = 0; d < node->num_deps; d++)
             {
-                num_pipes += 1;
+                int st = nodes[node->deps[d]].state;
+                if (st == DAG_FAILED || st == DAG_BLOCKED)
+                    blocked = 1;
+                else if (st != DAG_DONE && st != DAG_SKIPPED)
+                    ready = 0;
             }
-            else if (i != cmd_argc - 1 && strcmp(cmd_seg, "&") == 0)
+            node->start = node->end = now_seconds() - t0;
+            if (blocked)
             {
-                bg = 1;
+                node->state = DAG_BLOCKED;
+                remaining -= 1;
+                progress = 1;
             }
-            cmd_argv[i] = cmd_seg;
-            cmd_seg = strtok(NULL, " ");
-        }
-        // NULL terminate
-        cmd_argv[cmd_argc] = NULL;
-
-        // handle each command whatever it is -- see runi comments
-        if (cmd_argc - 1 > 0)
-        {
-            if (num_pipes > 0)
+            else if (ready && dag_up_to_date(node))
+            {
+                node->state = DAG_SKIPPED;
+                remaining -= 1;
+                progress = 1;
+            }
+            else if (ready && dag_in_shell(node))
+            {
+                // barriers and builtins run in the foreground, so cd or sched apply to what follows
+                last_status = 0;
+                eval_line(node->cmd, 0);
+                node->end = now_seconds() - t0;
+                node->status = last_status;
+                node->state = node->status == 0 ? DAG_DONE : DAG_FAILED;
+                if (node->state == DAG_FAILED)
+                    fprintf(stderr, "wsh: dag: %s failed with status %d\n", dag_name(node), node->status);
+                remaining -= 1;
+                progress = 1;
+            }
+            else if (ready && running < dag_max_jobs)
             {
-                if (bg)
+                node->j = eval_line(node->cmd, 1);
+                if (node->j == NULL)
                 {
-                    cmd_argv[cmd_argc - 2] = NULL;
-                    cmd_argc -= 1;
-
-                    int tmp_argc = cmd_argc - 2;
-                    int num_itr = 0;
+                    // prefixes on their own and empty lines finish immediately
+                    node->state = DAG_DONE;
+                    remaining -= 1;
+                }
+                else
+                {
+                    node->j->owed = 1;
+                    node->state = DAG_RUNNING;
+                    running += 1;
+                }
+                progress = 1;
+            }
+        }
+        if (progress)
+            continue;
+        if (running == 0 && remaining > 0)
+        {
+            fprintf(stderr, "wsh: dag: dependency cycle, %d nodes cannot run\n", remaining);
+            for (int i = 0; i < n; i++)
+                if (nodes[i].state == DAG_PENDING)
+                    nodes[i].state = DAG_BLOCKED;
+            break;
+        }
+        if (remaining == 0)
+            break;
 
-                    process *prev_p = (struct process *)malloc(sizeof(struct process));
-                    process *first_p = (struct process *)malloc(sizeof(struct process));
+        sched_dispatch();
+        int nfds = job_wait_fds(fds, -1);
+        if (poll(fds, nfds, sched_queue_len() > 0 ? 200 : -1) > 0 && (fds[0].revents & POLLIN))
+            drain_sigchld_pipe();
+    }
 
-                    while (num_itr != num_pipes + 1)
-                    {
-                        char *tmp_argv[256];
-                        int idx = 0;
-                        for (int i = tmp_argc; i >= 0; i--)
-                        {
-                            tmp_argc -= 1;
-                            if (strcmp(cmd_argv[i], "|") == 0)
-                            {
-                                break;
-                            }
+    dag_report(nodes, n, now_seconds() - t0);
+    for (int i = 0; i < n; i++)
+        if (nodes[i].state == DAG_FAILED || nodes[i].state == DAG_BLOCKED)
+            return 1;
+    return 0;
+}
 
-                            tmp_argv[idx] = cmd_argv[i];
-                            idx += 1;
-                        }
+/// @brief batch mode runner for dependency graph batch files
+/// @param batch_file the file of batch commands
+/// @return exit code
+int rund(char *batch_file)
+{
+    init_shell();
 
-                        int tmp_argc_2 = reverse_array(tmp_argv, idx);
+    printf("%s\n", batch_file);
 
-                        if (num_itr == 0)
-                        {
-                            populate_process_struct(prev_p, tmp_argv[0], NULL, tmp_argc_2, tmp_argv, 1);
-                        }
-                        else
-                        {
-                            process *p = (struct process *)malloc(sizeof(struct process));
-                            if (num_itr == num_pipes)
-                            {
-                                populate_process_struct(first_p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                            }
-                            else
-                            {
-                                populate_process_struct(p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                                prev_p = p;
-                            }
-                        }
+    FILE *file = fopen(batch_file, "r");
+    if (file == NULL)
+    {
+        perror(batch_file);
+        return 1;
+    }
 
-                        num_itr += 1;
-                    }
-                    job *j = (struct job *)malloc(sizeof(struct job));
+    dag_node *nodes = NULL;
+    int n = 0;
+    // in= and out= lists make long lines, so they are read whole
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, file) >= 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[strspn(line, " ")] == '\0' || line[0] == '#')
+            continue;
+        nodes = realloc(nodes, sizeof(dag_node) * (n + 1));
+        if (dag_parse_line(line, &nodes[n]) < 0)
+        {
+            fprintf(stderr, "wsh: dag: malformed line: %s\n", line);
+            free(line);
+            fclose(file);
+            return 1;
+        }
+        n += 1;
+    }
+    free(line);
+    fclose(file);
 
-                    populate_job_struct(j, first_p, 0, 1);
+    if (dag_link(nodes, n) < 0)
+        return 1;
+    if (dag_max_jobs <= 0)
+        dag_max_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
-                    jobs[curr_id] = j;
-                    curr_id = curr_id + 1;
+    int failed = dag_run(nodes, n);
+    mux_drain();
+    return failed;
+}
 
-                    run_job(j, 0);
-                }
-                else
-                {
-                    int tmp_argc = cmd_argc - 2;
-                    int num_itr = 0;
+/*
+ * CONTROL SERVER
+ */
 
-                    process *prev_p = (struct process *)malloc(sizeof(struct process));
-                    process *first_p = (struct process *)malloc(sizeof(struct process));
+// a client connected to the control socket
+typedef struct client
+{
+    int fd;         /* connected socket */
+    char in[512];   /* partial request line */
+    size_t in_len;  /* bytes in in */
+    char *out;      /* replies not written yet */
+    size_t out_len; /* bytes in out */
+    size_t out_cap; /* allocated size of out */
+} client;
+
+// a job submitted over the control socket and the client waiting for its status
+typedef struct request
+{
+    job *j;      /* the job, NULL if the slot is free */
+    client *c;   /* the client to report to, NULL once it disconnected */
+    int started; /* client was told the job is running */
+} request;
 
-                    while (num_itr != num_pipes + 1)
-                    {
-                        char *tmp_argv[256];
-                        int idx = 0;
-                        for (int i = tmp_argc; i >= 0; i--)
-                        {
-                            tmp_argc -= 1;
-                            if (strcmp(cmd_argv[i], "|") == 0)
-                            {
-                                break;
-                            }
+request requests[256];
+int serve_epfd = -1;
 
-                            tmp_argv[idx] = cmd_argv[i];
-                            idx += 1;
-                        }
+/// @brief Write as much of a client's pending replies as the socket takes, watch for EPOLLOUT otherwise
+/// @param c client struct pointer
+void client_flush(client *c)
+{
+    size_t done = 0;
+    while (done < c->out_len)
+    {
+        ssize_t n = write(c->fd, c->out + done, c->out_len - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    memmove(c->out, c->out + done, c->out_len - done);
+    c->out_len -= done;
 
-                        int tmp_argc_2 = reverse_array(tmp_argv, idx);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(serve_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-                        if (num_itr == 0)
-                        {
-                            populate_process_struct(prev_p, tmp_argv[0], NULL, tmp_argc_2, tmp_argv, 1);
-                        }
-                        else
-                        {
-                            process *p = (struct process *)malloc(sizeof(struct process));
-                            if (num_itr == num_pipes)
-                            {
-                                populate_process_struct(first_p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                            }
-                            else
-                            {
-                                populate_process_struct(p, tmp_argv[0], prev_p, tmp_argc_2, tmp_argv, 1);
-                                prev_p = p;
-                            }
-                        }
+/// @brief Queue a reply line for a client
+/// @param c client struct pointer
+/// @param fmt printf format of the line (without newline)
+void client_send(client *c, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (n > (int)sizeof(line) - 2)
+        n = sizeof(line) - 2;
+    line[n++] = '\n';
+
+    if (c->out_len + n > c->out_cap)
+    {
+        c->out_cap = (c->out_len + n) * 2;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, line, n);
+    c->out_len += n;
+    client_flush(c);
+}
 
-                        num_itr += 1;
-                    }
-                    job *j = (struct job *)malloc(sizeof(struct job));
+/// @brief Disconnect a client; its jobs keep running
+/// @param c client struct pointer
+void client_close(client *c)
+{
+    for (int i = 0; i < 256; i++)
+        if (requests[i].j != NULL && requests[i].c == c)
+            requests[i].c = NULL;
+    epoll_ctl(serve_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
 
-                    populate_job_struct(j, first_p, 1, 1);
+/// @brief Describe the state of a job for the protocol
+/// @param j job struct pointer
+/// @return queued, running, stopped or done
+char *job_state(job *j)
+{
+    if (j->queued)
+        return "queued";
+    if (j->dead || job_is_completed(j))
+        return "done";
+    if (job_is_stopped(j))
+        return "stopped";
+    return "running";
+}
 
-                    jobs[curr_id] = j;
-                    curr_id = curr_id + 1;
+/// @brief Handle one request line from a client
+/// run CMD | status ID | jobs | quit
+/// @param c client struct pointer
+/// @param line the request line
+/// @return false if the client has to be disconnected
+int serve_command(client *c, char *line)
+{
+    if (strncmp(line, "run ", 4) == 0)
+    {
+        int slot;
+        for (slot = 0; slot < 256; slot++)
+            if (requests[slot].j == NULL)
+                break;
+        if (slot == 256)
+        {
+            client_send(c, "error too many jobs");
+            return 1;
+        }
 
-                    run_job(j, 1);
-                }
-            }
-            else
+        // reuse the interactive parser and spawn path, but never touch the terminal
+        job *j = eval_line(line + 4, 1);
+        if (j == NULL)
+        {
+            client_send(c, "error cannot run: %s", line + 4);
+            return 1;
+        }
+        requests[slot].j = j;
+        requests[slot].c = c;
+        j->owed = 1;
+        requests[slot].started = !j->queued;
+        client_send(c, "job %d %s", j->job_id, j->queued ? "queued" : "running");
+    }
+    else if (strncmp(line, "status ", 7) == 0)
+    {
+        int id = atoi(line + 7);
+        for (int i = 0; i < 256; i++)
+        {
+            if (jobs[i] != NULL && jobs[i]->dead == 0 && jobs[i]->foreground == 0 && jobs[i]->job_id == id)
             {
-                if (bg)
-                {
-                    cmd_argv[cmd_argc - 2] = NULL;
-                    cmd_argc -= 1;
+                client_send(c, "job %d %s", id, job_state(jobs[i]));
+                return 1;
+            }
+        }
+        client_send(c, "error no job %d", id);
+    }
+    else if (strcmp(line, "jobs") == 0)
+    {
+        for (int i = 0; i < 256; i++)
+            if (jobs[i] != NULL && jobs[i]->dead == 0 && jobs[i]->foreground == 0)
+                client_send(c, "job %d %s %s", jobs[i]->job_id, job_state(jobs[i]),
+                            jobs[i]->command ? jobs[i]->command : "");
+        client_send(c, "ok");
+    }
+    else if (strcmp(line, "quit") == 0)
+    {
+        client_send(c, "ok");
+        return 0;
+    }
+    else if (line[0] != '\0')
+    {
+        client_send(c, "error unknown request");
+    }
+    return 1;
+}
+
+/// @brief Tell clients about jobs that left the queue or finished
+void serve_update()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        request *r = &requests[i];
+        if (r->j == NULL)
+            continue;
+        if (!r->started && !r->j->queued)
+        {
+            r->started = 1;
+            if (r->c)
+                client_send(r->c, "job %d running", r->j->job_id);
+        }
+        if (!r->j->queued && job_is_completed(r->j))
+        {
+            if (r->c)
+                client_send(r->c, "exit %d %d", r->j->job_id, job_exit_status(r->j));
+            r->j->owed = 0;
+            r->j = NULL;
+            r->c = NULL;
+        }
+    }
+}
+
+/// @brief Read from a client and run every complete request line
+/// @param c client struct pointer
+/// @return false if the client has to be disconnected
+int client_read(client *c)
+{
+    while (true)
+    {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+        if (n == 0)
+            return 0;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->in_len += n;
 
-                    process *p = (struct process *)malloc(sizeof(struct process));
-                    job *j = (struct job *)malloc(sizeof(struct job));
+        char *start = c->in, *nl;
+        while ((nl = memchr(start, '\n', c->in + c->in_len - start)) != NULL)
+        {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            // eval_line takes a line of any length; only the in buffer bounds a request
+            if (!serve_command(c, start))
+                return 0;
+            start = nl + 1;
+        }
+        c->in_len -= start - c->in;
+        memmove(c->in, start, c->in_len);
+        if (c->in_len == sizeof(c->in) - 1)
+        {
+            client_send(c, "error line too long");
+            return 0;
+        }
+    }
+}
 
-                    populate_process_struct(p, cmd_argv[0], NULL, cmd_argc, cmd_argv, 0);
-                    populate_job_struct(j, p, 0, 0);
-                    // populate_job_struct(j, p, 0, getpgid(getpid()));
+/// @brief control server mode: accept command lines and job queries on a unix domain socket
+/// @param socket_path path of the socket to create
+/// @return exit code
+int runs(char *socket_path)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[64];
 
-                    jobs[curr_id] = j;
-                    curr_id += 1;
+    // jobs never get the terminal and must not read the server's stdin
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0)
+    {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    init_sigchld_pipe();
+    signal(SIGCHLD, sigchld_handler);
 
-                    run_job(j, 0);
-                }
-                else
-                {
-                    // exit
-                    if (strcmp(cmd_argv[0], "exit") == 0)
-                    {
-                        wsh_exit();
-                    }
-                    // cd
-                    else if (strcmp(cmd_argv[0], "cd") == 0)
-                    {
-                        wsh_cd(cmd_argc, cmd_argv);
-                    }
-                    // jobs
-                    else if (strcmp(cmd_argv[0], "jobs") == 0)
-                    {
-                        wsh_jobs();
-                    }
-                    // fg
-                    else if (strcmp(cmd_argv[0], "fg") == 0)
-                    {
-                        wsh_fg(cmd_argc, cmd_argv);
-                    }
-                    // bg
-                    else if (strcmp(cmd_argv[0], "bg") == 0)
-                    {
-                        wsh_bg(cmd_argc, cmd_argv);
-                    }
-                    // run fg child process/job
-                    else
-                    {
-                        // run process in a job in the foreground
-                        process *p = (struct process *)malloc(sizeof(struct process));
-                        job *j = (struct job *)malloc(sizeof(struct job));
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "wsh: cannot create socket %s\n", socket_path);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
 
-                        populate_process_struct(p, cmd_argv[0], NULL, cmd_argc, cmd_argv, 0);
-                        populate_job_struct(j, p, 1, 0);
+    serve_epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(serve_epfd, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.ptr = sigchld_pipe;
+    epoll_ctl(serve_epfd, EPOLL_CTL_ADD, sigchld_pipe[0], &ev);
 
-                        jobs[curr_id] = j;
-                        curr_id = curr_id + 1;
+    while (true)
+    {
+        sched_dispatch();
+        serve_update();
 
-                        run_job(j, 1);
-                    }
+        // tick while jobs are queued or under a deadline
+        int tick = (sched_queue_len() > 0 || job_wait_fds(NULL, -1) > 1) ? 100 : -1;
+        int n = epoll_wait(serve_epfd, events, 64, tick);
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                int cfd;
+                while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    client *c = calloc(1, sizeof(client));
+                    c->fd = cfd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(serve_epfd, EPOLL_CTL_ADD, cfd, &ev);
                 }
             }
+            else if (events[i].data.ptr == sigchld_pipe)
+            {
+                drain_sigchld_pipe();
+            }
+            else
+            {
+                client *c = events[i].data.ptr;
+                int keep = 1;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    keep = client_read(c);
+                if (keep && (events[i].events & EPOLLOUT))
+                    client_flush(c);
+                if (!keep)
+                    client_close(c);
+            }
         }
     }
-    fclose(file);
     return 0;
 }
 
 /////
 
+/// @brief print usage and exit
+void usage()
+{
+    printf("Usage: ./wsh [--line-timeout DURATION] [--mux] [--dag [--jobs N]] [--profile JSON_FILE] "
+           "[--journal FILE] [--resume] [--record FILE] [--serve SOCKET | batch_file]\n");
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 1 || argc > 2)
+    static struct option long_options[] = {
+        {"line-timeout", required_argument, NULL, 't'},
+        {"serve", required_argument, NULL, 'S'},
+        {"mux", no_argument, NULL, 'm'},
+        {"dag", no_argument, NULL, 'D'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"profile", required_argument, NULL, 'P'},
+        {"journal", required_argument, NULL, 'J'},
+        {"resume", no_argument, NULL, 'R'},
+        {"record", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    char *serve_socket = NULL;
+    char *record_path = NULL;
+
+    // SIGTERM gets a grace period before SIGKILL
+    shell_attrs.kill_after_ms = 5000;
+
+    while ((opt = getopt_long(argc, argv, "+t:mj:", long_options, NULL)) != -1)
     {
-        printf("Usage: ./wsh [batch_file]\n");
-        exit(1);
+        switch (opt)
+        {
+        case 't':
+            // every line of the run gets this deadline unless it says otherwise
+            if (parse_duration_ms(optarg, &shell_attrs.timeout_ms) < 0)
+                usage();
+            break;
+        case 'S':
+            serve_socket = optarg;
+            break;
+        case 'm':
+            // prefix and line-batch the output of background jobs
+            mux_start();
+            break;
+        case 'D':
+            // run the batch file as a dependency graph
+            dag_mode = 1;
+            break;
+        case 'j':
+            dag_max_jobs = atoi(optarg);
+            break;
+        case 'P':
+            // time every batch line, report at exit and write the numbers as JSON to this file
+            profile_path = optarg;
+            break;
+        case 'J':
+            // record every finished batch line durably in this file
+            journal_path = optarg;
+            break;
+        case 'R':
+            // skip the lines the journal has as finished
+            journal_resume = 1;
+            break;
+        case 'r':
+            // log every command line with its timing and status, for wshreplay
+            record_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 1 || argc > 2 || (serve_socket && argc != 1) || (dag_mode && argc != 2) ||
+        (profile_path && (argc != 2 || dag_mode)) || ((journal_path || journal_resume) && (argc != 2 || dag_mode)))
+    {
+        usage();
     }
 
+    // --resume alone keeps the journal next to the batch file
+    char default_journal[4096];
+    if (journal_resume && !journal_path)
+    {
+        snprintf(default_journal, sizeof(default_journal), "%s.journal", argv[1]);
+        journal_path = default_journal;
+    }
+
+    if (record_path && (serve_socket || dag_mode))
+        usage();
+    if (record_path && record_open(record_path) < 0)
+        return 1;
+
+    // publish the job table for monitoring tools
+    board_open();
+
+    // control server mode
+    if (serve_socket)
+    {
+        runs(serve_socket);
+    }
     // interactive mode
-    if (argc == 1)
+    else if (argc == 1)
     {
         runi();
     }
+    // dependency graph batch mode
+    else if (dag_mode)
+    {
+        return rund(argv[1]);
+    }
     // batch mode
     else if (argc == 2)
     {
         char *file_name = argv[1];
-        runb(file_name);
+        return runb(file_name);
     }
 
     return 0;
@@ -1 +1,76 @@
 //
+#ifndef WSH_H
+#define WSH_H
+
+#include <stdint.h>
+
+/*
+ * JOB BOARD
+ *
+ * With WSH_BOARD set, the shell publishes its job table in a file under /dev/shm that
+ * monitoring tools map read-only (see wshmon.c). The shell is the only writer: it makes seq
+ * odd, updates the board and makes seq even again. A reader copies the board and keeps the
+ * copy only if seq was even and unchanged around the copy. Every field has a fixed size and
+ * offset, so 32-bit and 64-bit builds agree on the layout.
+ */
+
+#define WSH_BOARD_MAGIC "WSHB"
+#define WSH_BOARD_VERSION 1
+#define WSH_BOARD_JOBS 256 /* one slot per job table entry */
+#define WSH_BOARD_PROCS 16 /* processes kept per job, longer pipelines only publish the first ones */
+
+enum wsh_board_state
+{
+    WSH_BOARD_FREE,    /* slot not used */
+    WSH_BOARD_QUEUED,  /* waiting for admission */
+    WSH_BOARD_RUNNING, /* started and not done */
+    WSH_BOARD_STOPPED, /* every live process is stopped */
+    WSH_BOARD_DONE     /* exited or killed, status is valid */
+};
+
+// one process of a job
+typedef struct wsh_board_proc
+{
+    int32_t pid;    /* 0 until forked */
+    int32_t status; /* wait status once done */
+    uint8_t state;  /* wsh_board_state */
+    uint8_t pad[7];
+} wsh_board_proc;
+
+// one job table slot
+typedef struct wsh_board_job
+{
+    int32_t job_id;      /* 0 if the slot is free */
+    int32_t pgid;        /* process group */
+    uint8_t state;       /* wsh_board_state */
+    uint8_t foreground;  /* foreground job indicator */
+    uint16_t num_procs;  /* processes in the job, may be more than WSH_BOARD_PROCS */
+    int32_t exit_status; /* shell exit status once done, -1 before */
+    int64_t start_ns;    /* CLOCK_REALTIME when the job was started, 0 while queued */
+    int64_t end_ns;      /* CLOCK_REALTIME when the shell saw it done, 0 before */
+    char command[128];   /* command line, truncated */
+    wsh_board_proc procs[WSH_BOARD_PROCS];
+} wsh_board_job;
+
+// the whole board, as mapped from the file
+typedef struct wsh_board
+{
+    char magic[4];          /* WSH_BOARD_MAGIC */
+    uint32_t version;       /* WSH_BOARD_VERSION */
+    uint32_t seq;           /* seqlock sequence, odd while the shell writes */
+    int32_t shell_pid;      /* the publishing shell */
+    int64_t start_ns;       /* CLOCK_REALTIME when the shell started */
+    int64_t updated_ns;     /* CLOCK_REALTIME of the last update */
+    uint64_t jobs_started;  /* jobs handed to run_job */
+    uint64_t spawns;        /* processes forked */
+    uint64_t reaps;         /* processes reaped */
+    uint32_t num_jobs;      /* WSH_BOARD_JOBS */
+    uint32_t procs_per_job; /* WSH_BOARD_PROCS */
+    wsh_board_job jobs[WSH_BOARD_JOBS];
+} wsh_board;
+
+_Static_assert(sizeof(wsh_board_proc) == 16, "board process layout");
+_Static_assert(sizeof(wsh_board_job) == 32 + 128 + 16 * WSH_BOARD_PROCS, "board job layout");
+_Static_assert(sizeof(wsh_board) == 64 + sizeof(wsh_board_job) * WSH_BOARD_JOBS, "board layout");
+
+#endif
@@ -0,0 +1,192 @@
+// Reader for the job board a wsh publishes with WSH_BOARD set
+#include "wsh.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/// @brief Copy a consistent snapshot of the board: seq must be even and unchanged around the copy
+/// @param shared the mapped board
+/// @param copy where to store the snapshot
+/// @return number of retries, or -1 if the shell kept writing
+int board_snapshot(const wsh_board *shared, wsh_board *copy)
+{
+    for (int tries = 0; tries < 10000; tries++)
+    {
+        uint32_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, shared, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq)
+            return tries;
+    }
+    return -1;
+}
+
+/// @brief Name a board state
+/// @param state wsh_board_state
+/// @return its name
+const char *state_name(int state)
+{
+    static const char *names[] = {"free", "queued", "running", "stopped", "done"};
+    return state >= 0 && state <= WSH_BOARD_DONE ? names[state] : "?";
+}
+
+/// @brief Format a duration in nanoseconds as h:mm:ss.t
+/// @param out where to store it (at least 32 bytes)
+/// @param ns the duration
+void format_duration(char *out, int64_t ns)
+{
+    int64_t ds = ns > 0 ? ns / 100000000 : 0;
+    snprintf(out, 32, "%lld:%02lld:%02lld.%lld", (long long)(ds / 36000), (long long)(ds / 600 % 60),
+             (long long)(ds / 10 % 60), (long long)(ds % 10));
+}
+
+/// @brief Describe a wait status
+/// @param out where to store it (at least 32 bytes)
+/// @param status the wait status
+void format_status(char *out, int status)
+{
+    if (WIFEXITED(status))
+        snprintf(out, 32, "exit %d", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        snprintf(out, 32, "signal %d", WTERMSIG(status));
+    else
+        snprintf(out, 32, "-");
+}
+
+/// @brief Print one snapshot of the board
+/// @param b the snapshot
+/// @param retries how many copies were thrown away
+void print_board(const wsh_board *b, int retries)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    char up[32], age[32];
+    format_duration(up, now - b->start_ns);
+    format_duration(age, now - b->updated_ns);
+
+    printf("wsh %d: up %s, updated %s ago, %llu jobs started, %llu spawns, %llu reaps (seq %u, %d retries)\n",
+           b->shell_pid, up, age, (unsigned long long)b->jobs_started, (unsigned long long)b->spawns,
+           (unsigned long long)b->reaps, b->seq, retries);
+    printf("%6s %8s %-8s %-10s %12s  %s\n", "JOB", "PID", "STATE", "STATUS", "ELAPSED", "COMMAND");
+    for (uint32_t i = 0; i < b->num_jobs && i < WSH_BOARD_JOBS; i++)
+    {
+        const wsh_board_job *j = &b->jobs[i];
+        if (j->job_id == 0)
+            continue;
+
+        char id[16], status[32], elapsed[32];
+        snprintf(id, sizeof(id), "[%d]", j->job_id);
+        if (j->exit_status >= 0)
+            snprintf(status, sizeof(status), "%d", j->exit_status);
+        else
+            snprintf(status, sizeof(status), "-");
+        format_duration(elapsed, j->start_ns == 0 ? 0 : (j->end_ns ? j->end_ns : now) - j->start_ns);
+        printf("%6s %8d %-8s %-10s %12s  %s%s\n", id, j->pgid, state_name(j->state), status, elapsed, j->command,
+               j->foreground ? " (foreground)" : "");
+        for (int p = 0; p < j->num_procs && p < WSH_BOARD_PROCS; p++)
+        {
+            const wsh_board_proc *proc = &j->procs[p];
+            if (proc->state == WSH_BOARD_DONE)
+                format_status(status, proc->status);
+            else
+                snprintf(status, sizeof(status), "-");
+            printf("%6s %8d %-8s %-10s\n", "", proc->pid, state_name(proc->state), status);
+        }
+        if (j->num_procs > WSH_BOARD_PROCS)
+            printf("%6s %8s (%d more processes)\n", "", "", j->num_procs - WSH_BOARD_PROCS);
+    }
+}
+
+void usage()
+{
+    printf("Usage: ./wshmon [--watch SECONDS] PID|BOARD_FILE\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"watch", required_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0},
+    };
+    double interval = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "w:", long_options, NULL)) != -1)
+    {
+        if (opt != 'w' || (interval = atof(optarg)) <= 0)
+            usage();
+    }
+    if (optind != argc - 1)
+        usage();
+
+    // a pid names the default board of that shell
+    char path[4096];
+    if (strchr(argv[optind], '/'))
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+    else
+        snprintf(path, sizeof(path), "/dev/shm/wsh-%s", argv[optind]);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(wsh_board))
+    {
+        printf("Error: %s is not a job board.\n", path);
+        return 1;
+    }
+    const wsh_board *shared = mmap(NULL, sizeof(wsh_board), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(shared->magic, WSH_BOARD_MAGIC, 4) != 0 || shared->version != WSH_BOARD_VERSION)
+    {
+        printf("Error: %s is not a version %d job board.\n", path, WSH_BOARD_VERSION);
+        return 1;
+    }
+
+    // snapshots only read memory, the shell never waits for a reader
+    wsh_board *copy = malloc(sizeof(wsh_board));
+    while (true)
+    {
+        int retries = board_snapshot(shared, copy);
+        if (retries < 0)
+        {
+            printf("Error: no consistent snapshot, the shell kept writing.\n");
+            return 1;
+        }
+        if (interval > 0)
+            printf("\x1b[H\x1b[2J");
+        print_board(copy, retries);
+        if (interval <= 0)
+            break;
+        fflush(stdout);
+        usleep((useconds_t)(interval * 1e6));
+    }
+    free(copy);
+    return 0;
+}
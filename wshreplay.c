@@ -0,0 +1,451 @@
+// Replays a session recorded with wsh --record against a wsh control server and reports its latency
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// one recorded command line
+typedef struct record
+{
+    double at;      /* seconds since the start of the recording */
+    int bg;         /* background job */
+    int status;     /* recorded exit status, -1 if unfinished */
+    double elapsed; /* recorded seconds until it was done */
+    char *cmd;      /* the command line as sent */
+    double sent;    /* when it was submitted, 0 if skipped */
+    double latency; /* submitted to exit reported, -1 if never reported */
+    int exit;       /* replayed exit status */
+} record;
+
+// builtins that only make sense in the shell that ran them: a control server runs every line as a job
+const char *skipped_builtins[] = {"cd", "exit", "fg", "bg", "wait", "read", "sched", "mux", "cache", "exec",
+                                  "coproc", "pack"};
+
+record *records;
+int num_records;
+int inflight[4096];   /* job id -> record index + 1 */
+int queued_ids[4096]; /* job id is queued, its "running" notice is not a reply */
+int awaiting = -1;    /* record whose run was sent and not answered yet */
+int refused;          /* runs answered with an error */
+
+/// @brief Seconds on the monotonic clock
+/// @return time in seconds
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief Sort records by the time they were started
+int record_cmp(const void *a, const void *b)
+{
+    double d = ((const record *)a)->at - ((const record *)b)->at;
+    return d < 0 ? -1 : d > 0;
+}
+
+/// @brief Sort latencies
+int double_cmp(const void *a, const void *b)
+{
+    double d = *(const double *)a - *(const double *)b;
+    return d < 0 ? -1 : d > 0;
+}
+
+/// @brief Load a record file
+/// @param path the file
+/// @return 0 on success, -1 on error
+int load_records(char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int cap_records = 0;
+    while (getline(&line, &cap, f) > 0)
+    {
+        record r = {0};
+        char mode[8];
+        int n = 0;
+        if (line[0] == '#' || sscanf(line, "%lf\t%7[a-z]\t%d\t%lf\t%n", &r.at, mode, &r.status, &r.elapsed, &n) != 4 ||
+            n == 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        r.bg = strcmp(mode, "bg") == 0;
+        r.cmd = strdup(line + n);
+        r.latency = -1;
+        if (num_records == cap_records)
+        {
+            cap_records = cap_records ? cap_records * 2 : 1024;
+            records = realloc(records, cap_records * sizeof(record));
+        }
+        records[num_records++] = r;
+    }
+    free(line);
+    fclose(f);
+    qsort(records, num_records, sizeof(record), record_cmp);
+    return 0;
+}
+
+/// @brief Count the words of the per-job prefixes (nice, taskset, timeout, ulimit) a line starts with
+/// @param words the words of the line
+/// @param n number of words
+/// @return index of the command word, n if the line is made only of prefixes
+int prefix_words(char **words, int n)
+{
+    int i = 0;
+
+    while (i < n)
+    {
+        if (strcmp(words[i], "nice") == 0)
+        {
+            i += 1;
+            if (i < n && strcmp(words[i], "-n") == 0)
+                i += 2;
+            else if (i < n && words[i][words[i][0] == '-'] != '\0' &&
+                     words[i][strspn(words[i] + (words[i][0] == '-'), "0123456789") + (words[i][0] == '-')] == '\0')
+                i += 1;
+        }
+        else if (strcmp(words[i], "taskset") == 0)
+        {
+            i += 1;
+            if (i < n && strcmp(words[i], "-c") == 0)
+                i += 1;
+            i += 1;
+        }
+        else if (strcmp(words[i], "timeout") == 0)
+        {
+            i += 1;
+            if (i < n && (strcmp(words[i], "-k") == 0 || strcmp(words[i], "--kill-after") == 0))
+                i += 2;
+            i += 1;
+        }
+        else if (strcmp(words[i], "ulimit") == 0)
+        {
+            i += 1;
+            while (i < n && words[i][0] == '-' && strlen(words[i]) == 2)
+                i += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return i < n ? i : n;
+}
+
+/// @brief Make the command line that is sent for a record
+/// @param r the record
+/// @param stand_in 0 = as recorded, 1 = a sleep of the recorded duration when the command is not on PATH, 2 = always
+/// @param out where to store the line
+/// @param size size of out
+/// @return false if the line is skipped
+bool replay_line(record *r, int stand_in, char *out, size_t size)
+{
+    // prefixes on their own set the server's defaults, before a command they go with the job
+    size_t cmd_len = strlen(r->cmd);
+    char copy[cmd_len + 1];
+    char *words[cmd_len / 2 + 1];
+    int n = 0;
+    memcpy(copy, r->cmd, cmd_len + 1);
+    for (char *w = strtok(copy, " "); w; w = strtok(NULL, " "))
+        words[n++] = w;
+    int skip = prefix_words(words, n);
+    if (skip == n)
+        return false;
+    char *first = words[skip];
+    for (size_t i = 0; i < sizeof(skipped_builtins) / sizeof(skipped_builtins[0]); i++)
+        if (strcmp(first, skipped_builtins[i]) == 0)
+            return false;
+
+    // the trailing & is implied, the control server runs every line as a background job
+    snprintf(out, size, "%s", r->cmd);
+    size_t len = strlen(out);
+    while (len > 0 && (out[len - 1] == '&' || out[len - 1] == ' '))
+        out[--len] = '\0';
+
+    bool found = strchr(first, '/') != NULL && access(first, X_OK) == 0;
+    char *path = getenv("PATH");
+    for (char *dir = path ? path : ""; !found && *dir;)
+    {
+        size_t n = strcspn(dir, ":");
+        char candidate[4096];
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)n, dir, first);
+        found = access(candidate, X_OK) == 0;
+        dir += n + (dir[n] == ':');
+    }
+    if (stand_in == 2 || (stand_in == 1 && !found))
+        snprintf(out, size, "sleep %.6f", r->elapsed > 0 ? r->elapsed : 0);
+    return true;
+}
+
+/// @brief Start a control server to replay against
+/// @param wsh path of the wsh binary
+/// @param socket_path where it listens
+/// @return its pid, -1 on error
+pid_t start_server(char *wsh, char *socket_path)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(wsh, wsh, "--serve", socket_path, (char *)NULL);
+        perror(wsh);
+        _exit(127);
+    }
+    return pid;
+}
+
+/// @brief Connect to the control server, waiting for it to listen
+/// @param socket_path the socket
+/// @return connected socket, -1 on error
+int connect_server(char *socket_path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    for (int tries = 0; tries < 500; tries++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    perror(socket_path);
+    return -1;
+}
+
+/// @brief Read reply lines from the server: the answer to the awaited run and exits of finished jobs,
+/// in the order they were sent (a job may exit within the same read as its answer)
+/// @param fd the socket
+/// @param buf partial line buffer
+/// @param len bytes in buf
+/// @return false when the server went away
+bool read_replies(int fd, char *buf, size_t *len)
+{
+    ssize_t n = read(fd, buf + *len, 65536 - *len);
+    if (n <= 0)
+        return n < 0 && errno == EINTR;
+    *len += n;
+
+    char *line = buf, *nl;
+    while ((nl = memchr(line, '\n', buf + *len - line)) != NULL)
+    {
+        *nl = '\0';
+        int id, status;
+        char state[16];
+        if (sscanf(line, "exit %d %d", &id, &status) == 2 && id > 0 && id < 4096 && inflight[id])
+        {
+            record *r = &records[inflight[id] - 1];
+            r->latency = now_seconds() - r->sent;
+            r->exit = status;
+            inflight[id] = 0;
+            queued_ids[id] = 0;
+        }
+        else if (sscanf(line, "job %d %15s", &id, state) == 2 && id > 0 && id < 4096)
+        {
+            // a queued job that got started is a notice, anything else answers the last run
+            if (queued_ids[id] && strcmp(state, "running") == 0)
+                queued_ids[id] = 0;
+            else if (awaiting >= 0)
+            {
+                queued_ids[id] = strcmp(state, "queued") == 0;
+                inflight[id] = awaiting + 1;
+                awaiting = -1;
+            }
+        }
+        else if (strncmp(line, "error", 5) == 0 && awaiting >= 0)
+        {
+            fprintf(stderr, "wshreplay: %s\n", line);
+            records[awaiting].sent = 0;
+            refused++;
+            awaiting = -1;
+        }
+        line = nl + 1;
+    }
+    *len = buf + *len - line;
+    memmove(buf, line, *len);
+    return true;
+}
+
+/// @brief Print a percentile table of latencies
+/// @param name what is measured
+/// @param v the values in seconds
+/// @param n number of values
+void print_percentiles(const char *name, double *v, int n)
+{
+    if (n == 0)
+        return;
+    qsort(v, n, sizeof(double), double_cmp);
+    printf("%-22s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  p99.9 %9.3f ms  max %9.3f ms\n", name,
+           v[n / 2] * 1e3, v[n * 90 / 100] * 1e3, v[n * 99 / 100] * 1e3, v[n * 999 / 1000] * 1e3, v[n - 1] * 1e3);
+}
+
+void usage()
+{
+    printf("Usage: ./wshreplay [--speed N|max] [--stand-in missing|all] [--wsh PATH | --socket SOCKET] RECORD_FILE\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"stand-in", required_argument, NULL, 'i'},
+        {"wsh", required_argument, NULL, 'w'},
+        {"socket", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    double speed = 1;
+    int stand_in = 0, opt;
+    char *wsh = "./wsh", *socket_path = NULL;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            // max: every line as soon as the previous foreground line is done
+            speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+            if (speed < 0 || (speed == 0 && strcmp(optarg, "max") != 0))
+                usage();
+            break;
+        case 'i':
+            if (strcmp(optarg, "missing") == 0)
+                stand_in = 1;
+            else if (strcmp(optarg, "all") == 0)
+                stand_in = 2;
+            else
+                usage();
+            break;
+        case 'w':
+            wsh = optarg;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || load_records(argv[optind]) < 0)
+        usage();
+
+    // without --socket, a private control server is started and stopped again
+    char private_socket[108];
+    pid_t server = -1;
+    if (socket_path == NULL)
+    {
+        snprintf(private_socket, sizeof(private_socket), "/tmp/wshreplay-%d.sock", getpid());
+        socket_path = private_socket;
+        if ((server = start_server(wsh, socket_path)) < 0)
+            return 1;
+    }
+    int fd = connect_server(socket_path);
+    if (fd < 0)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    // foreground lines keep their order: the next line waits for the previous foreground one to exit
+    char *buf = malloc(65536), line[8192];
+    size_t len = 0;
+    int sent = 0, skipped = 0, blocking = -1;
+    bool alive = true;
+    double start = now_seconds(), max_lag = 0;
+    for (int i = 0; i <= num_records; i++)
+    {
+        while (true)
+        {
+            bool blocked = blocking >= 0 && records[blocking].latency < 0;
+            double wait = i < num_records && speed > 0 ? start + records[i].at / speed - now_seconds() : 0;
+            int done = i == num_records ? 1 : 0;
+            for (int id = 1; done && id < 4096; id++)
+                done = !inflight[id];
+            if (!blocked && (i < num_records ? wait <= 0 : done))
+                break;
+
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int ms = blocked || i == num_records ? -1 : (int)(wait * 1000) + 1;
+            if (poll(&pfd, 1, ms) > 0 && !read_replies(fd, buf, &len))
+            {
+                alive = false;
+                break;
+            }
+        }
+        if (i >= num_records || !alive)
+            break;
+
+        record *r = &records[i];
+        if (!replay_line(r, stand_in, line, sizeof(line)))
+        {
+            skipped++;
+            continue;
+        }
+        double lag = speed > 0 ? now_seconds() - start - r->at / speed : 0;
+        if (lag > max_lag)
+            max_lag = lag;
+
+        // send the line and read until its reply came
+        dprintf(fd, "run %s\n", line);
+        r->sent = now_seconds();
+        sent++;
+        awaiting = i;
+        while (alive && awaiting >= 0)
+            alive = read_replies(fd, buf, &len);
+        if (!alive)
+            break;
+        if (!r->bg && r->sent > 0)
+            blocking = i;
+    }
+    if (!alive)
+        fprintf(stderr, "wshreplay: the control server went away\n");
+    double wall = now_seconds() - start;
+    close(fd);
+    if (server > 0)
+    {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        unlink(socket_path);
+    }
+
+    // latency is what the shell adds on top of the command itself: submit to exit, minus the recorded run time
+    double *latency = malloc((num_records + 1) * sizeof(double));
+    double *excess = malloc((num_records + 1) * sizeof(double));
+    int n = 0, status_changed = 0;
+    for (int i = 0; i < num_records; i++)
+    {
+        record *r = &records[i];
+        if (r->sent == 0 || r->latency < 0)
+            continue;
+        latency[n] = r->latency;
+        excess[n] = r->latency - r->elapsed > 0 ? r->latency - r->elapsed : 0;
+        status_changed += r->status >= 0 && r->exit != r->status;
+        n++;
+    }
+    printf("%d lines: %d sent, %d skipped (builtins), %d refused, %d finished, %d with another status\n", num_records,
+           sent, skipped, refused, n, status_changed);
+    char speed_name[32];
+    snprintf(speed_name, sizeof(speed_name), speed > 0 ? "%gx" : "max", speed);
+    printf("wall %.3f s, %.1f lines/s at speed %s, latest submission %.3f ms behind schedule\n", wall,
+           wall > 0 ? n / wall : 0, speed_name, max_lag * 1e3);
+    print_percentiles("latency", latency, n);
+    print_percentiles("over recorded time", excess, n);
+    free(latency);
+    free(excess);
+    free(buf);
+    return 0;
+}